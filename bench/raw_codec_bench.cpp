@@ -0,0 +1,135 @@
+// Host benchmark for the raw timing codec (include/raw_codec.h)
+//
+// Reads raw timing arrays from any mix of definition files (commands.json,
+// migrate_commands.py pull output) and replay_traffic.py captures: every "data"
+// array is taken as one frame. Reports the encoded size against uint16_t arrays
+// and JSON text, and encode/decode time per edge. Every frame is round-tripped.
+//
+// Build and run:
+//   g++ -O2 -std=c++17 -Iinclude bench/raw_codec_bench.cpp -o raw_codec_bench
+//   ./raw_codec_bench commands.json traffic.jsonl
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "raw_codec.h"
+
+#define MAX_RAW_DATA 200   // As in src/main.cpp
+#define MAX_RAW_PACKED 320
+
+typedef std::vector<uint16_t> Frame;
+
+// Every "data":[...] array in the text, also inside escaped JSON strings
+static void collectFrames(const std::string& text, std::vector<Frame>& frames) {
+  size_t at = 0;
+  while ((at = text.find("data", at)) != std::string::npos) {
+    at += 4;
+    size_t p = at;
+    while (p < text.size() && strchr("\\\": ", text[p])) p++;
+    if (p >= text.size() || text[p] != '[') continue;
+    Frame frame;
+    const char* s = text.c_str() + p + 1;
+    while (*s && *s != ']') {
+      char* end;
+      long v = strtol(s, &end, 10);
+      if (end == s) break;
+      if (frame.size() < MAX_RAW_DATA) frame.push_back((uint16_t)v);
+      s = end;
+      while (*s == ',' || *s == ' ') s++;
+    }
+    if (!frame.empty()) frames.push_back(frame);
+    at = s - text.c_str();
+  }
+}
+
+static size_t jsonSize(const Frame& f) {
+  size_t n = 2;  // []
+  char buf[8];
+  for (size_t i = 0; i < f.size(); i++) n += snprintf(buf, sizeof(buf), i ? ",%u" : "%u", f[i]);
+  return n;
+}
+
+int main(int argc, char** argv) {
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s <definitions.json|capture.jsonl>...\n", argv[0]);
+    return 1;
+  }
+
+  std::vector<Frame> frames;
+  for (int i = 1; i < argc; i++) {
+    std::ifstream in(argv[i]);
+    if (!in) {
+      fprintf(stderr, "cannot read %s\n", argv[i]);
+      return 1;
+    }
+    std::stringstream ss;
+    ss << in.rdbuf();
+    collectFrames(ss.str(), frames);
+  }
+  if (frames.empty()) {
+    fprintf(stderr, "no raw timing arrays found\n");
+    return 1;
+  }
+
+  size_t edges = 0, rawBytes = 0, jsonBytes = 0, packedBytes = 0, b64Bytes = 0, maxPacked = 0, tooLong = 0;
+  std::vector<std::vector<uint8_t>> packed(frames.size());
+  for (size_t i = 0; i < frames.size(); i++) {
+    const Frame& f = frames[i];
+    uint8_t buf[RAW_CODEC_MAX_SIZE(MAX_RAW_DATA)];
+    size_t n = rawEncode(f.data(), f.size(), buf, sizeof(buf));
+    uint16_t back[MAX_RAW_DATA];
+    if (!rawDecode(buf, n, back, f.size()) || memcmp(back, f.data(), f.size() * 2) != 0) {
+      fprintf(stderr, "round trip failed on frame %zu\n", i);
+      return 1;
+    }
+    packed[i].assign(buf, buf + n);
+    edges += f.size();
+    rawBytes += f.size() * 2;
+    jsonBytes += jsonSize(f);
+    packedBytes += n;
+    b64Bytes += rawBase64Length(n);
+    if (n > maxPacked) maxPacked = n;
+    if (n > MAX_RAW_PACKED) tooLong++;
+  }
+
+  // Timing: enough passes over the corpus for ~10M edges
+  int passes = (int)(10000000 / edges) + 1;
+  uint16_t out[MAX_RAW_DATA];
+  uint8_t buf[RAW_CODEC_MAX_SIZE(MAX_RAW_DATA)];
+  volatile uint32_t sink = 0;
+
+  auto t0 = std::chrono::steady_clock::now();
+  for (int p = 0; p < passes; p++) {
+    for (size_t i = 0; i < frames.size(); i++) {
+      rawDecode(packed[i].data(), packed[i].size(), out, frames[i].size());
+      sink += out[0];
+    }
+  }
+  auto t1 = std::chrono::steady_clock::now();
+  for (int p = 0; p < passes; p++) {
+    for (size_t i = 0; i < frames.size(); i++) {
+      sink += rawEncode(frames[i].data(), frames[i].size(), buf, sizeof(buf));
+    }
+  }
+  auto t2 = std::chrono::steady_clock::now();
+  double decodeNs = std::chrono::duration<double, std::nano>(t1 - t0).count() / ((double)edges * passes);
+  double encodeNs = std::chrono::duration<double, std::nano>(t2 - t1).count() / ((double)edges * passes);
+
+  printf("Corpus:      %zu frames, %zu edges\n", frames.size(), edges);
+  printf("uint16_t:    %zu bytes (2.00 bytes/edge)\n", rawBytes);
+  printf("JSON array:  %zu bytes (%.2f bytes/edge)\n", jsonBytes, (double)jsonBytes / edges);
+  printf("Packed:      %zu bytes (%.2f bytes/edge, %.2fx vs uint16_t, largest frame %zu bytes)\n",
+    packedBytes, (double)packedBytes / edges, (double)rawBytes / packedBytes, maxPacked);
+  printf("Base64:      %zu bytes (%.2f bytes/edge, %.2fx vs JSON array)\n",
+    b64Bytes, (double)b64Bytes / edges, (double)jsonBytes / b64Bytes);
+  printf("Decode:      %.2f ns/edge (host)\n", decodeNs);
+  printf("Encode:      %.2f ns/edge (host)\n", encodeNs);
+  if (tooLong) printf("WARNING: %zu frames exceed MAX_RAW_PACKED (%d bytes)\n", tooLong, MAX_RAW_PACKED);
+  return sink == 0xFFFFFFFF;  // Keeps the loops from being optimized away
+}
@@ -0,0 +1,473 @@
+#!/usr/bin/env python3
+"""
+IR Blaster Catalogue Export/Import
+
+Backs up the device's whole command cache as one binary blob (the chunk format
+described under Bulk Transfer in src/main.cpp) and loads a blob back into the
+same or another device. Every chunk carries a CRC-32 and the end chunk a
+record count and CRC over the whole stream; both are checked here and on the
+device.
+
+Requirements:
+  pip install paho-mqtt
+
+Usage:
+  python3 catalog_blob.py export backup.irxb              # from device 1
+  python3 catalog_blob.py import backup.irxb --device 2   # cache only
+  python3 catalog_blob.py import backup.irxb --device 2 --publish
+  python3 catalog_blob.py show backup.irxb                # list records
+  python3 catalog_blob.py show backup.irxb --json         # as JSON definitions
+
+--publish makes the device republish imported device definitions to its
+commands/ topics (retained); without it, entries the broker does not hold are
+dropped at the device's next sync.
+
+Broker settings come from --host/--port/--user/--password or the MQTT_HOST,
+MQTT_PORT, MQTT_USER and MQTT_PASS environment variables.
+"""
+
+import argparse
+import base64
+import json
+import math
+import os
+import struct
+import sys
+import threading
+import time
+import zlib
+
+MAGIC = b"IRXB"
+VERSION = 5  # 2: packed raw timings, 3: carrier u16 + duty cycle, 4: burst profile, 5: channel
+HEADER = struct.Struct("<4sBBHHHI")  # magic, version, type, seq, count, flags, crc
+PAYLOAD_MAX = 1536
+BEGIN, DATA, END = 0, 1, 2
+FLAG_PUBLISH = 0x0001
+RECORD_RAW, RECORD_SHARED = 0x01, 0x02
+RANK_UNSET = 0xFE
+
+MAX_RAW_PACKED = 320
+FREQ_DEFAULT = 38  # kHz
+DUTY_DEFAULT = 30  # Percent
+MAX_BURST_RUNS = 6
+MAX_REPEAT_FRAME = 8
+GAP_UNIT_US = 50
+MAX_SEND_CHANNELS = 8
+
+TRANSFER_TIMEOUT_S = 60.0
+
+
+class BlobError(ValueError):
+    pass
+
+
+# ====== Format ======
+
+def pack_timings(data):
+    """Raw timings as the firmware stores them (include/raw_codec.h): a unit byte
+    (gcd of the durations, <= 255), then per edge a LEB128 varint of
+    zigzag(d / unit - ref) * 2 + r, ref being one of the last two distinct
+    durations of the same kind (mark/space), kept in move-to-front order"""
+    unit = 0
+    for d in data:
+        unit = math.gcd(unit, d)
+    if not 1 <= unit <= 255:
+        unit = 1
+    out = bytearray([unit])
+    refs = [[0, 0], [0, 0]]
+    for i, d in enumerate(data):
+        h = refs[i & 1]
+        d //= unit
+        r = 1 if abs(d - h[1]) < abs(d - h[0]) else 0
+        delta = d - h[r]
+        if r:
+            h[1] = h[0]
+        h[0] = d
+        v = ((delta << 1) ^ (delta >> 31)) << 1 | r
+        while True:
+            b = v & 0x7F
+            v >>= 7
+            out.append(b | 0x80 if v else b)
+            if not v:
+                break
+    return bytes(out)
+
+
+def unpack_timings(packed, count):
+    if not packed or packed[0] == 0:
+        raise BlobError("packed timings have no unit")
+    unit, pos = packed[0], 1
+    data, refs = [], [[0, 0], [0, 0]]
+    for i in range(count):
+        v, shift = 0, 0
+        while True:
+            if pos >= len(packed) or shift > 14:
+                raise BlobError("packed timings run short")
+            b = packed[pos]
+            pos += 1
+            v |= (b & 0x7F) << shift
+            shift += 7
+            if not b & 0x80:
+                break
+        h = refs[i & 1]
+        r, z = v & 1, v >> 1
+        d = h[r] + ((z >> 1) ^ -(z & 1))
+        if d < 0 or d * unit > 0xFFFF:
+            raise BlobError("packed timings out of range")
+        if r:
+            h[1] = h[0]
+        h[0] = d
+        data.append(d * unit)
+    if pos != len(packed):
+        raise BlobError("packed timings have bytes left over")
+    return data
+
+
+def timings(definition):
+    """Raw timings of a definition in either form ("data" or "len" + "packed")"""
+    if "packed" in definition:
+        return unpack_timings(base64.b64decode(definition["packed"]), definition.get("len", 0))
+    return list(definition.get("data", []))
+
+
+def packed_definition(definition):
+    """A raw definition with its timings in the packed form, as the device learns them"""
+    if not definition.get("raw"):
+        return definition
+    data = timings(definition)
+    out = {k: v for k, v in definition.items() if k not in ("data", "len", "packed")}
+    out.update(len=len(data), packed=base64.b64encode(pack_timings(data)).decode("ascii"))
+    return out
+
+
+def bursts(definition):
+    """Burst profile [[gap us, count, repeat frame], ...] of a definition, derived from
+    repeatCount/repeatInterval when it has none (as the firmware does)"""
+    if "bursts" in definition:
+        return [[run[0], run[1], 1 if run[2:3] and run[2] else 0] for run in definition["bursts"]]
+    count = definition.get("repeatCount", 0)
+    return [[min(definition.get("repeatInterval", 0) * 1000, 0xFFFF * GAP_UNIT_US), count, 0]] if count else []
+
+
+def encode_record(rec):
+    """rec: dict with name, shared, version, rank and the definition fields
+    (proto/addr/cmd/rpt or raw/freq/duty with data or len/packed and repeatFrame, plus
+    repeatCount/repeatInterval/bursts and channel)"""
+    name = rec["name"].encode("utf-8")
+    raw = bool(rec.get("raw"))
+    flags = (RECORD_RAW if raw else 0) | (RECORD_SHARED if rec.get("shared") else 0)
+    out = bytearray(struct.pack("<B", len(name)) + name)
+    runs = bursts(rec)
+    if len(runs) > MAX_BURST_RUNS:
+        raise BlobError(f"{rec['name']}: {len(runs)} burst runs (max {MAX_BURST_RUNS})")
+    if not 0 <= rec.get("channel", 0) < MAX_SEND_CHANNELS:
+        raise BlobError(f"{rec['name']}: channel {rec['channel']} (max {MAX_SEND_CHANNELS - 1})")
+    out += struct.pack("<BIBHBBB", flags, rec.get("version", 0), sum(r[1] for r in runs),
+                       rec.get("repeatInterval", 0), rec.get("rank", RANK_UNSET), rec.get("channel", 0), len(runs))
+    for gap, count, frame in runs:
+        out += struct.pack("<HBB", gap // GAP_UNIT_US, count, frame)
+    if raw:
+        data = timings(rec)
+        packed = pack_timings(data)
+        if len(packed) > MAX_RAW_PACKED:
+            raise BlobError(f"{rec['name']}: timings pack to {len(packed)} bytes (max {MAX_RAW_PACKED})")
+        out += struct.pack("<HBHH", rec.get("freq", FREQ_DEFAULT), rec.get("duty", DUTY_DEFAULT),
+                           len(data), len(packed)) + packed
+        repeat = rec.get("repeatFrame", [])
+        if len(repeat) > MAX_REPEAT_FRAME:
+            raise BlobError(f"{rec['name']}: repeat frame of {len(repeat)} values (max {MAX_REPEAT_FRAME})")
+        out += struct.pack(f"<B{len(repeat)}H", len(repeat), *repeat)
+    else:
+        proto = rec.get("proto", "NEC").encode("ascii")
+        out += struct.pack("<B", len(proto)) + proto
+        out += struct.pack("<HHB", rec.get("addr", 0), rec.get("cmd", 0), rec.get("rpt", 0))
+    return bytes(out)
+
+
+def decode_record(buf, pos):
+    (n,) = struct.unpack_from("<B", buf, pos)
+    name = buf[pos + 1:pos + 1 + n].decode("utf-8")
+    pos += 1 + n
+    flags, version, repeat_count, repeat_interval, rank, channel, runs = struct.unpack_from("<BIBHBBB", buf, pos)
+    pos += 11
+    rec = {"name": name, "shared": bool(flags & RECORD_SHARED), "version": version,
+           "rank": rank, "repeatCount": repeat_count, "repeatInterval": repeat_interval}
+    if channel:
+        rec["channel"] = channel
+    if runs:
+        rec["bursts"] = []
+        for _ in range(runs):
+            gap, count, frame = struct.unpack_from("<HBB", buf, pos)
+            rec["bursts"].append([gap * GAP_UNIT_US, count, frame])
+            pos += 4
+    if flags & RECORD_RAW:
+        freq, duty, length, packed_len = struct.unpack_from("<HBHH", buf, pos)
+        pos += 7
+        packed = bytes(buf[pos:pos + packed_len])
+        rec.update(raw=True, freq=freq, len=length, packed=base64.b64encode(packed).decode("ascii"))
+        if duty != DUTY_DEFAULT:
+            rec["duty"] = duty
+        pos += packed_len
+        (n,) = struct.unpack_from("<B", buf, pos)
+        if n:
+            rec["repeatFrame"] = list(struct.unpack_from(f"<{n}H", buf, pos + 1))
+        pos += 1 + 2 * n
+    else:
+        (n,) = struct.unpack_from("<B", buf, pos)
+        proto = buf[pos + 1:pos + 1 + n].decode("ascii")
+        pos += 1 + n
+        addr, cmd, rpt = struct.unpack_from("<HHB", buf, pos)
+        pos += 5
+        rec.update(proto=proto, addr=addr, cmd=cmd, rpt=rpt)
+    return rec, pos
+
+
+def definition(rec):
+    """The JSON definition the device takes on commands/<name>"""
+    keys = ("raw", "freq", "duty", "len", "packed", "repeatFrame") if rec.get("raw") else ("proto", "addr", "cmd", "rpt")
+    out = {k: rec[k] for k in keys if k in rec}
+    out["repeatCount"] = rec.get("repeatCount", 0)
+    out["repeatInterval"] = rec.get("repeatInterval", 0)
+    if "bursts" in rec:
+        out["bursts"] = rec["bursts"]
+    if rec.get("channel"):
+        out["channel"] = rec["channel"]
+    return out
+
+
+def make_chunk(chunk_type, seq, payload, count=0, flags=0):
+    return HEADER.pack(MAGIC, VERSION, chunk_type, seq, count, flags, zlib.crc32(payload)) + payload
+
+
+def build_blob(source, records, flags=0):
+    """List of chunks (bytes) for records, packed like the device's export"""
+    src = source.encode("utf-8")
+    chunks = [make_chunk(BEGIN, 0, struct.pack("<B", len(src)) + src + struct.pack("<H", len(records)),
+                         flags=flags)]
+    stream_crc = 0
+    payload, count = b"", 0
+
+    def flush():
+        nonlocal payload, count, stream_crc
+        if count:
+            stream_crc = zlib.crc32(payload, stream_crc)
+            chunks.append(make_chunk(DATA, len(chunks), payload, count))
+        payload, count = b"", 0
+
+    for rec in records:
+        encoded = encode_record(rec)
+        if len(payload) + len(encoded) > PAYLOAD_MAX:
+            flush()
+        payload += encoded
+        count += 1
+    flush()
+    chunks.append(make_chunk(END, len(chunks), struct.pack("<II", len(records), stream_crc)))
+    return chunks
+
+
+def split_chunks(data):
+    """Split a concatenated blob into its chunks"""
+    chunks, pos = [], 0
+    while pos < len(data):
+        if pos + HEADER.size > len(data) or data[pos:pos + 4] != MAGIC:
+            raise BlobError(f"bad chunk header at byte {pos}")
+        _, version, chunk_type, _, count, _, _ = HEADER.unpack_from(data, pos)
+        if version != VERSION:
+            raise BlobError(f"unsupported format version {version}")
+        end = pos + HEADER.size
+        if chunk_type == BEGIN:
+            end += data[end] + 3
+        elif chunk_type == END:
+            end += 8
+        else:
+            for _ in range(count):
+                _, end = decode_record(data, end)
+        chunks.append(data[pos:end])
+        pos = end
+    return chunks
+
+
+def parse_blob(chunks):
+    """(source device id, records) after checking sequence and checksums"""
+    source, records, stream_crc = None, [], 0
+    for i, chunk in enumerate(chunks):
+        _, _, chunk_type, seq, count, _, crc = HEADER.unpack_from(chunk, 0)
+        payload = chunk[HEADER.size:]
+        if seq != i:
+            raise BlobError(f"chunk {i}: sequence number {seq}")
+        if zlib.crc32(payload) != crc:
+            raise BlobError(f"chunk {i}: CRC mismatch")
+        if chunk_type == BEGIN:
+            source = payload[1:1 + payload[0]].decode("utf-8")
+        elif chunk_type == DATA:
+            stream_crc = zlib.crc32(payload, stream_crc)
+            pos = 0
+            for _ in range(count):
+                rec, pos = decode_record(payload, pos)
+                records.append(rec)
+        else:
+            total, crc_all = struct.unpack_from("<II", payload, 0)
+            if total != len(records) or crc_all != stream_crc:
+                raise BlobError("stream checksum mismatch")
+            return source, records
+    raise BlobError("blob has no end chunk (truncated?)")
+
+
+def with_flags(chunk, flags):
+    """Same chunk with new header flags (the CRC only covers the payload)"""
+    return chunk[:10] + struct.pack("<H", flags) + chunk[12:]
+
+
+# ====== MQTT ======
+
+def make_client(client_id):
+    import paho.mqtt.client as mqtt
+    # paho-mqtt 2.x requires the callback API version, 1.x does not know it
+    try:
+        return mqtt.Client(mqtt.CallbackAPIVersion.VERSION1, client_id=client_id)
+    except AttributeError:
+        return mqtt.Client(client_id=client_id)
+
+
+def connect(args, client_id):
+    client = make_client(client_id)
+    if args.user:
+        client.username_pw_set(args.user, args.password)
+    client.connect(args.host, args.port, 60)
+    client.loop_start()
+    return client
+
+
+def export(args):
+    base = f"home/ir/{args.device}/"
+    chunks = []
+    done = threading.Event()
+    error = []
+
+    def on_message(client, userdata, msg):
+        if msg.topic == base + "state":
+            state = msg.payload.decode("utf-8", "replace")
+            if state == "ERR:BUSY":
+                error.append("device busy")
+                done.set()
+            return
+        if msg.payload[5] == BEGIN:
+            chunks.clear()
+        chunks.append(bytes(msg.payload))
+        if msg.payload[5] == END:
+            done.set()
+
+    client = connect(args, "ir_catalog_export")
+    client.on_message = on_message
+    client.subscribe(base + "export/data", qos=0)
+    client.subscribe(base + "state", qos=0)
+    time.sleep(0.5)
+
+    start = time.monotonic()
+    client.publish(base + "export", b"", qos=1)
+    if not done.wait(TRANSFER_TIMEOUT_S):
+        error.append("timed out")
+    elapsed = time.monotonic() - start
+    client.loop_stop()
+    client.disconnect()
+    if error:
+        print(f"✗ Export failed: {error[0]}")
+        return 1
+
+    source, records = parse_blob(chunks)
+    size = sum(len(c) for c in chunks)
+    with open(args.file, "wb") as f:
+        for chunk in chunks:
+            f.write(chunk)
+    print(f"✓ Exported {len(records)} commands from device {source}: {size} bytes in "
+          f"{len(chunks)} chunks, {elapsed:.2f}s ({size / max(elapsed, 1e-6) / 1024:.1f} KiB/s)")
+    return 0
+
+
+def import_blob(args):
+    with open(args.file, "rb") as f:
+        chunks = split_chunks(f.read())
+    source, records = parse_blob(chunks)
+    if args.publish:
+        chunks[0] = with_flags(chunks[0], FLAG_PUBLISH)
+
+    base = f"home/ir/{args.device}/"
+    done = threading.Event()
+    result = []
+
+    def on_message(client, userdata, msg):
+        state = msg.payload.decode("utf-8", "replace")
+        if state.startswith("import:done") or state.startswith("ERR:IMPORT") or state == "ERR:BUSY":
+            result.append(state)
+            done.set()
+
+    client = connect(args, "ir_catalog_import")
+    client.on_message = on_message
+    client.subscribe(base + "state", qos=0)
+    time.sleep(0.5)
+
+    start = time.monotonic()
+    for chunk in chunks:
+        client.publish(base + "import", chunk, qos=1)
+    if not done.wait(TRANSFER_TIMEOUT_S):
+        result.append("timed out")
+    elapsed = time.monotonic() - start
+    client.loop_stop()
+    client.disconnect()
+
+    if not result[0].startswith("import:done"):
+        print(f"✗ Import failed: {result[0]}")
+        return 1
+    print(f"✓ Imported {len(records)} commands (exported by device {source}) into device "
+          f"{args.device} in {elapsed:.2f}s: {result[0]}")
+    return 0
+
+
+def show(args):
+    with open(args.file, "rb") as f:
+        source, records = parse_blob(split_chunks(f.read()))
+    if args.json:
+        json.dump({r["name"]: definition(r) for r in records}, sys.stdout, indent=2)
+        print()
+        return 0
+    print(f"Exported by device {source}, {len(records)} commands:")
+    for r in records:
+        kind = f"raw {r['len']} @ {r['freq']}kHz/{r.get('duty', DUTY_DEFAULT)}%" if r.get("raw") else \
+            f"{r['proto']} addr={r['addr']} cmd={r['cmd']}"
+        channel = f" ch{r['channel']}" if r.get("channel") else ""
+        print(f"  {r['name']:32} {'shared ' if r['shared'] else ''}{kind}{channel} v={r['version']:08x}")
+    return 0
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Export and import the IR blaster command cache")
+    parser.add_argument("--host", default=os.environ.get("MQTT_HOST", "homeassistant.local"))
+    parser.add_argument("--port", type=int, default=int(os.environ.get("MQTT_PORT", "1883")))
+    parser.add_argument("--user", default=os.environ.get("MQTT_USER"))
+    parser.add_argument("--password", default=os.environ.get("MQTT_PASS"))
+    sub = parser.add_subparsers(dest="mode", required=True)
+
+    exp = sub.add_parser("export", help="Save a device's command cache to a blob file")
+    exp.add_argument("file")
+    exp.add_argument("--device", default="1")
+
+    imp = sub.add_parser("import", help="Load a blob file into a device")
+    imp.add_argument("file")
+    imp.add_argument("--device", default="1")
+    imp.add_argument("--publish", action="store_true",
+                     help="Device republishes imported definitions to the broker (retained)")
+
+    sh = sub.add_parser("show", help="List the commands in a blob file")
+    sh.add_argument("file")
+    sh.add_argument("--json", action="store_true", help="Print JSON definitions")
+
+    args = parser.parse_args()
+    try:
+        return {"export": export, "import": import_blob, "show": show}[args.mode](args)
+    except BlobError as e:
+        print(f"✗ Invalid blob: {e}")
+        return 1
+
+
+if __name__ == "__main__":
+    exit(main())
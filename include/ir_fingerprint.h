@@ -0,0 +1,122 @@
+// Frame fingerprints
+//
+// 32-bit keys of received frames and stored commands for the recognition index (see
+// Recognition Index in src/main.cpp): known protocols by protocol, address and
+// command, raw frames by the shape of their timings, so receiver jitter does not
+// change the key. 0 is reserved for "no fingerprint".
+//
+// Raw frames: marks and spaces are classed separately, as a receiver stretches one and
+// shortens the other by up to ~100 us. Each kind's durations are sorted and split
+// into classes at the steps between a remote's widths: a class starts above a step
+// of a third (and at least RAW_CLASS_STEP_US), and a class holding under an eighth of
+// the durations only above a step of 1.6x. So class edges fall where the frame has
+// no durations rather than at fixed ratios, and a duration only changes class when
+// jitter closes a gap; a 220 us outlier among 430 us spaces stays with them. The
+// unit class is the shortest one holding an eighth of the durations, and classes are
+// keyed by rank from it: 1 for the unit (and shorter glitches), 2 for the next width
+// and so on. Ranks rather than nearest multiples of the unit: mark/space distortion
+// moves a remote with a 1:2.7 ratio, like fan_power in commands.json, across the
+// 2.5x rounding boundary. Frame length is part of the key as well.
+//
+// Header-only and free of Arduino dependencies, so the native tests in test/ check
+// the keys the firmware computes.
+#pragma once
+
+#include <ctype.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define RAW_FP_MAX 256         // Durations that set the classes, half of each kind; later ones are only classed
+#define RAW_CLASS_MAX 16
+#define RAW_CLASS_STEP_DIV 3   // A class starts above a step of 1/3 of the duration...
+#define RAW_CLASS_STEP_US 150  // ...and of three receiver ticks
+
+static inline uint32_t fnv1a(uint32_t h, const void* data, size_t len) {
+  const uint8_t* p = (const uint8_t*)data;
+  for (size_t i = 0; i < len; i++) {
+    h ^= p[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+// Known protocols: hash of protocol name (case-insensitive), address and command
+static inline uint32_t protocolFingerprint(const char* proto, uint16_t addr, uint16_t cmd) {
+  uint32_t h = 2166136261u;
+  uint8_t tag = 'P';
+  h = fnv1a(h, &tag, 1);
+  for (const char* c = proto; *c; c++) {
+    char lower = tolower(*c);
+    h = fnv1a(h, &lower, 1);
+  }
+  h = fnv1a(h, &addr, sizeof(addr));
+  h = fnv1a(h, &cmd, sizeof(cmd));
+  return h ? h : 1;
+}
+
+// Classes of the marks (kind 0) or spaces (kind 1) of a raw frame
+struct RawClasses {
+  uint16_t start[RAW_CLASS_MAX];  // Shortest duration of each class
+  uint8_t count;
+  uint8_t unit;
+};
+
+static inline void rawClasses(const uint16_t* data, uint16_t len, uint8_t kind, RawClasses& out) {
+  uint16_t sorted[RAW_FP_MAX / 2];
+  uint16_t n = 0;
+  for (uint16_t i = kind; i < len && n < RAW_FP_MAX / 2; i += 2) {
+    if (data[i] == 0) continue;
+    uint16_t j = n++;
+    for (; j > 0 && sorted[j - 1] > data[i]; j--) sorted[j] = sorted[j - 1];
+    sorted[j] = data[i];
+  }
+
+  // Steps between widths, then the classes they start (a small class only behind a 1.6x step)
+  uint16_t first[RAW_CLASS_MAX + 1];  // Index in sorted of each class's shortest duration
+  uint16_t steps[RAW_FP_MAX / 2];     // Where a step starts a class
+  uint16_t stepCount = 0;
+  for (uint16_t i = 1; i < n; i++) {
+    uint16_t step = sorted[i - 1] / RAW_CLASS_STEP_DIV;
+    if (step < RAW_CLASS_STEP_US) step = RAW_CLASS_STEP_US;
+    if (sorted[i] - sorted[i - 1] > step) steps[stepCount++] = i;
+  }
+  out.count = 0;
+  for (uint16_t j = 0; j <= stepCount && n > 0; j++) {
+    uint16_t at = j ? steps[j - 1] : 0;
+    uint16_t end = j < stepCount ? steps[j] : n;
+    bool wide = j == 0 || (uint32_t)sorted[at] * 5 >= (uint32_t)sorted[at - 1] * 8;
+    bool small = out.count > 0 && ((end - at) * 8 < n || (at - first[out.count - 1]) * 8 < n);
+    if (out.count == 0 || ((wide || !small) && out.count < RAW_CLASS_MAX)) {
+      out.start[out.count] = sorted[at];
+      first[out.count++] = at;
+    }
+  }
+  first[out.count] = n;
+
+  out.unit = 0;
+  while (out.unit < out.count && (first[out.unit + 1] - first[out.unit]) * 8 < n) out.unit++;
+  if (out.unit == out.count) out.unit = 0;  // No class that large: the shortest
+}
+
+static inline uint8_t rawClassKey(const RawClasses& k, uint16_t d) {
+  if (d == 0) return 0;
+  uint8_t c = 0;
+  while (c + 1 < k.count && d >= k.start[c + 1]) c++;
+  return c > k.unit ? c - k.unit + 1 : 1;
+}
+
+static inline uint32_t rawFingerprint(const uint16_t* data, uint16_t len) {
+  RawClasses kinds[2];
+  rawClasses(data, len, 0, kinds[0]);
+  rawClasses(data, len, 1, kinds[1]);
+
+  uint32_t h = 2166136261u;
+  uint8_t tag = 'R';
+  h = fnv1a(h, &tag, 1);
+  h = fnv1a(h, &len, sizeof(len));
+  for (uint16_t i = 0; i < len; i++) {
+    uint8_t k = rawClassKey(kinds[i & 1], data[i]);
+    h = fnv1a(h, &k, 1);
+  }
+  return h ? h : 1;
+}
@@ -0,0 +1,276 @@
+// IR frame rendering
+//
+// Protocol encoders: IRremote's encoders bit-bang a single pin, so the emitter
+// channels render protocol frames here into marks and spaces (even index = mark, us)
+// with IRremote's timings and bit layouts, and send them like raw timings. Pulse
+// distance/width protocols come from PULSE_CODINGS; RC5 and RC6 are Manchester coded.
+//
+// Chunks: a send goes out as chunks of RMT items (two levels each), its frames and
+// the gaps between them rendered as many bursts as fit (see Emitter Channels in
+// src/main.cpp). IrItem has the layout of the ESP32's rmt_item32_t.
+//
+// Header-only and free of Arduino dependencies, so the native tests in test/ check
+// the same edges the firmware puts on the air.
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <strings.h>
+
+enum class Proto : uint8_t { Samsung, NEC, LG, Sony12, JVC, RC5, RC6, Panasonic };
+
+// Parse protocol string to Proto enum
+static inline Proto parseProto(const char* protoStr) {
+  if (strcasecmp(protoStr, "Samsung") == 0) return Proto::Samsung;
+  if (strcasecmp(protoStr, "NEC") == 0) return Proto::NEC;
+  if (strcasecmp(protoStr, "LG") == 0) return Proto::LG;
+  if (strcasecmp(protoStr, "Sony12") == 0) return Proto::Sony12;
+  if (strcasecmp(protoStr, "JVC") == 0) return Proto::JVC;
+  if (strcasecmp(protoStr, "RC5") == 0) return Proto::RC5;
+  if (strcasecmp(protoStr, "RC6") == 0) return Proto::RC6;
+  if (strcasecmp(protoStr, "Panasonic") == 0) return Proto::Panasonic;
+  return Proto::NEC;  // default
+}
+
+// ====== Protocol Encoders ======
+struct PulseCoding {
+  Proto proto;
+  uint8_t kHz;
+  uint16_t headerMark, headerSpace;
+  uint16_t oneMark, oneSpace, zeroMark, zeroSpace;
+  uint8_t bits;
+  bool msbFirst;
+  bool stopBit;          // Trailing bit mark
+  uint16_t repeatSpace;  // Header space of the repeat code, 0 = repeats resend the frame, or its data
+  uint8_t repeatBits;    // Zero bits in the repeat code
+  bool repeatHeaderless; // Repeats are the data bits without the header (JVC)
+};
+
+static const PulseCoding PULSE_CODINGS[] = {
+  // proto            kHz  header       one          zero        bits msb    stop   repeat
+  { Proto::NEC,       38,  8960, 4480,  560, 1680,   560, 560,   32, false,  true,  2240, 0, false },
+  { Proto::Samsung,   38,  4424, 4424,  553, 1659,   553, 553,   32, false,  true,  4424, 1, false },
+  { Proto::LG,        38,  9000, 4200,  500, 1580,   500, 550,   28, true,   true,  2000, 0, false },
+  { Proto::JVC,       38,  8400, 4200,  526, 1578,   526, 526,   16, false,  true,  0,    0, true },
+  { Proto::Sony12,    40,  2400, 600,   1200, 600,   600, 600,   12, false,  false, 0,    0, false },
+  { Proto::Panasonic, 37,  3456, 1728,  432, 1296,   432, 432,   48, false,  true,  0,    0, false },
+};
+
+#define RC5_UNIT 889
+#define RC6_UNIT 444
+#define RC_KHZ 36
+
+// Data word of a pulse coded frame, laid out as IRremote's send functions do
+static inline uint64_t pulseData(Proto proto, uint16_t addr, uint8_t command) {
+  switch (proto) {
+    case Proto::NEC:
+    case Proto::Samsung: {
+      // 8-bit addresses go out with their complement (NEC) or twice (Samsung)
+      uint16_t a = addr > 0xFF ? addr : proto == Proto::NEC ? addr | (uint8_t)~addr << 8 : addr | addr << 8;
+      return a | (uint32_t)command << 16 | (uint32_t)(uint8_t)~command << 24;
+    }
+    case Proto::LG: {
+      uint8_t sum = (command & 0xF) + (command >> 4);
+      return (uint32_t)(addr & 0xFF) << 20 | (uint32_t)command << 4 | (sum & 0xF);
+    }
+    case Proto::JVC:
+      return (addr & 0xFF) | command << 8;
+    case Proto::Sony12:
+      return (uint32_t)(addr & 0x1F) << 7 | (command & 0x7F);
+    case Proto::Panasonic: {
+      // Kaseikyo: vendor 0x2002, vendor parity nibble, 12-bit address, command, parity
+      const uint16_t vendor = 0x2002;
+      uint8_t parity = (uint8_t)(vendor ^ (vendor >> 8));
+      parity = (parity ^ (parity >> 4)) & 0xF;
+      uint16_t low = (addr & 0xFFF) << 4 | parity;
+      uint8_t check = command ^ (low & 0xFF) ^ (low >> 8);
+      return vendor | (uint64_t)low << 16 | (uint64_t)command << 32 | (uint64_t)check << 40;
+    }
+    default:
+      return 0;
+  }
+}
+
+// Appends a Manchester half bit, merging it with the previous one of the same level
+static inline void halfBit(uint16_t* out, uint16_t& n, bool mark, uint16_t us) {
+  if (n == 0 && !mark) return;  // Leading silence
+  if (n > 0 && ((n - 1) & 1) == !mark) out[n - 1] += us;
+  else out[n++] = us;
+}
+
+// RC5: start bit, field bit (inverted command bit 6), toggle, 5 address and 6 command
+// bits, 1 = space then mark. RC6 mode 0: leader, start bit, 3 mode bits, double-width
+// toggle, 8 address and 8 command bits, 1 = mark then space. Toggle stays 0.
+static inline uint16_t encodeManchester(Proto proto, uint16_t addr, uint8_t command, uint16_t* out) {
+  uint16_t n = 0;
+  if (proto == Proto::RC5) {
+    uint16_t data = 1 << 13 | (command < 0x40) << 12 | (addr & 0x1F) << 6 | (command & 0x3F);
+    for (int8_t i = 13; i >= 0; i--) {
+      bool one = data >> i & 1;
+      halfBit(out, n, !one, RC5_UNIT);
+      halfBit(out, n, one, RC5_UNIT);
+    }
+  } else {
+    out[n++] = 6 * RC6_UNIT;
+    out[n++] = 2 * RC6_UNIT;
+    halfBit(out, n, true, RC6_UNIT);  // Start bit
+    halfBit(out, n, false, RC6_UNIT);
+    uint32_t data = (uint32_t)(addr & 0xFF) << 8 | command;
+    for (int8_t i = 19; i >= 0; i--) {
+      bool one = data >> i & 1;
+      uint16_t width = i == 16 ? 2 * RC6_UNIT : RC6_UNIT;
+      halfBit(out, n, one, width);
+      halfBit(out, n, !one, width);
+    }
+  }
+  if ((n & 1) == 0) n--;  // Ends on a mark; the trailing space is part of the gap
+  return n;
+}
+
+// One frame (or repeat frame) of a protocol command into out, 0 if the protocol has
+// no encoder. The repeat frame is the protocol's repeat code, the data without the
+// header (JVC), or the full frame for protocols that repeat by resending it.
+static inline uint16_t encodeFrame(Proto proto, uint16_t addr, uint8_t command, bool repeatFrame, uint16_t* out, uint16_t* kHz) {
+  if (proto == Proto::RC5 || proto == Proto::RC6) {
+    *kHz = RC_KHZ;
+    return encodeManchester(proto, addr, command, out);
+  }
+
+  for (const PulseCoding& p : PULSE_CODINGS) {
+    if (p.proto != proto) continue;
+    *kHz = p.kHz;
+    bool repeat = repeatFrame && p.repeatSpace;
+    uint8_t bits = repeat ? p.repeatBits : p.bits;
+    uint64_t data = repeat ? 0 : pulseData(proto, addr, command);
+    uint16_t n = 0;
+    if (!(repeatFrame && p.repeatHeaderless)) {
+      out[n++] = p.headerMark;
+      out[n++] = repeat ? p.repeatSpace : p.headerSpace;
+    }
+    for (uint8_t i = 0; i < bits; i++) {
+      bool one = data >> (p.msbFirst ? bits - 1 - i : i) & 1;
+      out[n++] = one ? p.oneMark : p.zeroMark;
+      out[n++] = one ? p.oneSpace : p.zeroSpace;
+    }
+    if (p.stopBit) out[n++] = p.oneMark;
+    else n--;  // Ends on the last bit's mark
+    return n;
+  }
+  return 0;
+}
+
+// ====== Chunks ======
+#define IR_CHUNK_ITEMS 256    // RMT items (two levels each) per chunk: 1 KB per channel
+#define IR_LEVEL_MAX 32767    // Ticks (us) in one item level
+
+struct IrItem {
+  uint32_t duration0 : 15;
+  uint32_t level0 : 1;
+  uint32_t duration1 : 15;
+  uint32_t level1 : 1;
+};
+
+struct IrChunk {
+  uint16_t itemCount;
+  bool half;                  // items[itemCount] has its first level filled
+  IrItem items[IR_CHUNK_ITEMS];
+};
+
+// A send's progress through its bursts, kept from one chunk to the next
+struct IrBurstState {
+  bool pending;               // A burst is left to render...
+  bool pendingRepeat;         // ...of this kind...
+  uint32_t pendingGapUs;      // ...after this much of its gap that did not fit the last chunk
+  uint16_t burst;             // Bursts rendered
+  uint32_t airtime;           // us
+  uint32_t lastFrameUs;
+};
+
+// Append a level held for us to the chunk; returns the part that did not fit
+static inline uint32_t itemPush(IrChunk& c, bool mark, uint32_t us) {
+  while (us > 0) {
+    if (!c.half && c.itemCount >= IR_CHUNK_ITEMS) return us;
+    uint16_t d = us > IR_LEVEL_MAX ? IR_LEVEL_MAX : us;
+    IrItem& item = c.items[c.itemCount];
+    if (!c.half) {
+      item.duration0 = d;
+      item.level0 = mark;
+      item.duration1 = 0;  // A zero second level ends the chunk if nothing follows
+      item.level1 = 0;
+    } else {
+      item.duration1 = d;
+      item.level1 = mark;
+      c.itemCount++;
+    }
+    c.half = !c.half;
+    us -= d;
+  }
+  return 0;
+}
+
+static inline bool frameFits(const IrChunk& c, const uint16_t* frame, uint16_t len) {
+  uint32_t levels = 0;
+  for (uint16_t i = 0; i < len; i++) levels += (frame[i] + IR_LEVEL_MAX - 1) / IR_LEVEL_MAX;
+  return levels <= (uint32_t)(IR_CHUNK_ITEMS - c.itemCount) * 2 - c.half;
+}
+
+// Returns the frame's airtime in us
+static inline uint32_t framePush(IrChunk& c, const uint16_t* frame, uint16_t len) {
+  uint32_t us = 0;
+  for (uint16_t i = 0; i < len; i++) {
+    itemPush(c, !(i & 1), frame[i]);  // Even values are marks
+    us += frame[i];
+  }
+  return us;
+}
+
+static inline void chunkClear(IrChunk& c) {
+  c.itemCount = 0;
+  c.half = false;
+}
+
+enum IrRender : uint8_t {
+  IR_RENDERED,         // The chunk is ready to write
+  IR_RENDER_DONE,      // Nothing left to send
+  IR_RENDER_NO_FRAME,  // The frame cannot be encoded
+  IR_RENDER_TOO_LONG,  // The frame does not fit a chunk
+};
+
+// Render a send's next chunk: the rest of a gap that did not fit the last one, then
+// bursts and the gaps after them while they fit (one burst for a hold, so a release
+// takes effect at the next frame). src supplies the send:
+//   const uint16_t* frame(bool repeatFrame, uint16_t* len)   nullptr if it cannot be sent
+//   bool next(uint32_t lastFrameUs, uint32_t* gapUs, bool* repeatFrame)
+//                                     gap before the next burst, false once none is left
+//   void started(uint16_t burst)      as each burst goes into the chunk
+template <typename Source>
+static inline IrRender renderChunk(IrChunk& c, IrBurstState& s, Source& src, bool hold) {
+  chunkClear(c);
+  if (!s.pending) return IR_RENDER_DONE;
+  s.pendingGapUs = itemPush(c, false, s.pendingGapUs);
+
+  bool first = true;
+  while (s.pending && s.pendingGapUs == 0) {
+    uint16_t len;
+    const uint16_t* frame = src.frame(s.pendingRepeat, &len);
+    if (!frame) return IR_RENDER_NO_FRAME;
+    if (!frameFits(c, frame, len)) {
+      if (!first) break;
+      return IR_RENDER_TOO_LONG;
+    }
+    src.started(s.burst);
+    s.lastFrameUs = framePush(c, frame, len);
+    s.airtime += s.lastFrameUs;
+    s.burst++;
+    first = false;
+
+    uint32_t gap;
+    bool repeatFrame;
+    s.pending = src.next(s.lastFrameUs, &gap, &repeatFrame);
+    if (!s.pending) break;
+    s.pendingRepeat = repeatFrame;
+    s.pendingGapUs = itemPush(c, false, gap);
+    if (hold) break;
+  }
+  return IR_RENDERED;
+}
@@ -0,0 +1,142 @@
+// Raw timing codec
+//
+// IR frames alternate mark and space, and each kind switches between a couple of
+// widths (e.g. 430/1220 us spaces for 0/1 bits) with a little jitter. Encoding:
+//   unit u8    greatest common divisor of the durations (<= 255, else 1); a
+//              receiver with 50 us ticks makes every duration a multiple of 50
+//   per edge   LEB128 varint of zigzag(d / unit - ref) * 2 + r, where ref is one
+//              of the last two distinct durations of the same kind (mark/space),
+//              r says which, and the pair is kept in move-to-front order
+// Jitter of up to 31 units fits one byte, so real captures come out at 1.0-1.3
+// bytes per edge, against 2 for uint16_t arrays and ~5 for JSON. The encoding is
+// lossless; at most 3 bytes per edge plus the unit byte.
+//
+// Header-only and free of Arduino dependencies, so the host benchmark in bench/
+// runs the same code as the firmware.
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define RAW_CODEC_MAX_BYTES_PER_EDGE 3
+#define RAW_CODEC_MAX_SIZE(edges) (1 + (size_t)(edges) * RAW_CODEC_MAX_BYTES_PER_EDGE)
+
+static inline uint32_t rawZigzag(int32_t v) { return ((uint32_t)v << 1) ^ (uint32_t)(v >> 31); }
+static inline int32_t rawUnzigzag(uint32_t v) { return (int32_t)(v >> 1) ^ -(int32_t)(v & 1); }
+
+static inline uint8_t rawUnit(const uint16_t* in, uint16_t n) {
+  uint32_t g = 0;
+  for (uint16_t i = 0; i < n && g != 1; i++) {
+    uint32_t a = in[i], b = g;
+    while (b) {
+      uint32_t t = a % b;
+      a = b;
+      b = t;
+    }
+    g = a;
+  }
+  return g >= 1 && g <= 255 ? g : 1;
+}
+
+// Encode n durations into out. Returns the encoded size, or 0 if it exceeds cap.
+static inline size_t rawEncode(const uint16_t* in, uint16_t n, uint8_t* out, size_t cap) {
+  if (cap < 1) return 0;
+  uint8_t unit = rawUnit(in, n);
+  out[0] = unit;
+  size_t pos = 1;
+  int32_t ref[2][2] = { { 0, 0 }, { 0, 0 } };  // [mark/space][most recent first]
+  for (uint16_t i = 0; i < n; i++) {
+    int32_t* h = ref[i & 1];
+    int32_t d = in[i] / unit;
+    int32_t d0 = d - h[0], d1 = d - h[1];
+    uint8_t r = (d1 < 0 ? -d1 : d1) < (d0 < 0 ? -d0 : d0);
+    uint32_t v = rawZigzag(r ? d1 : d0) << 1 | r;
+    if (r) h[1] = h[0];
+    h[0] = d;
+    do {
+      if (pos >= cap) return 0;
+      uint8_t b = v & 0x7F;
+      v >>= 7;
+      out[pos++] = v ? b | 0x80 : b;
+    } while (v);
+  }
+  return pos;
+}
+
+// Decode exactly n durations from len bytes into out. False if the input is
+// malformed, runs short or has bytes left over.
+static inline bool rawDecode(const uint8_t* in, size_t len, uint16_t* out, uint16_t n) {
+  if (len < 1 || in[0] == 0) return false;
+  const uint8_t* end = in + len;
+  uint32_t unit = *in++;
+  int32_t ref[2][2] = { { 0, 0 }, { 0, 0 } };
+  for (uint16_t i = 0; i < n; i++) {
+    if (in >= end) return false;
+    uint32_t v = *in++;
+    if (v & 0x80) {  // Rare beyond two bytes, so no loop on the common path
+      v &= 0x7F;
+      uint8_t shift = 7;
+      uint8_t b;
+      do {
+        if (in >= end || shift > 14) return false;
+        b = *in++;
+        v |= (uint32_t)(b & 0x7F) << shift;
+        shift += 7;
+      } while (b & 0x80);
+    }
+    int32_t* h = ref[i & 1];
+    int32_t d = h[v & 1] + rawUnzigzag(v >> 1);
+    if (d < 0 || (uint32_t)d * unit > 0xFFFF) return false;
+    if (v & 1) h[1] = h[0];
+    h[0] = d;
+    out[i] = d * unit;
+  }
+  return in == end;
+}
+
+// Base64 (RFC 4648, padded) for carrying encoded timings in JSON
+static const char RAW_BASE64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static inline size_t rawBase64Length(size_t n) { return (n + 2) / 3 * 4; }
+
+// Writes rawBase64Length(n) characters plus a terminator; out must have room
+static inline void rawBase64Encode(const uint8_t* in, size_t n, char* out) {
+  for (size_t i = 0; i < n; i += 3) {
+    uint32_t v = (uint32_t)in[i] << 16;
+    if (i + 1 < n) v |= (uint32_t)in[i + 1] << 8;
+    if (i + 2 < n) v |= in[i + 2];
+    *out++ = RAW_BASE64[v >> 18];
+    *out++ = RAW_BASE64[(v >> 12) & 0x3F];
+    *out++ = i + 1 < n ? RAW_BASE64[(v >> 6) & 0x3F] : '=';
+    *out++ = i + 2 < n ? RAW_BASE64[v & 0x3F] : '=';
+  }
+  *out = '\0';
+}
+
+static inline int8_t rawBase64Value(char c) {
+  if (c >= 'A' && c <= 'Z') return c - 'A';
+  if (c >= 'a' && c <= 'z') return c - 'a' + 26;
+  if (c >= '0' && c <= '9') return c - '0' + 52;
+  if (c == '+') return 62;
+  if (c == '/') return 63;
+  return -1;
+}
+
+// Returns the decoded size, or -1 if the text is malformed or exceeds cap
+static inline int rawBase64Decode(const char* in, uint8_t* out, size_t cap) {
+  size_t pos = 0;
+  uint32_t v = 0;
+  uint8_t bits = 0;
+  for (; *in && *in != '='; in++) {
+    int8_t d = rawBase64Value(*in);
+    if (d < 0) return -1;
+    v = (v << 6) | d;
+    bits += 6;
+    if (bits >= 8) {
+      bits -= 8;
+      if (pos >= cap) return -1;
+      out[pos++] = (v >> bits) & 0xFF;
+    }
+  }
+  return (int)pos;
+}
@@ -1,166 +1,510 @@
 #!/usr/bin/env python3
 """
-MQTT IR Command Migration Script
+IR Catalogue Sync
 
-This script publishes the hardcoded IR commands to MQTT as retained messages,
-allowing the ESP32 to load them from the broker instead of having them in firmware.
+Makes the broker's retained command definitions match a set of definition
+files. The retained state is read first, then only added, changed or (with
+--prune) removed definitions are published, pipelined at QoS 1 with a bounded
+in-flight window. Running it twice publishes nothing the second time. Each
+device's retained manifest is updated to match, so devices report sync:ok. A
+manifest covers the device's whole cache, as the firmware counts it: its own
+definitions plus the shared ones its catalogue filter selects and it does not
+override. So a --shared sync updates every device that has a manifest.
+
+Definitions are read from:
+  *.json   {"tv_power": {"proto":"Samsung","addr":7,"cmd":2}, ...}, or one
+           definition per file named <command>.json
+  *.irxb   a binary blob from catalog_blob.py export (device records for a
+           device target, shared records for --shared)
+  a directory of the above
 
 Requirements:
   pip install paho-mqtt
 
 Usage:
-  python3 migrate_commands.py
+  python3 migrate_commands.py sync commands.json                  # device 1
+  python3 migrate_commands.py sync defs/ --device living --device hall --prune
+  python3 migrate_commands.py sync shared.json --shared           # home/ir/catalog/
+  python3 migrate_commands.py sync backup.irxb --device 2 --dry-run
+  python3 migrate_commands.py pull current.json --device 1        # broker -> file
+  python3 migrate_commands.py pack commands.json out.irxb --device 2
+
+pack writes a blob for catalog_blob.py import, stamped as the device would.
+
+Against a local broker:
+  mosquitto -p 1884 &
+  python3 migrate_commands.py --host localhost --port 1884 sync commands.json
+
+Broker settings come from --host/--port/--user/--password or the MQTT_HOST,
+MQTT_PORT, MQTT_USER and MQTT_PASS environment variables.
 """
 
-import paho.mqtt.client as mqtt
+import argparse
 import json
+import math
+import os
+import sys
+import threading
 import time
 
-# MQTT Broker Configuration
-MQTT_HOST = "homeassistant.local"
-MQTT_PORT = 1883
-MQTT_USER = "matt"
-MQTT_PASS = "W8j!&VQ3*sXUnWIEx!$z6"
-
-# Base topic for commands
-COMMAND_TOPIC_BASE = "home/ir/1/commands/"
-
-# Define all commands to migrate
-COMMANDS = {
-    # TV Commands (Samsung protocol)
-    "tv_power": {
-        "proto": "Samsung",
-        "addr": 7,
-        "cmd": 2,
-        "rpt": 0
-    },
-    "tv_vol_up": {
-        "proto": "Samsung",
-        "addr": 7,
-        "cmd": 7,
-        "rpt": 0
-    },
-    "tv_vol_down": {
-        "proto": "Samsung",
-        "addr": 7,
-        "cmd": 11,
-        "rpt": 0
-    },
-    "tv_mute": {
-        "proto": "Samsung",
-        "addr": 7,
-        "cmd": 15,
-        "rpt": 0
-    },
-
-    # Fan Commands (Raw timing data)
-    "fan_power": {
-        "raw": True,
-        "freq": 38,
-        "data": [1330,270,1380,270,580,1220,1280,270,1430,320,480,1220,430,1220,480,1220,430,1220,430,1220,430,1220,1330,7070,1280,370,1330,270,530,1220,1330,220,1430,270,580,1220,480,1170,480,1170,480,1170,480,1220,430,1220,1330,8020,1330,320,1330,370,480,1220,1280,370,1330,320,480,1220,480,1170,430,1220,430,1270,430,1220,430,1220,1280,7120,1280,370,1280,420,430,1220,1280,420,1280,370,430,1270,380,1270,430,1220,430,1270,380,1270,380,1270,1230]
-    },
-    "fan_speed_up": {
-        "raw": True,
-        "freq": 38,
-        "data": [1180,2420,230,1320,180,770,230,420,230,120,180,120,380,170,180,220,280,1470,180,1470,280,1370,230,1420,330,1320,1180,570,280,170,180,7520,1180,520,1180,520,230,1420,1180,520,1180,570,180,1420,280,1370,230,1370,380,1320,280,120,230,1020,1180,570,280]
-    },
-    "fan_speed_down": {
-        "raw": True,
-        "freq": 38,
-        "data": [1280,370,1330,370,430,1220,1280,320,1380,320,530,1220,430,1220,1230,420,430,1270,380,1270,1280,320,530,7870,1280,320,1380,370,430,1270,1230,370,1330,370,480,1220,430,1220,1280,370,480,1220,430,1220,1280,320,530]
-    },
-    "fan_rotate": {
-        "raw": True,
-        "freq": 38,
-        "data": [1230,120,1580,420,380,1270,230,120,880,470,230,120,880,420,130,120,180,1220,230,1470,230,120,280,120,130,120,230,470,230,1370,230,1470,230,1420,230]
-    }
-}
-
-
-def on_connect(client, userdata, flags, rc):
-    if rc == 0:
-        print("✓ Connected to MQTT broker")
-    else:
-        print(f"✗ Connection failed with code {rc}")
+import catalog_blob
 
+TOPIC_ROOT = "home/ir/"
+TOPIC_CATALOG = TOPIC_ROOT + "catalog/"
+TOPIC_BARRIER = TOPIC_ROOT + "fleet/sync"  # Not used by devices
+MAX_COMMAND_NAME = 31
+CATALOG_FILTER_MAX = 24  # Entries the device keeps from its catalogue filter
+RESERVED_IDS = ("catalog", "fleet")
+MAX_PAYLOAD = 1900  # Leaves room for the topic in the device's 2048-byte buffer
 
-def publish_commands(client):
-    """Publish all commands as retained MQTT messages"""
+BARRIER_TIMEOUT_S = 15.0
+ACK_TIMEOUT_S = 30.0
 
-    print(f"\nPublishing {len(COMMANDS)} commands to MQTT broker...")
-    print(f"Broker: {MQTT_HOST}:{MQTT_PORT}\n")
 
-    success_count = 0
+def make_client(client_id):
+    import paho.mqtt.client as mqtt
+    # paho-mqtt 2.x requires the callback API version, 1.x does not know it
+    try:
+        return mqtt.Client(mqtt.CallbackAPIVersion.VERSION1, client_id=client_id)
+    except AttributeError:
+        return mqtt.Client(client_id=client_id)
 
-    for name, command_data in COMMANDS.items():
-        topic = COMMAND_TOPIC_BASE + name
-        payload = json.dumps(command_data)
 
-        # Publish as retained message
-        result = client.publish(topic, payload, qos=1, retain=True)
+def connect(args, client_id):
+    client = make_client(client_id)
+    if args.user:
+        client.username_pw_set(args.user, args.password)
+    client.max_inflight_messages_set(args.window)
+    client.max_queued_messages_set(0)
+    client.connect(args.host, args.port, 60)
+    client.loop_start()
+    return client
 
-        if result.rc == mqtt.MQTT_ERR_SUCCESS:
-            print(f"✓ Published: {name}")
-            if "proto" in command_data:
-                print(f"    Type: Protocol ({command_data['proto']})")
-            else:
-                print(f"    Type: Raw ({len(command_data['data'])} values)")
-            success_count += 1
+
+def percentile(sorted_values, pct):
+    if not sorted_values:
+        return 0.0
+    # Nearest-rank
+    rank = max(1, math.ceil(pct / 100.0 * len(sorted_values)))
+    return sorted_values[rank - 1]
+
+
+# ====== Definitions ======
+
+def fnv1a(data, h=2166136261):
+    for b in data:
+        h = ((h ^ b) * 16777619) & 0xFFFFFFFF
+    return h
+
+
+def stamp(name, payload):
+    """Version stamp the device gives a definition (see Catalogue Versioning)"""
+    return fnv1a(payload, fnv1a(name.encode("utf-8")))
+
+
+def encode(definition):
+    return json.dumps(definition, separators=(",", ":")).encode("utf-8")
+
+
+def canonical(definition):
+    """Comparable form: raw timings expanded, whichever way they were written, the
+    carrier defaults filled in, repeats as the burst profile the device replays and
+    the emitter channel explicit"""
+    out = {k: v for k, v in definition.items()
+           if k not in ("data", "len", "packed", "repeatCount", "repeatInterval", "bursts")}
+    out.setdefault("channel", 0)
+    unit = catalog_blob.GAP_UNIT_US
+    out["bursts"] = [[gap // unit * unit, count, frame] for gap, count, frame in catalog_blob.bursts(definition)]
+    if not definition.get("raw"):
+        return out
+    out["data"] = catalog_blob.timings(definition)
+    out.setdefault("freq", catalog_blob.FREQ_DEFAULT)
+    out.setdefault("duty", catalog_blob.DUTY_DEFAULT)
+    return out
+
+
+def is_definition(obj):
+    return isinstance(obj, dict) and ("proto" in obj or "raw" in obj)
+
+
+def load_definitions(paths, shared):
+    """name -> definition dict from files, directories and blobs"""
+    defs = {}
+    for path in paths:
+        if os.path.isdir(path):
+            files = sorted(os.path.join(path, f) for f in os.listdir(path) if f.endswith((".json", ".irxb")))
+            defs.update(load_definitions(files, shared))
+        elif path.endswith(".irxb"):
+            with open(path, "rb") as f:
+                _, records = catalog_blob.parse_blob(catalog_blob.split_chunks(f.read()))
+            for rec in records:
+                if rec["shared"] == shared:
+                    defs[rec["name"]] = catalog_blob.definition(rec)
         else:
-            print(f"✗ Failed: {name}")
+            with open(path) as f:
+                data = json.load(f)
+            if is_definition(data):
+                defs[os.path.splitext(os.path.basename(path))[0]] = data
+            else:
+                defs.update(data)
 
-    print(f"\n{success_count}/{len(COMMANDS)} commands published successfully")
-    print("\nThese commands are now stored as retained messages on the MQTT broker.")
-    print("The ESP32 will automatically load them on boot/reconnect.")
+    for name, definition in defs.items():
+        if not name or len(name) > MAX_COMMAND_NAME or any(c in name for c in "+#/"):
+            raise ValueError(f"invalid command name {name!r}")
+        if not is_definition(definition):
+            raise ValueError(f"{name}: not a command definition")
+        if len(encode(definition)) > MAX_PAYLOAD:
+            raise ValueError(f"{name}: definition longer than {MAX_PAYLOAD} bytes")
+    return defs
 
 
-def main():
-    print("=" * 60)
-    print("IR Command Migration to MQTT")
-    print("=" * 60)
+def affinity_rank(definition, device):
+    """This device's fleet rank, as the firmware computes it (see Fleet Routing)"""
+    table = definition.get("affinity")
+    if not isinstance(table, dict):
+        return catalog_blob.RANK_UNSET
+    mine = table.get(device, 0)
+    if mine <= 0:
+        return 0xFF
+    rank = sum(1 for dev, score in table.items() if score > mine or (score == mine and dev < device))
+    return min(rank, catalog_blob.RANK_UNSET - 1)
+
 
-    # Create MQTT client
-    client = mqtt.Client(client_id="ir_migration_script")
-    client.username_pw_set(MQTT_USER, MQTT_PASS)
-    client.on_connect = on_connect
+# ====== Broker State ======
 
+class Target:
+    def __init__(self, device):
+        self.device = device  # None for the shared catalogue
+        self.prefix = TOPIC_CATALOG if device is None else f"{TOPIC_ROOT}{device}/commands/"
+        self.manifest_topic = None if device is None else f"{TOPIC_ROOT}{device}/manifest"
+        self.filter_topic = None if device is None else f"{TOPIC_ROOT}{device}/catalog"
+        self.retained = {}    # name -> payload bytes
+        self.manifest = None  # (count, digest) if the device has one
+        self.filter = None    # Catalogue filter entries, None = every shared command
+
+    def label(self):
+        return "shared catalogue" if self.device is None else f"device {self.device}"
+
+    def topics(self):
+        return [self.prefix + "#"] + ([self.manifest_topic, self.filter_topic] if self.device is not None else [])
+
+
+def parse_filter(payload):
+    """Catalogue filter entries as the firmware keeps them (see Shared Catalogue)"""
+    if not payload:
+        return None
     try:
-        # Connect to broker
-        print(f"\nConnecting to {MQTT_HOST}:{MQTT_PORT}...")
-        client.connect(MQTT_HOST, MQTT_PORT, 60)
-        client.loop_start()
+        names = json.loads(payload).get("names", [])
+    except (ValueError, AttributeError):
+        return None  # The device keeps its previous filter; assume none
+    entries = [n for n in names if isinstance(n, str) and n and len(n) <= MAX_COMMAND_NAME]
+    return entries[:CATALOG_FILTER_MAX]
+
+
+def catalog_wants(entries, name):
+    if entries is None:
+        return True
+    return any(name.startswith(e[:-1]) if e.endswith("*") else name == e for e in entries)
+
+
+def collect_retained(client, topics, handle):
+    """Call handle(topic, payload) for every retained message on topics. A nonce
+    published after subscribing comes back once the broker has delivered them all."""
+    lock = threading.Lock()
+    nonce = str(time.time_ns())
+    barrier = threading.Event()
+
+    def on_message(client, userdata, msg):
+        if msg.topic == TOPIC_BARRIER:
+            if msg.payload.decode("utf-8", "replace") == nonce:
+                barrier.set()
+            return
+        if msg.retain:
+            with lock:
+                handle(msg.topic, bytes(msg.payload))
+
+    client.on_message = on_message
+    for topic in topics:
+        client.subscribe(topic, qos=1)
+    client.subscribe(TOPIC_BARRIER, qos=1)
+    client.publish(TOPIC_BARRIER, nonce, qos=1)
+    if not barrier.wait(BARRIER_TIMEOUT_S):
+        raise RuntimeError(f"no echo on {TOPIC_BARRIER} (broker ACL?)")
+    for topic in topics:
+        client.unsubscribe(topic)
+    client.on_message = None
+
+
+def fetch_retained(client, targets):
+    """Fill in each target's retained definitions, manifest and catalogue filter"""
+    def handle(topic, payload):
+        for t in targets:
+            if topic.startswith(t.prefix) and payload:
+                t.retained[topic[len(t.prefix):]] = payload
+            elif topic == t.manifest_topic and payload:
+                try:
+                    m = json.loads(payload)
+                    t.manifest = (int(m["count"]), int(m["hash"], 16))
+                except (ValueError, KeyError):
+                    pass
+            elif topic == t.filter_topic:
+                t.filter = parse_filter(payload)
+
+    collect_retained(client, [topic for t in targets for topic in t.topics()], handle)
+
 
-        # Wait for connection
-        time.sleep(1)
+def devices_with_manifest(client):
+    """Ids of every device that has a retained manifest"""
+    devices = set()
 
-        # Publish all commands
-        publish_commands(client)
+    def handle(topic, payload):
+        device = topic[len(TOPIC_ROOT):].split("/")[0]
+        if payload and device not in RESERVED_IDS:
+            devices.add(device)
 
-        # Wait for messages to be sent
-        time.sleep(1)
+    collect_retained(client, [TOPIC_ROOT + "+/manifest"], handle)
+    return sorted(devices)
 
+
+def diff(target, defs, prune):
+    """[(name, payload or b"" to delete)] turning the retained state into defs"""
+    changes = []
+    for name, definition in sorted(defs.items()):
+        current = target.retained.get(name)
+        try:
+            same = current is not None and canonical(json.loads(current)) == canonical(definition)
+        except (ValueError, TypeError):
+            same = False  # Unparseable on the broker: replace it
+        if not same:
+            changes.append((name, encode(definition)))
+    if prune:
+        changes += [(name, b"") for name in sorted(target.retained) if name not in defs]
+    return changes
+
+
+def applied(retained, changes):
+    """Retained definitions after changes"""
+    out = dict(retained)
+    for name, payload in changes:
+        if payload:
+            out[name] = payload
+        else:
+            out.pop(name, None)
+    return out
+
+
+def device_manifest(own, shared, entries):
+    """(count, digest) of the cache a device builds from its own definitions and the
+    shared catalogue: shared entries its filter selects, unless overridden by name"""
+    cache = dict(own)
+    for name, payload in shared.items():
+        if name not in cache and catalog_wants(entries, name):
+            cache[name] = payload
+    return len(cache), sum(stamp(name, payload) for name, payload in cache.items()) & 0xFFFFFFFF
+
+
+# ====== Publishing ======
+
+class Pipeline:
+    """QoS 1 publishes with at most `window` awaiting PUBACK"""
+
+    def __init__(self, client, window):
+        self.client = client
+        self.slots = threading.Semaphore(window)
+        self.lock = threading.Lock()
+        self.sent_at = {}
+        self.early = set()  # PUBACKs that beat publish() returning the mid
+        self.latencies = []
+        self.bytes = 0
+        client.on_publish = self.on_publish
+
+    def on_publish(self, client, userdata, mid):
+        now = time.monotonic()
+        with self.lock:
+            sent = self.sent_at.pop(mid, None)
+            if sent is None:
+                self.early.add(mid)
+                return
+            self.latencies.append((now - sent) * 1000.0)
+        self.slots.release()
+
+    def publish(self, topic, payload, retain=True):
+        self.slots.acquire()
+        now = time.monotonic()
+        info = self.client.publish(topic, payload, qos=1, retain=retain)
+        with self.lock:
+            self.bytes += len(payload)
+            if info.mid in self.early:
+                self.early.discard(info.mid)
+                self.latencies.append((time.monotonic() - now) * 1000.0)
+                self.slots.release()
+            else:
+                self.sent_at[info.mid] = now
+
+    def drain(self, timeout):
+        deadline = time.monotonic() + timeout
+        while time.monotonic() < deadline:
+            with self.lock:
+                if not self.sent_at:
+                    return True
+            time.sleep(0.01)
+        return False
+
+
+def sync(args):
+    targets = [Target(None)] if args.shared else [Target(d) for d in args.device or ["1"]]
+    defs = load_definitions(args.files, args.shared)
+    if not args.plain:
+        defs = {name: catalog_blob.packed_definition(d) for name, d in defs.items()}
+    print(f"Loaded {len(defs)} definitions from {', '.join(args.files)}")
+
+    client = connect(args, "ir_catalog_sync")
+    start = time.monotonic()
+    # Manifests also count shared definitions: a device sync needs the shared
+    # catalogue, a shared sync every device that has a manifest
+    shared = targets[0] if args.shared else Target(None)
+    devices = [] if args.shared else targets
+    if not args.no_manifest:
+        if args.shared:
+            devices = [Target(d) for d in devices_with_manifest(client)]
+        fetch_retained(client, targets + [t for t in devices + [shared] if t not in targets])
+    else:
+        fetch_retained(client, targets)
+    fetch_elapsed = time.monotonic() - start
+    print(f"Read {sum(len(t.retained) for t in targets)} retained definitions in {fetch_elapsed:.2f}s")
+
+    plan = []
+    for t in targets:
+        changes = diff(t, defs, args.prune)
+        added = sum(1 for n, p in changes if p and n not in t.retained)
+        deleted = sum(1 for _, p in changes if not p)
+        print(f"{t.label()}: {added} to add, {len(changes) - added - deleted} to change, "
+              f"{deleted} to delete, {len(defs) - len(changes) + deleted} unchanged")
+        plan.append((t, changes))
+        if args.verbose:
+            for name, payload in changes:
+                print(f"  {'-' if not payload else '+' if name not in t.retained else '~'} {name}")
+
+    total = sum(len(c) for _, c in plan)
+    if args.dry_run or total == 0:
         client.loop_stop()
         client.disconnect()
+        print("Nothing published" + (" (dry run)" if args.dry_run and total else ""))
+        return 0
+
+    pipeline = Pipeline(client, args.window)
+    start = time.monotonic()
+    after = {}
+    for t, changes in plan:
+        for name, payload in changes:
+            pipeline.publish(t.prefix + name, payload)
+        after[t.device] = applied(t.retained, changes)
+    # Same client and QoS: delivered after the definitions they account for
+    manifests = 0
+    shared_after = after.get(None, shared.retained)
+    for t in devices:
+        if not t.manifest or args.no_manifest:
+            continue
+        manifest = device_manifest(after.get(t.device, t.retained), shared_after, t.filter)
+        if manifest != t.manifest:
+            pipeline.publish(t.manifest_topic, '{{"count":{},"hash":"{:08x}"}}'.format(*manifest).encode())
+            manifests += 1
+    acked = pipeline.drain(ACK_TIMEOUT_S)
+    elapsed = time.monotonic() - start
+    client.loop_stop()
+    client.disconnect()
 
-        print("\n" + "=" * 60)
-        print("Migration complete!")
-        print("=" * 60)
-        print("\nNext steps:")
-        print("1. Flash the updated firmware to your ESP32")
-        print("2. Watch the Serial monitor - should see 'Loaded 8 commands from MQTT'")
-        print("3. Test commands by publishing to home/ir/1/send")
-        print("   Example: mosquitto_pub -h homeassistant.local -u matt -P <pass> \\")
-        print("            -t 'home/ir/1/send' -m 'tv_power'")
-        print("\nTo view all commands:")
-        print("  mosquitto_sub -h homeassistant.local -u matt -P <pass> \\")
-        print("                -t 'home/ir/1/commands/#' -v")
-
-    except Exception as e:
-        print(f"\n✗ Error: {e}")
+    lat = sorted(pipeline.latencies)
+    print(f"{'✓' if acked else '✗'} Published {total} changes and {manifests} manifests ({pipeline.bytes} bytes) in {elapsed:.2f}s: "
+          f"{total / max(elapsed, 1e-6):.0f} msg/s, {pipeline.bytes / max(elapsed, 1e-6) / 1024:.1f} KiB/s, "
+          f"window {args.window}")
+    if lat:
+        print(f"PUBACK ms:   p50={percentile(lat, 50):.1f} p99={percentile(lat, 99):.1f} max={lat[-1]:.1f}")
+    if not acked:
+        print(f"✗ {len(pipeline.sent_at)} publishes not acknowledged")
         return 1
+    return 0
+
+
+def pull(args):
+    target = Target(None) if args.shared else Target((args.device or ["1"])[0])
+    client = connect(args, "ir_catalog_pull")
+    fetch_retained(client, [target])
+    client.loop_stop()
+    client.disconnect()
 
+    defs = {}
+    for name, payload in sorted(target.retained.items()):
+        try:
+            defs[name] = json.loads(payload)
+        except ValueError:
+            print(f"WARNING: {name} is not valid JSON, skipped", file=sys.stderr)
+    with open(args.out, "w") as f:
+        json.dump(defs, f, indent=2)
+        f.write("\n")
+    print(f"✓ Wrote {len(defs)} definitions from the {target.label()} to {args.out}")
     return 0
 
 
+def pack(args):
+    device = (args.device or ["1"])[0]
+    defs = load_definitions(args.files, args.shared)
+    records = []
+    for name, definition in sorted(defs.items()):
+        rec = dict(definition, name=name, shared=args.shared,
+                   version=stamp(name, encode(definition)), rank=affinity_rank(definition, device))
+        records.append(rec)
+    chunks = catalog_blob.build_blob(device, records)
+    with open(args.out, "wb") as f:
+        for chunk in chunks:
+            f.write(chunk)
+    print(f"✓ Packed {len(records)} definitions for device {device} into {args.out} "
+          f"({sum(len(c) for c in chunks)} bytes, {len(chunks)} chunks)")
+    return 0
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Sync IR command definitions with the broker")
+    parser.add_argument("--host", default=os.environ.get("MQTT_HOST", "homeassistant.local"))
+    parser.add_argument("--port", type=int, default=int(os.environ.get("MQTT_PORT", "1883")))
+    parser.add_argument("--user", default=os.environ.get("MQTT_USER"))
+    parser.add_argument("--password", default=os.environ.get("MQTT_PASS"))
+    parser.add_argument("--window", type=int, default=64, help="QoS 1 publishes in flight (default 64)")
+    sub = parser.add_subparsers(dest="mode", required=True)
+
+    def add_target(p, repeat):
+        p.add_argument("--device", action="append" if repeat else None,
+                       help="Device id (default 1)" + (", repeatable" if repeat else ""))
+        p.add_argument("--shared", action="store_true", help="Use the shared catalogue (home/ir/catalog/)")
+
+    sy = sub.add_parser("sync", help="Publish what differs from the broker's retained state")
+    sy.add_argument("files", nargs="+")
+    add_target(sy, True)
+    sy.add_argument("--prune", action="store_true", help="Delete retained definitions not in the files")
+    sy.add_argument("--dry-run", action="store_true", help="Only report the diff")
+    sy.add_argument("--no-manifest", action="store_true", help="Leave device manifests alone")
+    sy.add_argument("--plain", action="store_true",
+                    help="Publish raw timings as written instead of packed (see raw_codec.h)")
+    sy.add_argument("-v", "--verbose", action="store_true", help="List each change")
+
+    pl = sub.add_parser("pull", help="Save the broker's retained definitions to a JSON file")
+    pl.add_argument("out")
+    add_target(pl, False)
+
+    pk = sub.add_parser("pack", help="Write definitions as a binary blob for catalog_blob.py import")
+    pk.add_argument("files", nargs="+")
+    pk.add_argument("out")
+    add_target(pk, False)
+
+    args = parser.parse_args()
+    if isinstance(args.device, str):
+        args.device = [args.device]
+    try:
+        return {"sync": sync, "pull": pull, "pack": pack}[args.mode](args)
+    except (ValueError, OSError, RuntimeError) as e:
+        print(f"✗ {e}")
+        return 1
+
+
 if __name__ == "__main__":
     exit(main())
@@ -0,0 +1,323 @@
+#!/usr/bin/env python3
+"""
+MQTT Traffic Record/Replay Benchmark
+
+Records the real home/ir/<id>/* traffic from the broker (including the retained
+command flood seen on subscribe) and replays it into the ESP32 at 1x, 10x and
+max speed. Reports throughput, send latency distribution (request -> OK/ERR
+ack on home/ir/<id>/state) and the device's memory peaks and stage latencies from
+its metrics document.
+
+Replay publishes everything non-retained, so the broker's retained catalogue is
+never modified. Device-owned topics (state, learn, metrics, trace dumps, the
+sync sentinel) are not replayed. A capture replays into whichever device --device
+names: its home/ir/<id>/ prefix is rewritten, so traffic recorded on one device
+can be replayed into another.
+
+Requirements:
+  pip install paho-mqtt
+
+Usage:
+  python3 replay_traffic.py record traffic.jsonl --duration 600   # device 1
+  python3 replay_traffic.py replay traffic.jsonl                 # 1x, 10x, max
+  python3 replay_traffic.py replay traffic.jsonl --speed max --skip-listen
+  python3 replay_traffic.py replay traffic.jsonl --ids   # correlate via home/ir/<id>/ack
+  python3 replay_traffic.py replay traffic.jsonl --device bedroom
+
+Broker settings come from --host/--port/--user/--password or the MQTT_HOST,
+MQTT_PORT, MQTT_USER and MQTT_PASS environment variables.
+"""
+
+import argparse
+import base64
+import json
+import math
+import os
+import threading
+import time
+
+import paho.mqtt.client as mqtt
+
+TOPIC_ROOT = "home/ir/"
+RESERVED_IDS = ("catalog", "fleet")  # Shared catalogue and fleet topics, not devices
+
+# Published by the device itself - recorded for reference, never replayed
+DEVICE_TOPICS = ("state", "ack", "learn", "metrics", "received", "trace/dump", "export/data", "sync")
+
+ACK_TIMEOUT_S = 10.0
+
+
+def make_client(client_id):
+    # paho-mqtt 2.x requires the callback API version, 1.x does not know it
+    try:
+        return mqtt.Client(mqtt.CallbackAPIVersion.VERSION1, client_id=client_id)
+    except AttributeError:
+        return mqtt.Client(client_id=client_id)
+
+
+def connect(args, client_id):
+    client = make_client(client_id)
+    if args.user:
+        client.username_pw_set(args.user, args.password)
+    client.connect(args.host, args.port, 60)
+    client.loop_start()
+    return client
+
+
+def topic(args, suffix):
+    return f"{TOPIC_ROOT}{args.device}/{suffix}"
+
+
+def device_suffix(name):
+    """'send' for home/ir/<any device id>/send, None outside a device namespace"""
+    if not name.startswith(TOPIC_ROOT):
+        return None
+    parts = name[len(TOPIC_ROOT):].split("/", 1)
+    if len(parts) < 2 or parts[0] in RESERVED_IDS:
+        return None
+    return parts[1]
+
+
+def percentile(sorted_values, pct):
+    if not sorted_values:
+        return 0.0
+    # Nearest-rank
+    rank = max(1, math.ceil(pct / 100.0 * len(sorted_values)))
+    return sorted_values[rank - 1]
+
+
+# ====== Record ======
+
+def record(args):
+    start = time.monotonic()
+    count = 0
+    lock = threading.Lock()
+    out = open(args.file, "w")
+
+    def on_message(client, userdata, msg):
+        nonlocal count
+        try:
+            payload = {"text": msg.payload.decode("utf-8")}
+        except UnicodeDecodeError:
+            payload = {"b64": base64.b64encode(msg.payload).decode("ascii")}
+        entry = {"t": round(time.monotonic() - start, 6), "topic": msg.topic,
+                 "retained": bool(msg.retain), **payload}
+        with lock:
+            out.write(json.dumps(entry) + "\n")
+            count += 1
+
+    client = connect(args, "ir_replay_recorder")
+    client.on_message = on_message
+    client.subscribe(topic(args, "#"), qos=0)
+
+    print(f"Recording {topic(args, '#')} from {args.host}:{args.port} for {args.duration}s...")
+    try:
+        time.sleep(args.duration)
+    except KeyboardInterrupt:
+        pass
+    client.loop_stop()
+    client.disconnect()
+    out.close()
+    print(f"✓ Recorded {count} messages to {args.file}")
+    return 0
+
+
+# ====== Replay ======
+
+class AckTracker:
+    """Matches send requests to acks: by correlation id on the ack topic, or
+    OK:<name> / ERR:...:<name> on the state topic, FIFO per name"""
+
+    def __init__(self, args):
+        self.topic_ack = topic(args, "ack")
+        self.topic_metrics = topic(args, "metrics")
+        self.lock = threading.Lock()
+        self.pending = {}
+        self.latencies = []
+        self.errors = 0
+        self.metrics = None
+        self.metrics_event = threading.Event()
+        self.device_queue_us = []
+
+    def sent(self, key):
+        with self.lock:
+            self.pending.setdefault(key, []).append(time.monotonic())
+
+    def on_message(self, client, userdata, msg):
+        now = time.monotonic()
+        if msg.topic == self.topic_metrics:
+            try:
+                self.metrics = json.loads(msg.payload)
+                self.metrics_event.set()
+            except ValueError:
+                pass
+            return
+        if msg.topic == self.topic_ack:
+            try:
+                ack = json.loads(msg.payload)
+            except ValueError:
+                return
+            key, error = str(ack.get("id")), not ack.get("ok")
+            if not error:
+                self.device_queue_us.append(ack.get("q", 0))
+        else:
+            state = msg.payload.decode("utf-8", "replace")
+            if state.startswith("OK:"):
+                key, error = state[3:], False
+            elif state.startswith("ERR:") and state.count(":") >= 2:
+                key, error = state.rsplit(":", 1)[1], True
+            else:
+                return
+        with self.lock:
+            queue = self.pending.get(key)
+            if not queue:
+                return
+            sent_at = queue.pop(0)
+            self.latencies.append((now - sent_at) * 1000.0)
+            if error:
+                self.errors += 1
+
+    def outstanding(self):
+        with self.lock:
+            return sum(len(q) for q in self.pending.values())
+
+
+def load_traffic(args):
+    messages = []
+    with open(args.file) as f:
+        for line in f:
+            entry = json.loads(line)
+            suffix = device_suffix(entry["topic"])
+            if suffix is None or suffix in DEVICE_TOPICS:
+                continue
+            if args.skip_listen and suffix == "listen":
+                continue
+            payload = entry["text"].encode("utf-8") if "text" in entry else base64.b64decode(entry["b64"])
+            messages.append((entry["t"], suffix, payload))
+    return messages
+
+
+def replay_once(args, messages, speed):
+    tracker = AckTracker(args)
+    client = connect(args, "ir_replay_bench")
+    client.on_message = tracker.on_message
+    client.subscribe(topic(args, "ack" if args.ids else "state"), qos=0)
+    client.subscribe(topic(args, "metrics"), qos=0)
+    time.sleep(0.5)
+
+    factor = None if speed == "max" else float(speed)
+    t0 = messages[0][0] if messages else 0.0
+    start = time.monotonic()
+    sends = 0
+    for t, suffix, payload in messages:
+        if factor:
+            delay = start + (t - t0) / factor - time.monotonic()
+            if delay > 0:
+                time.sleep(delay)
+        if suffix == "send":
+            name = payload.decode("utf-8", "replace")
+            if args.ids:
+                payload = json.dumps({"name": name, "id": sends}).encode("utf-8")
+                tracker.sent(str(sends))
+            else:
+                tracker.sent(name)
+            sends += 1
+        client.publish(topic(args, suffix), payload, qos=0, retain=False)
+    publish_elapsed = time.monotonic() - start
+
+    # Wait for acks of the tail of the run
+    deadline = time.monotonic() + ACK_TIMEOUT_S
+    while tracker.outstanding() and time.monotonic() < deadline:
+        time.sleep(0.05)
+    total_elapsed = time.monotonic() - start
+
+    # Memory peaks and device-side stage latencies since the last window
+    client.publish(topic(args, "metrics/get"), b"", qos=0)
+    tracker.metrics_event.wait(5.0)
+
+    client.loop_stop()
+    client.disconnect()
+    return {
+        "speed": speed,
+        "messages": len(messages),
+        "sends": sends,
+        "publish_elapsed": publish_elapsed,
+        "total_elapsed": total_elapsed,
+        "latencies": sorted(tracker.latencies),
+        "errors": tracker.errors,
+        "timeouts": tracker.outstanding(),
+        "metrics": tracker.metrics,
+        "device_queue_us": sorted(tracker.device_queue_us),
+    }
+
+
+def print_report(result):
+    lat = result["latencies"]
+    speed = result["speed"]
+    print(f"\n--- Replay at {speed if speed == 'max' else speed + 'x'} ---")
+    print(f"Messages:    {result['messages']} in {result['publish_elapsed']:.2f}s "
+          f"({result['messages'] / max(result['publish_elapsed'], 1e-6):.1f} msg/s offered)")
+    print(f"Sends:       {result['sends']} requested, {len(lat)} acked, "
+          f"{result['errors']} errors, {result['timeouts']} timed out")
+    if result["total_elapsed"] > 0:
+        print(f"Throughput:  {len(lat) / result['total_elapsed']:.2f} acked sends/s")
+    if lat:
+        print(f"Latency ms:  p50={percentile(lat, 50):.1f} p90={percentile(lat, 90):.1f} "
+              f"p99={percentile(lat, 99):.1f} max={lat[-1]:.1f}")
+    q = result["device_queue_us"]
+    if q:
+        print(f"Device wait: p50={percentile(q, 50)}us p99={percentile(q, 99)}us (arrival -> first burst)")
+
+    metrics = result["metrics"]
+    if not metrics:
+        print("Device:      no metrics received")
+        return
+    mem = metrics.get("mem", {})
+    print(f"Memory:      heap_min={mem.get('heap_min')} heap_max_block={mem.get('heap_max_block')} "
+          f"stack_loop={mem.get('stack_loop')} cache={mem.get('cache_used')}/{mem.get('cache_size')}")
+    for stage in ("parse", "lookup", "airtime", "send", "publish"):
+        h = metrics.get(stage)
+        if h and h.get("n"):
+            print(f"Device {stage:8} n={h['n']} p50<={h['p50']}us p99<={h['p99']}us max={h['max']}us")
+
+
+def replay(args):
+    messages = load_traffic(args)
+    if not messages:
+        print("✗ No replayable messages in capture")
+        return 1
+    print(f"Loaded {len(messages)} messages spanning {messages[-1][0] - messages[0][0]:.1f}s")
+
+    for speed in args.speed or ["1", "10", "max"]:
+        print_report(replay_once(args, messages, speed))
+    return 0
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Record and replay IR blaster MQTT traffic")
+    parser.add_argument("--host", default=os.environ.get("MQTT_HOST", "homeassistant.local"))
+    parser.add_argument("--port", type=int, default=int(os.environ.get("MQTT_PORT", "1883")))
+    parser.add_argument("--user", default=os.environ.get("MQTT_USER"))
+    parser.add_argument("--password", default=os.environ.get("MQTT_PASS"))
+    sub = parser.add_subparsers(dest="mode", required=True)
+
+    rec = sub.add_parser("record", help="Capture home/ir/<id>/# traffic to a JSONL file")
+    rec.add_argument("file")
+    rec.add_argument("--device", default="1", help="Device id to record (default 1)")
+    rec.add_argument("--duration", type=float, default=300, help="Seconds to record (Ctrl+C stops early)")
+
+    rep = sub.add_parser("replay", help="Replay a capture into the device and report")
+    rep.add_argument("file")
+    rep.add_argument("--device", default="1", help="Device id to replay into (default 1)")
+    rep.add_argument("--speed", action="append", choices=["1", "10", "max"],
+                     help="Replay speed, repeatable (default: 1, 10 and max)")
+    rep.add_argument("--skip-listen", action="store_true", help="Do not replay learn requests")
+    rep.add_argument("--ids", action="store_true",
+                     help="Send with correlation ids and match structured acks (home/ir/<id>/ack)")
+
+    args = parser.parse_args()
+    return record(args) if args.mode == "record" else replay(args)
+
+
+if __name__ == "__main__":
+    exit(main())
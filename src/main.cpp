@@ -3,6 +3,11 @@
 #include <PubSubClient.h>
 #include <IRremote.hpp>
 #include <ArduinoJson.h>
+#include <Preferences.h>
+#include <esp_partition.h>
+#include "raw_codec.h"
+#include "ir_fingerprint.h"
+#include "ir_frames.h"
 
 // ====== WiFi/MQTT Configuration ======
 // Credentials are stored in credentials.h (not tracked in git)
@@ -10,12 +15,151 @@
 #include "credentials.h"
 
 // Topics
-#define TOPIC_IR_SEND  "home/ir/1/send"        // HA -> ESP (send command by name)
-#define TOPIC_STATE    "home/ir/1/state"       // ESP -> HA (status updates)
-#define TOPIC_LEARN    "home/ir/1/learn"       // ESP -> HA (learned command log)
-#define TOPIC_LISTEN   "home/ir/1/listen"      // HA -> ESP (begin 10s listening with name)
-#define TOPIC_COMMANDS "home/ir/1/commands/#"  // HA -> ESP (command definitions, retained)
+// Per-device topics live under home/ir/<device id>/ and are built at boot by
+// buildTopics(). The id defaults to DEVICE_ID and can be changed at runtime (see
+// Device Identity). The shared catalogue is the same for every device.
+#define TOPIC_ROOT     "home/ir/"
+#define TOPIC_CATALOG  "home/ir/catalog/"      // HA -> ESP (shared command definitions, retained, see Shared Catalogue)
+#define TOPIC_FLEET_SEND  "home/ir/fleet/send"  // HA -> ESP (send via the best-placed device, see Fleet Routing)
+#define TOPIC_FLEET_CLAIM "home/ir/fleet/claim" // ESP -> ESP (a device took a fleet send)
+#define TOPIC_FLEET_ACK   "home/ir/fleet/ack"   // ESP -> HA (structured ack for fleet sends)
 
+#define TOPIC_IR_SEND  topics.send             // HA -> ESP (send command by name)
+#define TOPIC_PRESS    topics.press            // HA -> ESP (start repeating a command, see Hold to Repeat)
+#define TOPIC_RELEASE  topics.release          // HA -> ESP (stop repeating)
+#define TOPIC_STATE    topics.state            // ESP -> HA (status updates)
+#define TOPIC_ACK      topics.ack              // ESP -> HA (structured acks for sends carrying an "id")
+#define TOPIC_LEARN    topics.learn            // ESP -> HA (learned command log)
+#define TOPIC_LISTEN   topics.listen           // HA -> ESP (begin 10s listening with name)
+#define TOPIC_COMMANDS topics.commands         // HA -> ESP (device command definitions / overrides, retained)
+#define TOPIC_CATALOG_FILTER topics.catalogFilter // HA -> ESP (which shared commands this device caches, retained)
+#define TOPIC_DEVICE_ID topics.deviceId        // HA -> ESP (new device id, saved and rebooted into)
+#define TOPIC_MANIFEST topics.manifest         // Both (catalogue summary: count + digest, retained)
+#define TOPIC_SYNC     topics.sync             // ESP -> ESP (load barrier sentinel, see Load Barrier)
+#define TOPIC_RECEIVE  topics.receive          // HA -> ESP (enable/disable receive mode: "on"/"off")
+#define TOPIC_RECEIVED topics.received         // ESP -> HA (name of command pressed on a real remote)
+#define TOPIC_METRICS  topics.metrics          // ESP -> HA (periodic latency histograms)
+#define TOPIC_METRICS_GET topics.metricsGet    // HA -> ESP (publish metrics now)
+#define TOPIC_PROFILE  topics.profile          // HA -> ESP (enable/disable loop profiler: "on"/"off")
+#define TOPIC_BENCH    topics.bench            // HA -> ESP (timing bench: "all" or a command name)
+#define TOPIC_BENCH_RESULT topics.benchResult  // ESP -> HA (per-command timing results)
+#define TOPIC_TRACE    topics.trace            // HA -> ESP ("dump" = publish trace buffer)
+#define TOPIC_TRACE_DUMP topics.traceDump      // ESP -> HA (binary trace chunks, see trace_to_perfetto.py)
+#define TOPIC_EXPORT   topics.exportReq        // HA -> ESP (stream the whole cache, see Bulk Transfer)
+#define TOPIC_EXPORT_DATA topics.exportData    // ESP -> HA (binary export chunks)
+#define TOPIC_IMPORT   topics.importData       // HA -> ESP (binary import chunks, same format)
+
+#define DEVICE_ID_MAX 17  // Including terminator
+#define TOPIC_MAX 48
+
+struct DeviceTopics {
+  char send[TOPIC_MAX], state[TOPIC_MAX], ack[TOPIC_MAX], learn[TOPIC_MAX], listen[TOPIC_MAX];
+  char commands[TOPIC_MAX];        // .../commands/#
+  char commandsPrefix[TOPIC_MAX];  // .../commands/
+  uint8_t commandsPrefixLen;
+  char catalogFilter[TOPIC_MAX], deviceId[TOPIC_MAX], manifest[TOPIC_MAX], sync[TOPIC_MAX];
+  char receive[TOPIC_MAX], received[TOPIC_MAX], metrics[TOPIC_MAX], metricsGet[TOPIC_MAX];
+  char profile[TOPIC_MAX], bench[TOPIC_MAX], benchResult[TOPIC_MAX], trace[TOPIC_MAX], traceDump[TOPIC_MAX];
+  char exportReq[TOPIC_MAX], exportData[TOPIC_MAX], importData[TOPIC_MAX];
+  char press[TOPIC_MAX], release[TOPIC_MAX];
+};
+static DeviceTopics topics;
+static char deviceId[DEVICE_ID_MAX];
+
+// ====== Logging ======
+// LOG_LEVEL selects what is compiled in; disabled levels compile to nothing (the dead
+// call only keeps format checking). Override via build_flags, e.g. -DLOG_LEVEL=2.
+#define LOG_LEVEL_NONE  0
+#define LOG_LEVEL_ERROR 1
+#define LOG_LEVEL_WARN  2
+#define LOG_LEVEL_INFO  3
+#define LOG_LEVEL_DEBUG 4  // Per-message, per-field and per-burst detail
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+// LOG_ASYNC=1: lines are formatted into a RAM ring buffer and drained from loop() only
+// as fast as the UART FIFO accepts them, so logging never blocks on the baud rate.
+// Lines that do not fit are dropped and counted.
+#ifndef LOG_ASYNC
+#define LOG_ASYNC 0
+#endif
+#define LOG_RING_SIZE 4096  // Power of two
+#define LOG_LINE_MAX  192
+
+void logPrintf(const char* fmt, ...) __attribute__((format(printf, 1, 2)));
+
+#if LOG_LEVEL >= LOG_LEVEL_ERROR
+#define LOGE(fmt, ...) logPrintf(fmt "\n", ##__VA_ARGS__)
+#else
+#define LOGE(fmt, ...) do { if (0) logPrintf(fmt, ##__VA_ARGS__); } while (0)
+#endif
+#if LOG_LEVEL >= LOG_LEVEL_WARN
+#define LOGW(fmt, ...) logPrintf(fmt "\n", ##__VA_ARGS__)
+#else
+#define LOGW(fmt, ...) do { if (0) logPrintf(fmt, ##__VA_ARGS__); } while (0)
+#endif
+#if LOG_LEVEL >= LOG_LEVEL_INFO
+#define LOGI(fmt, ...) logPrintf(fmt "\n", ##__VA_ARGS__)
+#else
+#define LOGI(fmt, ...) do { if (0) logPrintf(fmt, ##__VA_ARGS__); } while (0)
+#endif
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+#define LOGD(fmt, ...) logPrintf(fmt "\n", ##__VA_ARGS__)
+#else
+#define LOGD(fmt, ...) do { if (0) logPrintf(fmt, ##__VA_ARGS__); } while (0)
+#endif
+
+#if LOG_ASYNC
+static char     logRing[LOG_RING_SIZE];
+static uint32_t logHead = 0;  // Monotonic write position
+static uint32_t logTail = 0;  // Monotonic read position
+static uint32_t logDropped = 0;
+#endif
+
+void logPrintf(const char* fmt, ...) {
+  char line[LOG_LINE_MAX];
+  va_list args;
+  va_start(args, fmt);
+  int n = vsnprintf(line, sizeof(line), fmt, args);
+  va_end(args);
+  if (n <= 0) return;
+  if (n >= (int)sizeof(line)) n = sizeof(line) - 1;
+
+#if LOG_ASYNC
+  if ((uint32_t)n > LOG_RING_SIZE - (logHead - logTail)) {
+    logDropped++;
+    return;
+  }
+  for (int i = 0; i < n; i++) {
+    logRing[logHead++ & (LOG_RING_SIZE - 1)] = line[i];
+  }
+#else
+  Serial.write((const uint8_t*)line, n);
+#endif
+}
+
+// Drain the async ring into the UART without blocking (call from loop())
+void logFlush() {
+#if LOG_ASYNC
+  int room = Serial.availableForWrite();
+  if (logDropped && room > 32 && logHead == logTail) {
+    char note[32];
+    int n = snprintf(note, sizeof(note), "[log: %lu dropped]\n", (unsigned long)logDropped);
+    Serial.write((const uint8_t*)note, n);
+    logDropped = 0;
+    return;
+  }
+  while (room > 0 && logTail != logHead) {
+    uint32_t offset = logTail & (LOG_RING_SIZE - 1);
+    uint32_t chunk = min(min((uint32_t)room, logHead - logTail), LOG_RING_SIZE - offset);
+    Serial.write((const uint8_t*)&logRing[offset], chunk);
+    logTail += chunk;
+    room -= chunk;
+  }
+#endif
+}
 
 WiFiClient espClient;
 PubSubClient mqtt(espClient);
@@ -23,15 +167,36 @@ PubSubClient mqtt(espClient);
 const uint8_t ONBOARD_LED = 2;
 
 // ====== Command Cache ======
-#define MAX_COMMANDS 30
+// Two tiers: every definition lives in the cold tier on flash (see Cold Tier), and
+// commandCache is the hot tier holding the commands actually in use.
+#define MAX_COMMANDS 30  // Hot tier (RAM) slots
 #define MAX_COMMAND_NAME 32
 #define MAX_RAW_DATA 200  // Max raw timing values per command
+#define MAX_RAW_PACKED 320  // Encoded timings (see raw_codec.h): 1.6 bytes per edge at 200 edges
+#define MAX_BURST_RUNS 6    // See Burst Profile
+#define MAX_REPEAT_FRAME 8  // Timing values of a raw command's repeat frame
+
+// A run of bursts with the same gap and frame (see Burst Profile)
+struct BurstRun {
+  uint16_t gap;          // Silence before each burst, in BURST_GAP_UNIT_US
+  uint8_t count;         // Bursts in the run
+  uint8_t repeatFrame;   // 1 = the protocol's repeat frame, 0 = the full frame
+};
 
 struct StoredCommand {
   char name[MAX_COMMAND_NAME];
   bool isRaw;
   uint8_t repeatCount;        // Number of repeats captured (0 = single press)
-  uint16_t repeatInterval;    // Milliseconds between repeats
+  uint16_t repeatInterval;    // Milliseconds between repeats (definitions without "bursts")
+  uint8_t burstRuns;          // Used entries of bursts; their counts add up to repeatCount
+  BurstRun bursts[MAX_BURST_RUNS];
+  uint32_t fingerprint;       // Recognition key (see Recognition Index)
+  uint8_t fleetRank;          // This device's place for fleet sends (see Fleet Routing)
+  uint8_t channel;            // Emitter (see Emitter Channels)
+  uint32_t version;           // Content stamp of the definition (see Catalogue Versioning)
+  bool shared;                // From the shared catalogue; a device definition overrides it
+  bool referenced;            // Hot tier only: CLOCK reference bit
+  uint16_t coldSlot;          // Hot tier only: where the definition lives on flash
   union {
     struct {
       char proto[16];    // Protocol name as string
@@ -40,28 +205,72 @@ struct StoredCommand {
       uint8_t rpt;       // Protocol-level repeats (always 0, bursts handled by repeatCount)
     } protocol;
     struct {
-      uint8_t freq;
-      uint16_t data[MAX_RAW_DATA];
-      uint16_t len;
+      uint16_t freq;                   // Carrier in kHz (see Carrier)
+      uint16_t len;                    // Timing values
+      uint16_t packedLen;              // Bytes used in packed
+      uint8_t duty;                    // Carrier duty cycle in percent
+      uint8_t repeatLen;               // Timing values in repeatFrame, 0 = repeats resend the frame
+      uint16_t repeatFrame[MAX_REPEAT_FRAME];
+      uint8_t packed[MAX_RAW_PACKED];  // Delta/varint encoded, decoded at send time
     } raw;
   };
 };
 
-StoredCommand commandCache[MAX_COMMANDS];
-uint8_t commandCount = 0;
+// Decoded timings of one raw command, filled right before use (transmit, fingerprint,
+// bench). Only valid until the next rawTimingsOf().
+static uint16_t rawTimings[MAX_RAW_DATA];
+
+static const uint16_t* rawTimingsOf(const StoredCommand* cmd) {
+  if (!rawDecode(cmd->raw.packed, cmd->raw.packedLen, rawTimings, cmd->raw.len)) return nullptr;
+  return rawTimings;
+}
+
+// Hot slots never move: a freed slot goes on a free list and its generation is bumped,
+// so a CommandHandle taken earlier resolves to nullptr instead of another command.
+// Generations are 32-bit: a handle would have to sit out 2^32 reuses of its slot to
+// resolve again, where 8 bits wrapped after 256 evictions under a busy replay.
+StoredCommand commandCache[MAX_COMMANDS];  // name[0] == '\0' marks a free slot
+uint8_t hotCount = 0;
+static uint32_t hotGen[MAX_COMMANDS];
+static uint8_t hotFreeList[MAX_COMMANDS];
+static uint8_t hotFreeCount = 0;
+static uint8_t hotHighWater = 0;  // Slots above have never been used
+
+struct CommandHandle {
+  uint8_t slot;
+  uint32_t gen;
+};
+
+static inline bool hotUsed(uint8_t slot) { return commandCache[slot].name[0] != '\0'; }
+
+CommandHandle handleOf(const StoredCommand* cmd) {
+  uint8_t slot = cmd - commandCache;
+  return { slot, hotGen[slot] };
+}
+
+// nullptr once the command was deleted or evicted
+StoredCommand* resolveHandle(CommandHandle h) {
+  if (h.slot >= MAX_COMMANDS || hotGen[h.slot] != h.gen || !hotUsed(h.slot)) return nullptr;
+  return &commandCache[h.slot];
+}
+uint16_t commandCount = 0;  // Whole catalogue (cold tier)
 char learningCommandName[MAX_COMMAND_NAME] = "";
 
 // Burst capture tracking
 static uint8_t capturedRepeats = 0;
-static uint32_t firstPressTime = 0;
-static uint32_t lastRepeatTime = 0;
 static uint32_t lastSignalTime = 0;
 static IRData baseSignal;  // Store first signal for comparison
 static bool hasBaseSignal = false;
+static BurstRun learnRuns[MAX_BURST_RUNS];      // Burst profile so far (see Burst Profile)
+static uint8_t  learnRunCount = 0;
+static uint16_t learnRepeat[MAX_REPEAT_FRAME];  // Repeat frame of a raw capture
+static uint8_t  learnRepeatLen = 0;
+static bool     lastFrameMatched = false;       // Previous frame joined the burst
 
 // Learning mode timing
 #define LEARNING_TOTAL_TIMEOUT_MS 10000  // Maximum 10s total learning time
 #define BURST_IDLE_TIMEOUT_MS 500        // End learning if no signal for 500ms
+#define REPEAT_MIN_MARK_US 2000          // Leading mark of a raw repeat frame (NEC: 9000)
 
 // ====== Input ======
 // Button-based learning removed - now using MQTT TOPIC_LISTEN
@@ -74,249 +283,2669 @@ static bool hasBaseSignal = false;
 
 static bool     learnActive   = false;
 static uint32_t learnDeadline = 0;
+static uint16_t learnFreq     = 0;  // Carrier of raw captures from the listen request, 0 = measure (see Carrier)
+static uint8_t  learnDuty     = 0;
+static uint16_t baseCarrier   = 0;  // Measured on the first frame, 0 = no sensor or no reading
+
+// Batch learning: record an ordered list of names back to back in one receiver session
+#define MAX_BATCH_NAMES 40
+static char     batchNames[MAX_BATCH_NAMES][MAX_COMMAND_NAME];
+static uint32_t batchFingerprints[MAX_BATCH_NAMES];  // Per captured name, for duplicate detection
+static uint8_t  batchCount    = 0;  // 0 = single-command learning
+static uint8_t  batchIndex    = 0;  // Name currently being recorded
+static uint8_t  batchCaptured = 0;
+
+// Receive mode: receiver stays on while idle and recognizes presses on real remotes
+static bool     receiveActive      = false;
+static bool     benchActive        = false;  // See Timing Bench
+static uint32_t lastRecognizedFp   = 0;
+static uint32_t lastRecognizedTime = 0;
 
 // ====== IR ======
-constexpr uint8_t IR_SEND_PIN = 13;
+// One emitter per GPIO in IR_SEND_PINS, each on its own RMT channel (see Emitter
+// Channels); a definition's "channel" picks the emitter by position in the list.
+#ifndef IR_SEND_PINS
+#define IR_SEND_PINS 13  // e.g. -DIR_SEND_PINS=13,14,25 for three cabinet zones
+#endif
+static const uint8_t sendPins[] = { IR_SEND_PINS };
+#define SEND_CHANNELS (sizeof(sendPins) / sizeof(sendPins[0]))
+#define MAX_SEND_CHANNELS 8  // RMT channels on the ESP32
+static_assert(SEND_CHANNELS <= MAX_SEND_CHANNELS, "More emitters than RMT channels");
 constexpr uint8_t IR_RECEIVE_PIN = 27;
 
 
-enum class Proto : uint8_t { Samsung, NEC, LG, Sony12, JVC, RC5, RC6, Panasonic };
+// ====== Trace ======
+// Fixed-size in-RAM ring of binary timing records for post-mortem analysis. Always on;
+// a record is 8 bytes and costs one micros() call. Dumped over MQTT on request as
+// chunks of: "IRTR", version u8, reserved u8, seq u16, total u16, count u16, then
+// `count` records (all little-endian), one chunk per loop() iteration. The ring is
+// frozen while a dump streams, so no record of it is overwritten before it goes out.
+// trace_to_perfetto.py converts a dump into Chrome trace / Perfetto JSON.
+#define TRACE_CAPACITY 512       // Records, power of two
+#define TRACE_CHUNK_RECORDS 240  // Records per MQTT message (fits the 2048-byte buffer)
 
-// ====== Command Cache Management ======
+enum TraceEvent : uint16_t {
+  TRACE_MQTT_RX = 1,     // arg: payload length
+  TRACE_CMD_RESOLVED,    // arg: cache slot
+  TRACE_BURST_START,     // arg: burst index
+  TRACE_BURST_END,       // arg: burst index
+  TRACE_SEND_DONE,       // arg: cache slot
+  TRACE_LEARN_FRAME,     // arg: bursts seen so far
+  TRACE_LEARN_CAPTURED,  // arg: additional bursts
+  TRACE_PUBLISH_START,   // arg: definition length
+  TRACE_PUBLISH_DONE,
+  TRACE_MQTT_CONNECTED,
+  TRACE_SYNC_READY,      // arg: command count
+  TRACE_LOOP_STALL,      // arg: LoopStage
+  TRACE_RECOGNIZED,      // arg: cache slot
+};
 
-// Find command by name in cache
-StoredCommand* findCommandByName(const char* name) {
-  for (uint8_t i = 0; i < commandCount; i++) {
-    if (strcmp(commandCache[i].name, name) == 0) {
-      return &commandCache[i];
+struct TraceRecord {
+  uint32_t timestampUs;
+  uint16_t event;
+  uint16_t arg;
+};
+
+static TraceRecord traceRing[TRACE_CAPACITY];
+static uint32_t    traceHead = 0;  // Monotonic; oldest record is traceHead - TRACE_CAPACITY
+static bool        traceDumping = false;
+
+inline void trace(TraceEvent event, uint16_t arg = 0) {
+  if (traceDumping) return;
+  TraceRecord& rec = traceRing[traceHead++ & (TRACE_CAPACITY - 1)];
+  rec.timestampUs = micros();
+  rec.event = event;
+  rec.arg = arg;
+}
+
+// ====== Metrics ======
+// Fixed log2 histograms of stage latency in microseconds: bucket 0 holds 0us, bucket i
+// holds [2^(i-1), 2^i). No heap; published and reset every METRICS_INTERVAL_MS.
+#define HIST_BUCKETS 24              // Top bucket covers >= 2^22us (~4s)
+#define METRICS_INTERVAL_MS 60000
+
+struct LatencyHistogram {
+  uint32_t buckets[HIST_BUCKETS];
+  uint32_t count;
+  uint32_t maxUs;
+
+  void record(uint32_t us) {
+    uint8_t b = us ? 32 - __builtin_clz(us) : 0;
+    buckets[min(b, (uint8_t)(HIST_BUCKETS - 1))]++;
+    count++;
+    if (us > maxUs) maxUs = us;
+  }
+
+  // Upper bound of the bucket holding the given percentile
+  uint32_t percentile(uint8_t pct) const {
+    if (!count) return 0;
+    uint32_t rank = ((uint64_t)count * pct + 99) / 100;
+    uint32_t seen = 0;
+    for (uint8_t b = 0; b < HIST_BUCKETS; b++) {
+      seen += buckets[b];
+      if (seen >= rank) return b ? min((uint32_t)1 << b, maxUs) : 0;
     }
+    return maxUs;
+  }
+
+  void reset() { memset(this, 0, sizeof(*this)); }
+};
+
+// Records the lifetime of the enclosing scope into a histogram
+struct StageTimer {
+  LatencyHistogram& hist;
+  uint32_t start;
+  explicit StageTimer(LatencyHistogram& h) : hist(h), start(micros()) {}
+  ~StageTimer() { hist.record(micros() - start); }
+};
+
+static LatencyHistogram parseHist;    // JSON parsing in onMqttMessage()
+static LatencyHistogram lookupHist;   // findCommandByName()
+static LatencyHistogram airtimeHist;  // IR transmission of a send (frames only)
+static LatencyHistogram sendHist;     // A send from its first frame to its last
+static LatencyHistogram publishHist;  // Learned command publish in publishDecode()
+static uint32_t lastMetricsTime = 0;
+
+// ====== Loop Profiler ======
+// Optional per-stage timing of loop(): max and mean per metrics window, plus stall
+// detection. An iteration longer than LOOP_STALL_THRESHOLD_US counts as a stall and is
+// attributed to the stage that took the most time in it. Toggled via TOPIC_PROFILE.
+#define LOOP_STALL_THRESHOLD_US 100000  // 100ms
+
+enum LoopStage : uint8_t {
+  STAGE_CONNECT, STAGE_MQTT, STAGE_SYNC, STAGE_LED, STAGE_LEARN, STAGE_RECEIVE,
+  STAGE_BENCH, STAGE_FLEET, STAGE_EMIT, STAGE_TRANSFER, STAGE_PIPELINE, STAGE_METRICS,
+  LOOP_STAGES
+};
+static const char* const loopStageNames[LOOP_STAGES] = {
+  "connect", "mqtt", "sync", "led", "learn", "receive", "bench", "fleet", "emit",
+  "transfer", "pipeline", "metrics"
+};
+
+struct StageStats {
+  uint32_t maxUs;
+  uint64_t totalUs;
+  uint32_t stalls;  // Stalls attributed to this stage
+};
+
+static bool       profilerActive = false;
+static StageStats loopStats[LOOP_STAGES];
+static uint32_t   loopIterations = 0;
+static uint32_t   loopMaxUs = 0;
+static uint64_t   loopTotalUs = 0;
+static uint32_t   loopStalls = 0;
+static uint8_t    lastStallStage = LOOP_STAGES;  // LOOP_STAGES = none yet
+static uint32_t   lastStallUs = 0;
+static uint32_t   lastStallTime = 0;
+
+static uint32_t iterationStart = 0;
+static uint32_t stageMarkTime = 0;
+static uint32_t iterationStageUs[LOOP_STAGES];
+
+void profileBegin() {
+  if (!profilerActive) return;
+  iterationStart = stageMarkTime = micros();
+  memset(iterationStageUs, 0, sizeof(iterationStageUs));
+}
+
+// Attribute time since the previous mark to a stage
+void profileMark(LoopStage stage) {
+  if (!profilerActive) return;
+  uint32_t now = micros();
+  uint32_t us = now - stageMarkTime;
+  stageMarkTime = now;
+  iterationStageUs[stage] += us;
+  loopStats[stage].totalUs += us;
+  if (us > loopStats[stage].maxUs) loopStats[stage].maxUs = us;
+}
+
+void profileEnd() {
+  if (!profilerActive) return;
+  uint32_t us = micros() - iterationStart;
+  loopIterations++;
+  loopTotalUs += us;
+  if (us > loopMaxUs) loopMaxUs = us;
+  if (us < LOOP_STALL_THRESHOLD_US) return;
+
+  uint8_t cause = 0;
+  for (uint8_t i = 1; i < LOOP_STAGES; i++) {
+    if (iterationStageUs[i] > iterationStageUs[cause]) cause = i;
+  }
+  loopStats[cause].stalls++;
+  trace(TRACE_LOOP_STALL, cause);
+  loopStalls++;
+  lastStallStage = cause;
+  lastStallUs = us;
+  lastStallTime = millis();
+  LOGW("Loop stall: %luus in %s", (unsigned long)us, loopStageNames[cause]);
+}
+
+void profileReset() {
+  memset(loopStats, 0, sizeof(loopStats));
+  loopIterations = 0;
+  loopMaxUs = 0;
+  loopTotalUs = 0;
+  loopStalls = 0;
+}
+
+// Fixed-capacity FIFO; producers fill the slot from push() in place
+template <typename T, uint8_t N>
+struct StageQueue {
+  T items[N];
+  uint8_t head = 0;
+  uint8_t count = 0;
+
+  T* push() {
+    if (count == N) return nullptr;
+    return &items[(head + count++) % N];
+  }
+  T* front() { return count ? &items[head] : nullptr; }
+  void pop() {
+    head = (head + 1) % N;
+    count--;
+  }
+};
+
+// ====== Outbound Queue ======
+// State/ack/log messages are queued here instead of being written to the socket from
+// inside the MQTT callback (or mid-send), and flushed from loop() with a per-iteration
+// budget. Low-value progress messages carry a coalesce key: while one with the same
+// key is still queued, a newer one replaces its payload instead of adding another.
+// When the queue is full an incoming coalescable message is dropped (a later one of
+// its kind follows); any other message is published directly so acks are never lost.
+#define OUTBOX_DEPTH 16
+#define OUTBOX_MSG_MAX 320
+#define OUTBOX_FLUSH_BUDGET 4     // Messages per loop() iteration
+#define OUTBOX_FLUSH_BYTES 1024   // Payload bytes per loop() iteration
+
+enum CoalesceKey : uint8_t { COALESCE_NONE = 0, COALESCE_LEARN_BURST };
+
+struct OutboxEntry {
+  const char* topic;  // A fleet topic literal or a topics.* buffer; both static, so compared by pointer
+  uint8_t coalesceKey;
+  char payload[OUTBOX_MSG_MAX];
+};
+
+static StageQueue<OutboxEntry, OUTBOX_DEPTH> outbox;
+static uint8_t  outboxPeak = 0;
+static uint32_t outboxCoalesced = 0;
+static uint32_t outboxOverflow = 0;
+
+bool enqueuePublish(const char* topic, const char* payload, uint8_t coalesceKey = COALESCE_NONE) {
+  if (strlen(payload) >= OUTBOX_MSG_MAX) return mqtt.publish(topic, payload);
+
+  if (coalesceKey != COALESCE_NONE) {
+    for (uint8_t i = 0; i < outbox.count; i++) {
+      OutboxEntry& e = outbox.items[(outbox.head + i) % OUTBOX_DEPTH];
+      if (e.coalesceKey == coalesceKey && e.topic == topic) {
+        strcpy(e.payload, payload);
+        outboxCoalesced++;
+        return true;
+      }
+    }
+  }
+
+  OutboxEntry* e = outbox.push();
+  if (!e) {
+    if (coalesceKey != COALESCE_NONE) {
+      outboxCoalesced++;  // Dropped; a later one of its kind will follow
+      return false;
+    }
+    outboxOverflow++;
+    return mqtt.publish(topic, payload);
+  }
+  e->topic = topic;
+  e->coalesceKey = coalesceKey;
+  strcpy(e->payload, payload);
+  if (outbox.count > outboxPeak) outboxPeak = outbox.count;
+  return true;
+}
+
+// Publish queued messages within the per-iteration budget (call from loop())
+void flushOutbox() {
+  size_t bytes = 0;
+  for (uint8_t n = 0; n < OUTBOX_FLUSH_BUDGET && mqtt.connected(); n++) {
+    OutboxEntry* e = outbox.front();
+    if (!e) return;
+    size_t len = strlen(e->payload);
+    if (n > 0 && bytes + len > OUTBOX_FLUSH_BYTES) return;  // Rest goes next iteration
+    mqtt.publish(e->topic, e->payload);
+    bytes += len;
+    outbox.pop();
   }
-  return nullptr;
 }
 
 // Forward declaration
 void indicateSend();
 
-// Parse protocol string to Proto enum
-Proto parseProto(const char* protoStr) {
-  if (strcasecmp(protoStr, "Samsung") == 0) return Proto::Samsung;
-  if (strcasecmp(protoStr, "NEC") == 0) return Proto::NEC;
-  if (strcasecmp(protoStr, "LG") == 0) return Proto::LG;
-  if (strcasecmp(protoStr, "Sony12") == 0) return Proto::Sony12;
-  if (strcasecmp(protoStr, "JVC") == 0) return Proto::JVC;
-  if (strcasecmp(protoStr, "RC5") == 0) return Proto::RC5;
-  if (strcasecmp(protoStr, "RC6") == 0) return Proto::RC6;
-  if (strcasecmp(protoStr, "Panasonic") == 0) return Proto::Panasonic;
-  return Proto::NEC;  // default
-}
-
-// Execute a cached command
-void executeCommand(StoredCommand* cmd) {
-  if (!cmd) {
-    Serial.println("ERROR: Null command pointer");
-    mqtt.publish(TOPIC_STATE, "ERR:NULL_COMMAND");
+// ====== Recognition Index ======
+// Reverse index from received frame fingerprint -> hot tier slot, so a press on a
+// real remote resolves to a command name in O(1) instead of scanning the cache.
+// Commands only in the cold tier are found through the cold tier's fingerprint index
+// (see Cold Tier), so a frame from an unknown remote costs a few probes either way.
+// Open addressing with linear probing, sized to 2x MAX_COMMANDS to keep probes short.
+// Removal leaves a tombstone; the index is rebuilt once a quarter of it is tombstones.
+// Every hot slot is indexed, duplicates of a code after the first in its probe chain,
+// so the first one is the recognized name and removing it promotes the next without
+// a scan of the hot tier. The hot name index (see Command Cache Management) uses the
+// same layout.
+#define RECOGNIZE_INDEX_SIZE 64  // Must be a power of two >= 2 * MAX_COMMANDS
+#define INDEX_EMPTY 0xFF
+#define INDEX_TOMBSTONE 0xFE
+
+static uint8_t recognizeIndex[RECOGNIZE_INDEX_SIZE];
+static uint8_t recognizeTombstones = 0;
+
+// Fingerprints: protocolFingerprint() and rawFingerprint() (see ir_fingerprint.h)
+static_assert(MAX_RAW_DATA <= RAW_FP_MAX, "Raw frames longer than the fingerprint classes");
+
+uint32_t commandFingerprint(const StoredCommand* cmd) {
+  if (cmd->isRaw) {
+    const uint16_t* timings = rawTimingsOf(cmd);
+    return timings ? rawFingerprint(timings, cmd->raw.len) : 0;
+  }
+  return protocolFingerprint(cmd->protocol.proto, cmd->protocol.addr, cmd->protocol.cmd);
+}
+
+void indexInsert(uint8_t slot) {
+  uint32_t fp = commandCache[slot].fingerprint;
+  int16_t target = -1;
+  for (uint8_t probe = 0; probe < RECOGNIZE_INDEX_SIZE; probe++) {
+    uint8_t i = (fp + probe) & (RECOGNIZE_INDEX_SIZE - 1);
+    uint8_t e = recognizeIndex[i];
+    if (e == INDEX_EMPTY) {
+      if (target < 0) target = i;
+      break;
+    }
+    if (e == INDEX_TOMBSTONE) {
+      if (target < 0) target = i;  // Reuse, but keep probing for a duplicate
+      continue;
+    }
+    // Two commands with the same code: the first one stays the recognized name
+    if (commandCache[e].fingerprint == fp) target = -1;
+  }
+  if (target < 0) return;
+  if (recognizeIndex[target] == INDEX_TOMBSTONE) recognizeTombstones--;
+  recognizeIndex[target] = slot;
+}
+
+// Full rebuild - clears tombstones
+void rebuildRecognizeIndex() {
+  memset(recognizeIndex, INDEX_EMPTY, sizeof(recognizeIndex));
+  recognizeTombstones = 0;
+  for (uint8_t i = 0; i < MAX_COMMANDS; i++) {
+    if (hotUsed(i)) indexInsert(i);
+  }
+}
+
+// Call before the slot's fingerprint changes or the slot is freed; a hot duplicate of
+// the same code further down the chain becomes the recognized name
+void indexRemove(uint8_t slot) {
+  uint32_t fp = commandCache[slot].fingerprint;
+  for (uint8_t probe = 0; probe < RECOGNIZE_INDEX_SIZE; probe++) {
+    uint8_t i = (fp + probe) & (RECOGNIZE_INDEX_SIZE - 1);
+    if (recognizeIndex[i] == INDEX_EMPTY) return;
+    if (recognizeIndex[i] != slot) continue;
+    recognizeIndex[i] = INDEX_TOMBSTONE;
+    recognizeTombstones++;
     return;
   }
+}
+
+// Call once the slots are consistent again
+void compactRecognizeIndex() {
+  if (recognizeTombstones >= RECOGNIZE_INDEX_SIZE / 4) rebuildRecognizeIndex();
+}
+
+// ====== Cold Tier ======
+// Definitions are written through to the "ircold" flash partition (partitions.csv),
+// one 512-byte slot each. The RAM index keeps name hash, version and fingerprint per
+// slot, so lookups, retained-replay checks and the manifest digest never touch flash.
+// A hot-tier miss reads one record back (~100 us) into a hot slot picked by CLOCK:
+// each hot entry has a reference bit set on use, and the hand clears bits until it
+// finds an unreferenced entry. Hot entries are never dirty, so eviction costs nothing.
+//
+// Flash is written log-style. A changed definition goes into an erased slot and is
+// committed before its old slot is retired (the "live" word is programmed to 0, no
+// erase needed), so a failed write leaves the old definition in place. When no erased
+// slot is left, the sector with the most dead slots is erased and its live records
+// written back in place, so slot numbers never change. One slot is held back from new
+// commands so an update always has somewhere to go. A power cut between commit and
+// retire leaves two live records of a name; boot keeps one, and the broker's retained
+// copy replays over it (as it does for a record lost outright).
+//
+// Without the "ircold" partition (a board flashed with the default partition table),
+// the same slots live in a heap buffer of COLD_RAM_SLOTS instead: the cache holds
+// about as many commands as the hot tier, as before the cold tier existed, nothing
+// survives a reboot, and the ready state says "no flash store".
+//
+// Names resolve to slots through an open-addressing hash index (like the Recognition
+// Index, with tombstones on delete), so a lookup costs a probe or two, not a scan. A
+// second index of the same shape keys the slots by fingerprint for recognition of
+// commands that are not hot; both follow every change of a slot.
+#define COLD_SLOT_SIZE 512
+#define COLD_SECTOR_SIZE 4096
+#define COLD_SLOTS_PER_SECTOR (COLD_SECTOR_SIZE / COLD_SLOT_SIZE)
+#define COLD_MAX_SLOTS 2048          // Bounds the RAM index (21 bytes per slot)
+#define COLD_INDEX_SIZE 4096         // Name and fingerprint indexes, power of two >= 2 * COLD_MAX_SLOTS
+#define COLD_INDEX_EMPTY 0xFFFF
+#define COLD_INDEX_TOMBSTONE 0xFFFE
+#define COLD_PARTITION_SUBTYPE 0x40
+#define COLD_MAGIC 0x36435249u       // "IRC6" (older layouts are dropped and replayed)
+#define COLD_COMMITTED 0u
+#define COLD_LIVE 0xFFFFFFFFu
+#define COLD_RAM_SLOTS 32            // Without a partition: whole sectors, >= MAX_COMMANDS
+#define COLD_WRITE_FULL -1           // coldWrite() results
+#define COLD_WRITE_FAILED -2
 
-  Serial.print("Executing command: ");
-  Serial.println(cmd->name);
+// coldState: low bits = slot state, high bits = flags
+#define COLD_ERASED 0
+#define COLD_USED   1
+#define COLD_DEAD   2
+#define COLD_STATE_MASK  0x03
+#define COLD_FLAG_SHARED 0x04
+#define COLD_FLAG_SYNCED 0x08  // Replayed by the broker since the last subscribe
 
-  // Calculate total send count (initial + repeats)
-  uint8_t sendCount = 1 + cmd->repeatCount;
+// Header words are programmed in order: magic (slot claimed), record, committed
+struct ColdRecord {
+  uint32_t magic;
+  uint32_t committed;  // COLD_COMMITTED once the record is complete
+  uint32_t live;       // COLD_LIVE until superseded or deleted
+  StoredCommand cmd;
+};
+static_assert(sizeof(ColdRecord) <= COLD_SLOT_SIZE, "StoredCommand outgrew a cold slot");
 
-  if (cmd->repeatCount > 0) {
-    Serial.print("Will send ");
-    Serial.print(sendCount);
-    Serial.print(" times with ");
-    Serial.print(cmd->repeatInterval);
-    Serial.println("ms interval");
-  }
-
-  // Send command (initial + repeats)
-  for (uint8_t i = 0; i < sendCount; i++) {
-    if (i > 0) {
-      // Delay before sending next burst
-      delay(cmd->repeatInterval);
-      Serial.print("Sending burst #");
-      Serial.println(i);
-    }
-
-    if (cmd->isRaw) {
-      // Send raw IR data
-      if (i == 0) {
-        Serial.print("Sending raw command, freq=");
-        Serial.print(cmd->raw.freq);
-        Serial.print(", len=");
-        Serial.println(cmd->raw.len);
-      }
-      indicateSend();
-      IrSender.sendRaw(cmd->raw.data, cmd->raw.len, cmd->raw.freq);
-    } else {
-      // Send protocol command
-      if (i == 0) {
-        Serial.print("Sending protocol command: ");
-        Serial.println(cmd->protocol.proto);
-      }
+struct ColdMeta {
+  uint32_t nameHash;
+  uint32_t version;
+  uint32_t fingerprint;
+};
 
-      Proto proto = parseProto(cmd->protocol.proto);
-      uint16_t addr = cmd->protocol.addr;
-      uint8_t command = (uint8_t)cmd->protocol.cmd;
-      // Protocol-level repeats (always 0) - handled at burst level via repeatCount instead
-      uint8_t repeats = cmd->protocol.rpt;
-
-      switch (proto) {
-        case Proto::Samsung:   IrSender.sendSamsung(addr, command, repeats); break;
-        case Proto::NEC:       IrSender.sendNEC(addr, command, repeats); break;
-        case Proto::LG:        IrSender.sendLG(addr, command, repeats); break;
-        case Proto::Sony12:    IrSender.sendSony(addr, command, 12, repeats); break;
-        case Proto::RC5:       IrSender.sendRC5(addr, command, 0, repeats); break;
-        case Proto::RC6:       IrSender.sendRC6(addr, command, 20, repeats); break;
-        case Proto::Panasonic: IrSender.sendPanasonic(addr, cmd->protocol.cmd & 0x0FFF, repeats); break;
-      }
+static const esp_partition_t* coldPartition = nullptr;
+static uint8_t* coldRam = nullptr;   // Slots in RAM when there is no partition
+static uint16_t coldSlots = 0;       // Usable slots, whole sectors only
+static uint16_t coldErased = 0;
+static uint16_t coldNextFree = 0;    // Allocation rotates through the partition
+static ColdMeta coldMeta[COLD_MAX_SLOTS];
+static uint8_t  coldState[COLD_MAX_SLOTS];
+static uint16_t coldIndex[COLD_INDEX_SIZE];       // By name hash
+static uint16_t coldTombstones = 0;
+static uint16_t coldPrintIndex[COLD_INDEX_SIZE];  // By fingerprint (0 = none, not indexed)
+static uint16_t coldPrintTombstones = 0;
+static uint8_t  clockHand = 0;
+static uint32_t hotHits = 0, hotMisses = 0, hotEvictions = 0;
+
+static inline uint8_t coldSlotState(uint16_t slot) { return coldState[slot] & COLD_STATE_MASK; }
+
+static uint32_t nameHash(const char* name) {
+  return fnv1a(2166136261u, name, strlen(name));
+}
+
+static size_t coldOffset(uint16_t slot, size_t field) {
+  return (size_t)slot * COLD_SLOT_SIZE + field;
+}
+
+// Storage primitives. The RAM store behaves like NOR flash (writes only clear bits),
+// so both backings go through the same log-style code.
+static bool coldStoreRead(size_t at, void* out, size_t len) {
+  if (coldRam) {
+    memcpy(out, coldRam + at, len);
+    return true;
+  }
+  return esp_partition_read(coldPartition, at, out, len) == ESP_OK;
+}
+
+static bool coldStoreWrite(size_t at, const void* in, size_t len) {
+  if (coldRam) {
+    for (size_t i = 0; i < len; i++) coldRam[at + i] &= ((const uint8_t*)in)[i];
+    return true;
+  }
+  return esp_partition_write(coldPartition, at, in, len) == ESP_OK;
+}
+
+static bool coldStoreErase(size_t at, size_t len) {
+  if (coldRam) {
+    memset(coldRam + at, 0xFF, len);
+    return true;
+  }
+  return esp_partition_erase_range(coldPartition, at, len) == ESP_OK;
+}
+
+bool coldRead(uint16_t slot, StoredCommand* out) {
+  return coldStoreRead(coldOffset(slot, offsetof(ColdRecord, cmd)), out, sizeof(*out));
+}
+
+static bool coldReadName(uint16_t slot, char* name) {
+  size_t at = coldOffset(slot, offsetof(ColdRecord, cmd) + offsetof(StoredCommand, name));
+  if (!coldStoreRead(at, name, MAX_COMMAND_NAME)) return false;
+  name[MAX_COMMAND_NAME - 1] = '\0';
+  return true;
+}
+
+static void slotIndexInsert(uint16_t* index, uint16_t& tombstones, uint32_t h, uint16_t slot) {
+  for (uint16_t probe = 0; probe < COLD_INDEX_SIZE; probe++) {
+    uint16_t i = (h + probe) & (COLD_INDEX_SIZE - 1);
+    if (index[i] == COLD_INDEX_EMPTY || index[i] == COLD_INDEX_TOMBSTONE) {
+      if (index[i] == COLD_INDEX_TOMBSTONE) tombstones--;
+      index[i] = slot;
+      return;
     }
   }
+}
 
-  char msg[64];
-  snprintf(msg, sizeof(msg), "OK:%s", cmd->name);
-  mqtt.publish(TOPIC_STATE, msg);
-  Serial.println("Command sent successfully");
+static void slotIndexRemove(uint16_t* index, uint16_t& tombstones, uint32_t h, uint16_t slot) {
+  for (uint16_t probe = 0; probe < COLD_INDEX_SIZE; probe++) {
+    uint16_t i = (h + probe) & (COLD_INDEX_SIZE - 1);
+    if (index[i] == COLD_INDEX_EMPTY) return;
+    if (index[i] == slot) {
+      index[i] = COLD_INDEX_TOMBSTONE;
+      tombstones++;
+      return;
+    }
+  }
 }
 
-// blink onboard led to indicate sending
-void indicateSend() {
-  for (int i = 0; i < 3; i++) {
-    digitalWrite(ONBOARD_LED, HIGH);
-    delay(200);
-    digitalWrite(ONBOARD_LED, LOW);
-    delay(200);
+// Add a used slot to the name and fingerprint indexes (coldMeta filled in)
+static void coldIndexInsert(uint16_t slot) {
+  slotIndexInsert(coldIndex, coldTombstones, coldMeta[slot].nameHash, slot);
+  uint32_t fp = coldMeta[slot].fingerprint;
+  if (fp) slotIndexInsert(coldPrintIndex, coldPrintTombstones, fp, slot);
+}
+
+static void coldIndexRebuild() {
+  memset(coldIndex, 0xFF, sizeof(coldIndex));
+  memset(coldPrintIndex, 0xFF, sizeof(coldPrintIndex));
+  coldTombstones = coldPrintTombstones = 0;
+  for (uint16_t i = 0; i < coldSlots; i++) {
+    if (coldSlotState(i) == COLD_USED) coldIndexInsert(i);
   }
 }
 
-// Add or update command in cache
-bool addOrUpdateCommand(const char* name, JsonDocument& doc) {
-  if (strlen(name) >= MAX_COMMAND_NAME) {
-    Serial.println("ERROR: Command name too long");
-    return false;
+static void coldIndexRemove(uint16_t slot) {
+  slotIndexRemove(coldIndex, coldTombstones, coldMeta[slot].nameHash, slot);
+  uint32_t fp = coldMeta[slot].fingerprint;
+  if (fp) slotIndexRemove(coldPrintIndex, coldPrintTombstones, fp, slot);
+}
+
+// Slot holding name, or -1
+int16_t coldFind(const char* name) {
+  uint32_t h = nameHash(name);
+  char stored[MAX_COMMAND_NAME];
+  for (uint16_t probe = 0; probe < COLD_INDEX_SIZE; probe++) {
+    uint16_t slot = coldIndex[(h + probe) & (COLD_INDEX_SIZE - 1)];
+    if (slot == COLD_INDEX_EMPTY) return -1;
+    if (slot == COLD_INDEX_TOMBSTONE || coldMeta[slot].nameHash != h) continue;
+    if (coldReadName(slot, stored) && strcmp(stored, name) == 0) return slot;  // Rule out hash collisions
   }
+  return -1;
+}
 
-  // Check if command already exists
-  StoredCommand* existing = findCommandByName(name);
-  StoredCommand* cmd;
+// First used slot with fingerprint fp, or -1
+static int16_t coldFindFingerprint(uint32_t fp) {
+  for (uint16_t probe = 0; probe < COLD_INDEX_SIZE; probe++) {
+    uint16_t slot = coldPrintIndex[(fp + probe) & (COLD_INDEX_SIZE - 1)];
+    if (slot == COLD_INDEX_EMPTY) return -1;
+    if (slot != COLD_INDEX_TOMBSTONE && coldMeta[slot].fingerprint == fp) return slot;
+  }
+  return -1;
+}
 
-  if (existing) {
-    Serial.print("Updating existing command: ");
-    Serial.println(name);
-    cmd = existing;
-  } else {
-    if (commandCount >= MAX_COMMANDS) {
-      Serial.println("ERROR: Command cache full");
-      mqtt.publish(TOPIC_STATE, "ERR:CACHE_FULL");
-      return false;
+// Mark a slot dead on flash. RAM state follows regardless: a record that stays live
+// on flash after a failed retire is a duplicate or stale entry, settled at the next
+// boot and sync.
+static bool coldRetire(uint16_t slot) {
+  uint32_t dead = 0;
+  bool ok = coldStoreWrite(coldOffset(slot, offsetof(ColdRecord, live)), &dead, sizeof(dead));
+  if (!ok) LOGE("ERROR: Cold tier retire failed (slot %u)", slot);
+  coldIndexRemove(slot);
+  coldState[slot] = COLD_DEAD;
+  commandCount--;
+  return ok;
+}
+
+StoredCommand* hotFind(const char* name);  // See Command Cache Management
+static void hotRemove(uint8_t i);
+
+// Erase the sector with the most dead slots, writing its live records back in place
+static bool coldCompact() {
+  int16_t best = -1;
+  uint8_t bestDead = 0;
+  for (uint16_t sector = 0; sector < coldSlots / COLD_SLOTS_PER_SECTOR; sector++) {
+    uint8_t dead = 0;
+    for (uint8_t k = 0; k < COLD_SLOTS_PER_SECTOR; k++) {
+      if (coldSlotState(sector * COLD_SLOTS_PER_SECTOR + k) == COLD_DEAD) dead++;
+    }
+    if (dead > bestDead) {
+      best = sector;
+      bestDead = dead;
     }
-    Serial.print("Adding new command: ");
-    Serial.println(name);
-    cmd = &commandCache[commandCount++];
   }
+  if (best < 0) return false;  // Every slot holds a live command
 
-  // Copy name
-  strncpy(cmd->name, name, MAX_COMMAND_NAME - 1);
-  cmd->name[MAX_COMMAND_NAME - 1] = '\0';
+  static uint8_t sectorBuf[COLD_SECTOR_SIZE];
+  size_t base = (size_t)best * COLD_SECTOR_SIZE;
+  if (!coldStoreRead(base, sectorBuf, COLD_SECTOR_SIZE)) return false;
+  if (!coldStoreErase(base, COLD_SECTOR_SIZE)) {
+    LOGE("ERROR: Cold tier erase failed (sector %d)", best);
+    return false;
+  }
+  for (uint8_t k = 0; k < COLD_SLOTS_PER_SECTOR; k++) {
+    uint16_t slot = best * COLD_SLOTS_PER_SECTOR + k;
+    if (coldSlotState(slot) == COLD_USED) {
+      if (coldStoreWrite(base + k * COLD_SLOT_SIZE, sectorBuf + k * COLD_SLOT_SIZE, sizeof(ColdRecord))) continue;
+      // Lost; drop it from both tiers (the retained copy replays it after a reboot)
+      const ColdRecord* rec = (const ColdRecord*)(sectorBuf + k * COLD_SLOT_SIZE);
+      LOGE("ERROR: Cold tier rewrite failed, dropped %s", rec->cmd.name);
+      StoredCommand* hot = hotFind(rec->cmd.name);
+      if (hot) hotRemove(hot - commandCache);
+      coldIndexRemove(slot);
+      coldState[slot] = COLD_DEAD;
+      commandCount--;
+    } else if (coldSlotState(slot) == COLD_DEAD) {
+      coldState[slot] = COLD_ERASED;
+      coldErased++;
+    }
+  }
+  LOGD("Cold tier: compacted sector %d (%u dead)", best, bestDead);
+  return true;
+}
 
-  // Parse repeat fields (default to 0 if not present for backward compatibility)
-  cmd->repeatCount = doc["repeatCount"] | 0;
-  cmd->repeatInterval = doc["repeatInterval"] | 0;
+static int16_t coldAlloc() {
+  if (coldErased == 0 && !coldCompact()) return -1;
+  for (uint16_t n = 0; n < coldSlots; n++) {
+    uint16_t i = (coldNextFree + n) % coldSlots;
+    if (coldSlotState(i) == COLD_ERASED) {
+      coldNextFree = (i + 1) % coldSlots;
+      coldErased--;
+      return i;
+    }
+  }
+  return -1;
+}
 
-  if (cmd->repeatCount > 0) {
-    Serial.print("  Repeat info: count=");
-    Serial.print(cmd->repeatCount);
-    Serial.print(", interval=");
-    Serial.print(cmd->repeatInterval);
-    Serial.println("ms");
+// Store a definition, then retire its previous slot (-1 if new). Returns the slot,
+// COLD_WRITE_FULL or COLD_WRITE_FAILED; on failure the previous slot is untouched.
+int16_t coldWrite(const StoredCommand* cmd, int16_t previous) {
+  if (coldSlots == 0) return COLD_WRITE_FULL;
+  if (previous < 0 && commandCount >= coldSlots - 1) return COLD_WRITE_FULL;  // Spare for updates
+  int16_t slot = coldAlloc();
+  if (slot < 0) return COLD_WRITE_FULL;
+  if (previous >= 0 && coldSlotState(previous) != COLD_USED) previous = -1;  // Lost in compaction
+
+  uint32_t word = COLD_MAGIC;
+  bool ok = coldStoreWrite(coldOffset(slot, offsetof(ColdRecord, magic)), &word, sizeof(word)) &&
+            coldStoreWrite(coldOffset(slot, offsetof(ColdRecord, cmd)), cmd, sizeof(*cmd));
+  word = COLD_COMMITTED;
+  ok = ok && coldStoreWrite(coldOffset(slot, offsetof(ColdRecord, committed)), &word, sizeof(word));
+  if (!ok) {
+    LOGE("ERROR: Cold tier write failed (slot %d)", slot);
+    coldState[slot] = COLD_DEAD;  // Claimed; reclaimed by the next compaction
+    return COLD_WRITE_FAILED;
   }
 
-  // Check if raw or protocol command
-  if (doc["raw"].is<bool>() && doc["raw"]) {
-    // Raw command
-    cmd->isRaw = true;
-    cmd->raw.freq = doc["freq"] | 38;  // default 38kHz
+  if (previous >= 0) coldRetire(previous);
+  coldMeta[slot] = { nameHash(cmd->name), cmd->version, cmd->fingerprint };
+  coldState[slot] = COLD_USED | COLD_FLAG_SYNCED | (cmd->shared ? COLD_FLAG_SHARED : 0);
+  commandCount++;
+  if (coldTombstones >= COLD_INDEX_SIZE / 4 || coldPrintTombstones >= COLD_INDEX_SIZE / 4) coldIndexRebuild();
+  else coldIndexInsert(slot);
+  return slot;
+}
 
-    JsonArray dataArray = doc["data"];
-    cmd->raw.len = min((int)dataArray.size(), MAX_RAW_DATA);
+// Rebuild the RAM index from flash (call from setup())
+void coldBegin() {
+  coldPartition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA,
+    (esp_partition_subtype_t)COLD_PARTITION_SUBTYPE, "ircold");
+  memset(coldIndex, 0xFF, sizeof(coldIndex));
+  memset(coldPrintIndex, 0xFF, sizeof(coldPrintIndex));
+  if (!coldPartition) {
+    coldRam = (uint8_t*)malloc(COLD_RAM_SLOTS * COLD_SLOT_SIZE);
+    if (!coldRam) {
+      LOGE("ERROR: No ircold partition and no RAM for commands");
+      return;
+    }
+    memset(coldRam, 0xFF, COLD_RAM_SLOTS * COLD_SLOT_SIZE);
+    coldSlots = coldErased = COLD_RAM_SLOTS;
+    for (uint16_t i = 0; i < coldSlots; i++) coldState[i] = COLD_ERASED;
+    LOGW("No ircold partition - commands kept in RAM only (upload with partitions.csv)");
+    return;
+  }
+  coldSlots = min((uint32_t)COLD_MAX_SLOTS, coldPartition->size / COLD_SLOT_SIZE);
+  coldSlots -= coldSlots % COLD_SLOTS_PER_SECTOR;
 
-    for (uint16_t i = 0; i < cmd->raw.len; i++) {
-      cmd->raw.data[i] = dataArray[i];
+  // Header plus the fixed fields ahead of the protocol/raw union
+  struct alignas(4) {
+    uint32_t magic, committed, live;
+    uint8_t head[offsetof(StoredCommand, protocol)];
+  } rec;
+  static_assert(offsetof(ColdRecord, cmd) == 12, "ColdRecord header layout");
+  const StoredCommand* cmd = (const StoredCommand*)rec.head;
+
+  uint32_t start = millis();
+  uint16_t duplicates = 0;
+  for (uint16_t i = 0; i < coldSlots; i++) {
+    if (!coldStoreRead(coldOffset(i, 0), &rec, sizeof(rec))) {
+      coldState[i] = COLD_DEAD;  // Unreadable; the next compaction of its sector retries
+    } else if (rec.magic == 0xFFFFFFFFu) {
+      coldState[i] = COLD_ERASED;
+      coldErased++;
+    } else if (rec.magic == COLD_MAGIC && rec.committed == COLD_COMMITTED && rec.live == COLD_LIVE) {
+      char name[MAX_COMMAND_NAME];
+      memcpy(name, cmd->name, MAX_COMMAND_NAME);
+      name[MAX_COMMAND_NAME - 1] = '\0';
+      if (coldFind(name) >= 0) {
+        // Committed but the old record never retired (power cut): keep the first
+        uint32_t dead = 0;
+        coldStoreWrite(coldOffset(i, offsetof(ColdRecord, live)), &dead, sizeof(dead));
+        coldState[i] = COLD_DEAD;
+        duplicates++;
+        continue;
+      }
+      coldMeta[i] = { nameHash(name), cmd->version, cmd->fingerprint };
+      coldState[i] = COLD_USED | (cmd->shared ? COLD_FLAG_SHARED : 0);
+      coldIndexInsert(i);
+      commandCount++;
+    } else {
+      coldState[i] = COLD_DEAD;  // Retired or torn write
     }
+  }
+  LOGI("Cold tier: %u commands, %u/%u slots free, %u duplicates dropped (%lu ms)", commandCount,
+    coldErased, coldSlots, duplicates, (unsigned long)(millis() - start));
+}
 
-    Serial.print("  Raw command: freq=");
-    Serial.print(cmd->raw.freq);
-    Serial.print(", len=");
-    Serial.println(cmd->raw.len);
-  } else {
-    // Protocol command
-    cmd->isRaw = false;
+// ====== Command Cache Management ======
+// Hot slots by name hash, laid out like the recognition index, so a hot hit is a probe
+// or two instead of a strcmp per slot. A slot's name only changes when it is freed or
+// refilled by promote(), which keep the index in step.
+static uint8_t  hotNameIndex[RECOGNIZE_INDEX_SIZE];
+static uint8_t  hotNameTombstones = 0;
+static uint32_t hotNameHash[MAX_COMMANDS];
 
-    const char* proto = doc["proto"] | "NEC";
-    strncpy(cmd->protocol.proto, proto, 15);
-    cmd->protocol.proto[15] = '\0';
+static void hotNameInsert(uint8_t slot) {
+  uint32_t h = hotNameHash[slot] = nameHash(commandCache[slot].name);
+  for (uint8_t probe = 0; probe < RECOGNIZE_INDEX_SIZE; probe++) {
+    uint8_t i = (h + probe) & (RECOGNIZE_INDEX_SIZE - 1);
+    if (hotNameIndex[i] == INDEX_EMPTY || hotNameIndex[i] == INDEX_TOMBSTONE) {
+      if (hotNameIndex[i] == INDEX_TOMBSTONE) hotNameTombstones--;
+      hotNameIndex[i] = slot;
+      return;
+    }
+  }
+}
 
-    cmd->protocol.addr = doc["addr"] | 0;
-    cmd->protocol.cmd = doc["cmd"] | 0;
-    cmd->protocol.rpt = doc["rpt"] | 0;
+static void hotNameRemove(uint8_t slot) {
+  uint32_t h = hotNameHash[slot];
+  for (uint8_t probe = 0; probe < RECOGNIZE_INDEX_SIZE; probe++) {
+    uint8_t i = (h + probe) & (RECOGNIZE_INDEX_SIZE - 1);
+    if (hotNameIndex[i] == INDEX_EMPTY) return;
+    if (hotNameIndex[i] != slot) continue;
+    hotNameIndex[i] = INDEX_TOMBSTONE;
+    hotNameTombstones++;
+    break;
+  }
+  if (hotNameTombstones < RECOGNIZE_INDEX_SIZE / 4) return;
+  memset(hotNameIndex, INDEX_EMPTY, sizeof(hotNameIndex));
+  hotNameTombstones = 0;
+  for (uint8_t i = 0; i < hotHighWater; i++) {
+    if (i != slot && hotUsed(i)) hotNameInsert(i);
+  }
+}
 
-    Serial.print("  Protocol command: ");
-    Serial.print(cmd->protocol.proto);
-    Serial.print(", addr=");
-    Serial.print(cmd->protocol.addr);
-    Serial.print(", cmd=");
-    Serial.println(cmd->protocol.cmd);
+// Hot tier lookup only (no promotion)
+StoredCommand* hotFind(const char* name) {
+  uint32_t h = nameHash(name);
+  for (uint8_t probe = 0; probe < RECOGNIZE_INDEX_SIZE; probe++) {
+    uint8_t i = (h + probe) & (RECOGNIZE_INDEX_SIZE - 1);
+    uint8_t slot = hotNameIndex[i];
+    if (slot == INDEX_EMPTY) return nullptr;
+    if (slot == INDEX_TOMBSTONE || hotNameHash[slot] != h) continue;
+    if (strcmp(commandCache[slot].name, name) == 0) return &commandCache[slot];
   }
+  return nullptr;
+}
 
-  return true;
+// Free slot, or -1 when the hot tier is full
+static int16_t hotAlloc() {
+  if (hotFreeCount > 0) return hotFreeList[--hotFreeCount];
+  if (hotHighWater < MAX_COMMANDS) return hotHighWater++;
+  return -1;
 }
 
-// Delete command from cache
-bool deleteCommand(const char* name) {
-  for (uint8_t i = 0; i < commandCount; i++) {
-    if (strcmp(commandCache[i].name, name) == 0) {
-      Serial.print("Deleting command: ");
-      Serial.println(name);
-
-      // Shift remaining commands down
-      for (uint8_t j = i; j < commandCount - 1; j++) {
-        commandCache[j] = commandCache[j + 1];
-      }
-      commandCount--;
-      return true;
+// Free hot slot i in O(1): nothing moves, outstanding handles go stale
+static void hotRemove(uint8_t i) {
+  indexRemove(i);
+  hotNameRemove(i);
+  commandCache[i].name[0] = '\0';
+  hotGen[i]++;
+  hotFreeList[hotFreeCount++] = i;
+  hotCount--;
+  compactRecognizeIndex();
+}
+
+static uint8_t clockVictim() {
+  while (true) {
+    uint8_t i = clockHand;
+    clockHand = (clockHand + 1) % MAX_COMMANDS;
+    if (!commandCache[i].referenced) return i;
+    commandCache[i].referenced = false;
+  }
+}
+
+// Load a cold slot into the hot tier, evicting by CLOCK when full
+static StoredCommand* promote(uint16_t slot) {
+  int16_t target = hotAlloc();
+  if (target < 0) {
+    target = clockVictim();
+    hotRemove(target);
+    hotEvictions++;
+    target = hotAlloc();
+  }
+  StoredCommand* cmd = &commandCache[target];
+  if (!coldRead(slot, cmd)) {
+    LOGE("ERROR: Cold tier read failed (slot %u)", slot);
+    cmd->name[0] = '\0';
+    hotFreeList[hotFreeCount++] = target;
+    return nullptr;
+  }
+  hotCount++;
+  cmd->coldSlot = slot;
+  cmd->referenced = true;
+  cmd->shared = coldState[slot] & COLD_FLAG_SHARED;
+  indexInsert(target);
+  hotNameInsert(target);
+  return cmd;
+}
+
+// Find command by name, promoting it from the cold tier on a hot miss
+StoredCommand* findCommandByName(const char* name) {
+  StageTimer timer(lookupHist);
+  StoredCommand* cmd = hotFind(name);
+  if (cmd) {
+    cmd->referenced = true;
+    hotHits++;
+    return cmd;
+  }
+  int16_t slot = coldFind(name);
+  if (slot < 0) return nullptr;
+  hotMisses++;
+  return promote(slot);
+}
+
+StoredCommand* findCommandByFingerprint(uint32_t fp) {
+  for (uint8_t probe = 0; probe < RECOGNIZE_INDEX_SIZE; probe++) {
+    uint8_t i = (fp + probe) & (RECOGNIZE_INDEX_SIZE - 1);
+    if (recognizeIndex[i] == INDEX_EMPTY) break;
+    if (recognizeIndex[i] == INDEX_TOMBSTONE) continue;
+    if (commandCache[recognizeIndex[i]].fingerprint == fp) {
+      commandCache[recognizeIndex[i]].referenced = true;
+      return &commandCache[recognizeIndex[i]];
     }
   }
-  return false;
-}
+  // Not hot: the cold tier's fingerprint index
+  int16_t slot = coldFindFingerprint(fp);
+  if (slot < 0) return nullptr;
+  hotMisses++;
+  return promote(slot);
+}
+
+// ====== Carrier ======
+// Raw commands carry their own carrier: RAW_FREQ_MIN to RAW_FREQ_MAX kHz (40 kHz Sony,
+// 455 kHz Bang & Olufsen, ...) and a duty cycle. The RMT carrier generator of the
+// emitter's channel makes it (see Emitter Channels); protocol commands use their
+// protocol's carrier at RAW_DUTY_DEFAULT.
+#define RAW_FREQ_DEFAULT 38  // kHz
+#define RAW_FREQ_MIN 20
+#define RAW_FREQ_MAX 500
+#define RAW_DUTY_DEFAULT 30  // Percent, as IRremote's IR_SEND_DUTY_CYCLE_PERCENT
+#define RAW_DUTY_MIN 10
+#define RAW_DUTY_MAX 50
+
+static bool carrierValid(long kHz, long duty) {
+  return kHz >= RAW_FREQ_MIN && kHz <= RAW_FREQ_MAX && duty >= RAW_DUTY_MIN && duty <= RAW_DUTY_MAX;
+}
+
+// Carrier measurement while learning. Demodulating receivers strip the carrier, so it
+// takes a second, carrier-passing sensor (TSMP58000, or a photodiode and comparator) on
+// IR_CARRIER_PIN. A PCNT unit counts its rising edges and interrupts on edge 1,
+// CARRIER_SHORT and CARRIER_LONG of a frame. The long span is the more precise one and
+// is used unless it disagrees with the short one (it ran past the first mark). Without
+// the sensor, raw captures use the "freq" of the listen request or RAW_FREQ_DEFAULT.
+#ifndef IR_CARRIER_PIN
+#define IR_CARRIER_PIN -1  // e.g. -DIR_CARRIER_PIN=26
+#endif
+
+#if IR_CARRIER_PIN >= 0
+#include <driver/pcnt.h>
+
+#define CARRIER_PCNT_UNIT PCNT_UNIT_0
+#define CARRIER_SHORT 16  // Edges; fits the first mark of common protocols
+#define CARRIER_LONG 64
+
+static volatile uint32_t carrierEdgeAt[3];  // micros() at edge 1, CARRIER_SHORT, CARRIER_LONG
+static volatile uint8_t carrierStamps = 0;
+
+// Events come in count order, so each one takes the next stamp
+static void IRAM_ATTR carrierIsr(void*) {
+  uint32_t now = micros();
+  if (carrierStamps < 3) carrierEdgeAt[carrierStamps++] = now;
+  if (carrierStamps == 3) pcnt_counter_pause(CARRIER_PCNT_UNIT);
+}
+
+static void carrierBegin() {
+  pcnt_config_t cfg = {};
+  cfg.pulse_gpio_num = IR_CARRIER_PIN;
+  cfg.ctrl_gpio_num = PCNT_PIN_NOT_USED;
+  cfg.channel = PCNT_CHANNEL_0;
+  cfg.unit = CARRIER_PCNT_UNIT;
+  cfg.pos_mode = PCNT_COUNT_INC;
+  cfg.neg_mode = PCNT_COUNT_DIS;
+  cfg.lctrl_mode = PCNT_MODE_KEEP;
+  cfg.hctrl_mode = PCNT_MODE_KEEP;
+  cfg.counter_h_lim = CARRIER_LONG;
+  cfg.counter_l_lim = -1;
+  pcnt_unit_config(&cfg);
+  pcnt_set_filter_value(CARRIER_PCNT_UNIT, 10);  // 125 ns glitch filter
+  pcnt_filter_enable(CARRIER_PCNT_UNIT);
+  pcnt_set_event_value(CARRIER_PCNT_UNIT, PCNT_EVT_THRES_0, 1);
+  pcnt_set_event_value(CARRIER_PCNT_UNIT, PCNT_EVT_THRES_1, CARRIER_SHORT);
+  pcnt_event_enable(CARRIER_PCNT_UNIT, PCNT_EVT_THRES_0);
+  pcnt_event_enable(CARRIER_PCNT_UNIT, PCNT_EVT_THRES_1);
+  pcnt_event_enable(CARRIER_PCNT_UNIT, PCNT_EVT_H_LIM);
+  pcnt_isr_service_install(0);
+  pcnt_isr_handler_add(CARRIER_PCNT_UNIT, carrierIsr, nullptr);
+  pcnt_counter_pause(CARRIER_PCNT_UNIT);
+  LOGI("Carrier sensor on GPIO %d", IR_CARRIER_PIN);
+}
+
+// Measure the next frame that arrives
+static void carrierArm() {
+  pcnt_counter_pause(CARRIER_PCNT_UNIT);
+  pcnt_counter_clear(CARRIER_PCNT_UNIT);
+  carrierStamps = 0;
+  pcnt_counter_resume(CARRIER_PCNT_UNIT);
+}
+
+static uint16_t carrierKHz(uint32_t periods, uint32_t us) {
+  return us ? (periods * 1000 + us / 2) / us : 0;
+}
+
+// Carrier of the frame seen since carrierArm() in kHz, 0 if none was measured
+static uint16_t carrierMeasured() {
+  if (carrierStamps < 2) return 0;
+  uint16_t kHz = carrierKHz(CARRIER_SHORT - 1, carrierEdgeAt[1] - carrierEdgeAt[0]);
+  if (carrierStamps == 3) {
+    uint16_t fine = carrierKHz(CARRIER_LONG - 1, carrierEdgeAt[2] - carrierEdgeAt[0]);
+    if (fine * 20 >= kHz * 19 && fine * 20 <= kHz * 21) kHz = fine;  // Within 5%
+  }
+  return kHz >= RAW_FREQ_MIN && kHz <= RAW_FREQ_MAX ? kHz : 0;
+}
+#else
+static void carrierBegin() {}
+static void carrierArm() {}
+static uint16_t carrierMeasured() { return 0; }
+#endif
+
+// ====== Protocol Encoders ======
+// Protocol frames are rendered by encodeFrame (see ir_frames.h) with IRremote's
+// timings and bit layouts. Protocol-level repeats (rpt) are always 0 and not
+// rendered: bursts come from the burst profile.
+
+// One frame (or repeat frame) of a protocol command into out, 0 if the protocol is unknown
+static uint16_t encodeProtocol(const StoredCommand* cmd, bool repeatFrame, uint16_t* out, uint16_t* kHz) {
+  return encodeFrame(parseProto(cmd->protocol.proto), cmd->protocol.addr, (uint8_t)cmd->protocol.cmd, repeatFrame, out, kHz);
+}
+
+// Frame of a command as marks and spaces with its carrier: the full frame, or the
+// repeat frame (the protocol's repeat code or headerless frame, or a raw command's
+// captured repeat frame; the full frame for protocols that repeat by resending it).
+// Only valid until the next call; nullptr if the command cannot be sent.
+static const uint16_t* frameOf(const StoredCommand* cmd, bool repeatFrame, uint16_t* len, uint16_t* kHz, uint8_t* duty) {
+  if (cmd->isRaw) {
+    *kHz = cmd->raw.freq;
+    *duty = cmd->raw.duty;
+    if (repeatFrame && cmd->raw.repeatLen) {
+      *len = cmd->raw.repeatLen;
+      return cmd->raw.repeatFrame;
+    }
+    *len = cmd->raw.len;
+    const uint16_t* timings = rawTimingsOf(cmd);
+    if (!timings) LOGE("ERROR: Corrupt raw timings: %s", cmd->name);
+    return timings;
+  }
+  *duty = RAW_DUTY_DEFAULT;
+  *len = encodeProtocol(cmd, repeatFrame, rawTimings, kHz);
+  return *len ? rawTimings : nullptr;
+}
+
+// ====== Burst Profile ======
+// What a press sends after its first frame, as learned: runs of bursts that share the
+// gap (silence from the end of one frame to the start of the next, as the receiver
+// measured it) and the frame, which is either the full frame again or the protocol's
+// repeat frame (NEC/LG/Samsung repeat codes, or a short raw frame captured with the
+// press). A NEC button held for a second is [40 ms x1 repeat frame][96 ms x9 repeat
+// frame]; a Samsung volume press [60 ms x5 full frame]. Gaps within
+// BURST_GAP_TOLERANCE of a run's average join it, so a long hold stays a few runs.
+// Definitions without a profile get one run of repeatCount full frames
+// repeatInterval ms apart, as before.
+#define BURST_GAP_UNIT_US 50       // MICROS_PER_TICK, the receiver's resolution
+#define BURST_GAP_TOLERANCE 4      // Units, or 1/32 of the gap if that is more
+
+// Add one burst to a profile; false once it is full (255 bursts)
+static bool burstAppend(BurstRun* runs, uint8_t& n, uint16_t gap, bool repeatFrame) {
+  uint16_t total = 0;
+  for (uint8_t i = 0; i < n; i++) total += runs[i].count;
+  if (total >= 255) return false;
+  if (n > 0) {
+    BurstRun& last = runs[n - 1];
+    uint16_t diff = gap > last.gap ? gap - last.gap : last.gap - gap;
+    uint16_t tolerance = max((uint16_t)BURST_GAP_TOLERANCE, (uint16_t)(last.gap / 32));
+    // Join the last run if it matches, or if there is no room for another
+    if (last.repeatFrame == repeatFrame && (diff <= tolerance || n == MAX_BURST_RUNS)) {
+      last.gap = ((uint32_t)last.gap * last.count + gap + last.count / 2) / (last.count + 1);
+      last.count++;
+      return true;
+    }
+    if (n == MAX_BURST_RUNS) return false;
+  }
+  runs[n++] = { gap, 1, repeatFrame };
+  return true;
+}
+
+// Mean gap in ms, the repeatInterval of a learned definition
+static uint16_t burstMeanMs(const BurstRun* runs, uint8_t n) {
+  uint32_t sum = 0, count = 0;
+  for (uint8_t i = 0; i < n; i++) {
+    sum += (uint32_t)runs[i].gap * runs[i].count;
+    count += runs[i].count;
+  }
+  return count ? (sum * BURST_GAP_UNIT_US / count + 500) / 1000 : 0;
+}
+
+// ,"bursts":[[gap us,count,repeat frame],...] (nothing for a single burst)
+static size_t appendBursts(char* out, size_t size, const BurstRun* runs, uint8_t n) {
+  if (n == 0) return 0;
+  size_t pos = snprintf(out, size, ",\"bursts\":[");
+  for (uint8_t i = 0; i < n && pos < size; i++) {
+    pos += snprintf(out + pos, size - pos, i ? ",[%lu,%u,%u]" : "[%lu,%u,%u]",
+      (unsigned long)runs[i].gap * BURST_GAP_UNIT_US, runs[i].count, runs[i].repeatFrame);
+  }
+  if (pos < size) pos += snprintf(out + pos, size - pos, "]");
+  return pos;
+}
+
+// ,"repeatFrame":[...] of a raw command (nothing without one)
+static size_t appendRepeatFrame(char* out, size_t size, const uint16_t* timings, uint8_t n) {
+  if (n == 0) return 0;
+  size_t pos = snprintf(out, size, ",\"repeatFrame\":[");
+  for (uint8_t i = 0; i < n && pos < size; i++) {
+    pos += snprintf(out + pos, size - pos, i ? ",%u" : "%u", timings[i]);
+  }
+  if (pos < size) pos += snprintf(out + pos, size - pos, "]");
+  return pos;
+}
+
+// ====== Send Acknowledgements ======
+// A send request is either a bare command name (acked with OK:name / ERR:... on
+// TOPIC_STATE) or {"name":"tv_power","id":"r42","ts":1712345678901}. Requests
+// with an id get a compact record on TOPIC_ACK instead:
+//   {"id":"r42","ts":1712345678901,"ok":1,"q":850,"air":67512}
+//   {"id":"r43","ok":0,"err":"NOT_FOUND"}
+// "ts" is the client timestamp echoed back, "q" the time in us from message
+// arrival to the first burst, "air" the IR airtime in us.
+#define ACK_ID_MAX 24
+
+struct SendRequest {
+  char name[MAX_COMMAND_NAME];
+  char id[ACK_ID_MAX];   // Empty = legacy request, string acks
+  uint64_t clientTs;
+  bool hasTs;
+  uint32_t rxAt;         // micros() when the request arrived
+  bool fleet;            // Came in on TOPIC_FLEET_SEND: ack on TOPIC_FLEET_ACK
+};
+
+// Copy s into out as the inside of a JSON string: quote and backslash escaped, control
+// characters as \u00XX. Client ids and command names are arbitrary text. Stops before
+// an escape that does not fit, so JSON_ESCAPED(n) bytes always hold an n-char string.
+#define JSON_ESCAPED(n) ((n) * 6 + 1)
+
+const char* jsonEscape(char* out, size_t size, const char* s) {
+  size_t pos = 0;
+  for (; *s; s++) {
+    uint8_t c = *s;
+    char esc[8];
+    int n;
+    if (c == '"' || c == '\\') {
+      n = snprintf(esc, sizeof(esc), "\\%c", c);
+    } else if (c < 0x20) {
+      n = snprintf(esc, sizeof(esc), "\\u%04x", c);
+    } else {
+      esc[0] = c;
+      n = 1;
+    }
+    if (pos + n >= size) break;
+    memcpy(out + pos, esc, n);
+    pos += n;
+  }
+  out[pos] = '\0';
+  return out;
+}
+
+void publishAck(const SendRequest* req, const char* name, const char* err, uint32_t queued, uint32_t airtime) {
+  char msg[OUTBOX_MSG_MAX];
+  char text[JSON_ESCAPED(MAX_COMMAND_NAME)];
+  int pos;
+  if (req->id[0]) {
+    pos = snprintf(msg, sizeof(msg), "{\"id\":\"%s\"", jsonEscape(text, sizeof(text), req->id));
+  } else {
+    pos = snprintf(msg, sizeof(msg), "{\"name\":\"%s\"", jsonEscape(text, sizeof(text), name));
+  }
+  if (req->fleet) {
+    pos += snprintf(msg + pos, sizeof(msg) - pos, ",\"dev\":\"%s\"", deviceId);
+  }
+  if (req->hasTs) {
+    pos += snprintf(msg + pos, sizeof(msg) - pos, ",\"ts\":%llu", (unsigned long long)req->clientTs);
+  }
+  if (err) {
+    snprintf(msg + pos, sizeof(msg) - pos, ",\"ok\":0,\"err\":\"%s\"}", err);
+  } else {
+    snprintf(msg + pos, sizeof(msg) - pos, ",\"ok\":1,\"q\":%lu,\"air\":%lu}",
+             (unsigned long)queued, (unsigned long)airtime);
+  }
+  enqueuePublish(req->fleet ? TOPIC_FLEET_ACK : TOPIC_ACK, msg);
+}
+
+// Bare name, or {"name":..,"id":..,"ts":..} carrying a correlation id. Returns nullptr,
+// or the error: INVALID_JSON, INVALID_ID (an id that is neither a string nor an
+// integer, which would otherwise be acked as "0"; acked by name), or NAME_TOO_LONG (cut
+// short, the name could match another command that it starts with). The id is filled
+// in before the name check, so a too-long name is still acked by id.
+const char* parseSendRequest(const char* buf, uint32_t rxAt, SendRequest* req) {
+  memset(req, 0, sizeof(*req));
+  req->rxAt = rxAt;
+  const char* name = buf;
+  StaticJsonDocument<192> doc;
+  if (buf[0] == '{') {
+    if (deserializeJson(doc, buf)) return "INVALID_JSON";
+    name = doc["name"] | "";
+    req->hasTs = !doc["ts"].isNull();
+    req->clientTs = doc["ts"].as<unsigned long long>();
+    JsonVariant id = doc["id"];
+    if (id.is<const char*>()) {
+      strncpy(req->id, id.as<const char*>(), ACK_ID_MAX - 1);
+    } else if (id.is<unsigned long long>()) {
+      snprintf(req->id, ACK_ID_MAX, "%llu", id.as<unsigned long long>());
+    } else if (id.is<long long>()) {
+      snprintf(req->id, ACK_ID_MAX, "%lld", id.as<long long>());
+    } else if (!id.isNull()) {
+      if (strlen(name) < MAX_COMMAND_NAME) strcpy(req->name, name);
+      return "INVALID_ID";
+    }
+  }
+  if (strlen(name) >= MAX_COMMAND_NAME) return "NAME_TOO_LONG";
+  strcpy(req->name, name);
+  return nullptr;
+}
+
+// ====== Emitter Channels ======
+// Every emitter in IR_SEND_PINS has its own RMT TX channel, a queue of SEND_QUEUE
+// sends and a scheduler, so sends on different emitters go out at the same time and
+// throughput grows with the number of emitters. A send is rendered into its channel's
+// item buffer as frames and the gaps between them, as many bursts as fit (renderChunk
+// in ir_frames.h), and written without waiting: the RMT hardware times every edge and
+// makes the carrier while loop() carries on. handleChannels() starts the next chunk,
+// or the next queued send, once a channel goes idle. A chunk ends on the gap before
+// its following burst, so only sends longer than one chunk (long raw frames with many
+// repeats) see the loop latency, as a slightly longer gap at the split. A definition's
+// "channel" picks the emitter; a channel this device does not have sends on channel 0,
+// so shared definitions work on every device. A send that finds its queue full is
+// rejected with ERR:QUEUE_FULL:name (ack err "QUEUE_FULL"); the ack of a queued send
+// follows its last burst.
+#include <driver/rmt.h>
+
+#define SEND_QUEUE 4              // Sends per channel, including the one on air
+#define RMT_CLK_DIV 80            // 1 us ticks from the 80 MHz APB clock, as IR_LEVEL_MAX assumes
+#define RMT_SOURCE_HZ 80000000UL  // The carrier generator counts APB cycles
+#define SEND_SETTLE_US 20000      // Silence between two sends, so receivers see separate frames
+#define SEND_BLINK_MS 1200        // Three blinks after a raw send
+
+struct SendJob {
+  SendRequest req;    // Name, correlation id, arrival
+  CommandHandle cmd;  // Re-resolved by name if evicted or deleted meanwhile
+  bool hold;          // Repeats until released (see Hold to Repeat)
+  bool released;
+  uint32_t deadline;  // millis(), holds only
+};
+
+struct SendChannel {
+  SendJob queue[SEND_QUEUE];  // queue[head] is the send on air
+  uint8_t head, count;
+  bool onAir;                 // A chunk is being transmitted
+  bool started;               // queue[head] has rendered its first frame
+  IrBurstState state;         // Its progress through the bursts
+  uint8_t run, taken;         // Burst profile run of the next burst, bursts taken from it
+  uint32_t queued;            // Arrival to first frame, us
+  uint32_t firstAt;           // micros()
+  uint32_t idleAt;            // micros() when the last send finished
+  IrChunk chunk;
+};
+
+static_assert(sizeof(IrItem) == sizeof(rmt_item32_t), "IrItem is written as rmt_item32_t");
+
+static SendChannel channels[SEND_CHANNELS];
+static uint32_t sendBlinkAt = 0;  // millis() of the last raw send, 0 = none
+
+static bool holdCadence(const StoredCommand* cmd, uint32_t frameUs, uint32_t* gapUs, bool* repeatFrame);
+
+static uint8_t channelOf(const StoredCommand* cmd) {
+  return cmd->channel < SEND_CHANNELS ? cmd->channel : 0;
+}
+
+void channelsBegin() {
+  for (uint8_t i = 0; i < SEND_CHANNELS; i++) {
+    rmt_config_t cfg = RMT_DEFAULT_CONFIG_TX((gpio_num_t)sendPins[i], (rmt_channel_t)i);
+    cfg.clk_div = RMT_CLK_DIV;
+    cfg.tx_config.carrier_en = true;
+    cfg.tx_config.carrier_freq_hz = RAW_FREQ_DEFAULT * 1000;
+    cfg.tx_config.carrier_duty_percent = RAW_DUTY_DEFAULT;
+    cfg.tx_config.carrier_level = RMT_CARRIER_LEVEL_HIGH;
+    cfg.tx_config.idle_output_en = true;
+    cfg.tx_config.idle_level = RMT_IDLE_LEVEL_LOW;
+    if (rmt_config(&cfg) != ESP_OK || rmt_driver_install(cfg.channel, 0, 0) != ESP_OK) {
+      LOGE("ERROR: No RMT channel %u for GPIO %u", i, sendPins[i]);
+    }
+  }
+  LOGI("%u emitter channel(s)", (unsigned)SEND_CHANNELS);
+}
+
+static void channelWrite(uint8_t ch, uint16_t kHz, uint8_t duty, bool wait) {
+  SendChannel& c = channels[ch];
+  uint32_t hz = (uint32_t)kHz * 1000;
+  uint32_t period = (RMT_SOURCE_HZ + hz / 2) / hz;
+  uint16_t high = period * duty / 100;
+  rmt_set_tx_carrier((rmt_channel_t)ch, true, high, period - high, RMT_CARRIER_LEVEL_HIGH);
+  rmt_write_items((rmt_channel_t)ch, (const rmt_item32_t*)c.chunk.items, c.chunk.itemCount + c.chunk.half, wait);
+}
+
+// Gap before the next burst of the channel's send and its frame kind; false once the
+// send has none left (never for a hold: its last run repeats)
+static bool nextBurst(SendChannel& c, const StoredCommand* cmd, bool hold, uint32_t* gapUs, bool* repeatFrame) {
+  if (cmd->burstRuns == 0) return hold && holdCadence(cmd, c.state.lastFrameUs, gapUs, repeatFrame);
+  while (c.run < cmd->burstRuns && c.taken >= cmd->bursts[c.run].count) {
+    c.run++;
+    c.taken = 0;
+  }
+  if (c.run >= cmd->burstRuns) {
+    if (!hold) return false;
+    c.run = cmd->burstRuns - 1;
+  }
+  *gapUs = (uint32_t)cmd->bursts[c.run].gap * BURST_GAP_UNIT_US;
+  *repeatFrame = cmd->bursts[c.run].repeatFrame;
+  c.taken++;
+  return true;
+}
+
+// A channel's current send as renderChunk sees it (see ir_frames.h)
+struct ChannelSource {
+  SendChannel& c;
+  const StoredCommand* cmd;
+  bool hold;
+  uint16_t kHz;
+  uint8_t duty;
+
+  const uint16_t* frame(bool repeatFrame, uint16_t* len) { return frameOf(cmd, repeatFrame, len, &kHz, &duty); }
+  bool next(uint32_t, uint32_t* gapUs, bool* repeatFrame) { return nextBurst(c, cmd, hold, gapUs, repeatFrame); }
+  void started(uint16_t burst) { trace(TRACE_BURST_START, burst); }
+};
+
+// Ack the channel's current send and take it off the queue. cmd is nullptr if it was
+// deleted while queued; state is the end of a hold (hold_end / hold_timeout).
+static void finishSend(SendChannel& c, const StoredCommand* cmd, const char* state) {
+  SendJob& job = c.queue[c.head];
+  if (c.started) {
+    airtimeHist.record(c.state.airtime);
+    sendHist.record(micros() - c.firstAt);
+  }
+  char msg[96];
+  if (job.hold) {
+    snprintf(msg, sizeof(msg), "%s:%s,frames:%u", state ? state : "hold_end", job.req.name, c.state.burst);
+    enqueuePublish(TOPIC_STATE, msg);
+    LOGD("Hold of %s ended after %u frames", job.req.name, c.state.burst);
+  } else if (!cmd) {
+    LOGW("Command deleted while queued: %s", job.req.name);
+    if (job.req.id[0] || job.req.fleet) {
+      publishAck(&job.req, job.req.name, "NOT_FOUND", 0, 0);
+    } else {
+      snprintf(msg, sizeof(msg), "ERR:NOT_FOUND:%s", job.req.name);
+      enqueuePublish(TOPIC_STATE, msg);
+    }
+  } else {
+    if (cmd->isRaw) indicateSend();
+    trace(TRACE_SEND_DONE, cmd - commandCache);
+    if (job.req.id[0] || job.req.fleet) {
+      publishAck(&job.req, cmd->name, nullptr, c.queued, c.state.airtime);
+    } else {
+      snprintf(msg, sizeof(msg), "OK:%s", cmd->name);
+      enqueuePublish(TOPIC_STATE, msg);
+    }
+    LOGD("Command sent successfully");
+  }
+  c.head = (c.head + 1) % SEND_QUEUE;
+  c.count--;
+  c.started = false;
+  c.idleAt = micros();
+}
+
+// Start the channel's next chunk once it is idle, finishing sends that are done
+static void serviceChannel(uint8_t ch) {
+  SendChannel& c = channels[ch];
+  if (c.onAir) {
+    if (rmt_wait_tx_done((rmt_channel_t)ch, 0) != ESP_OK) return;
+    c.onAir = false;
+    trace(TRACE_BURST_END, c.state.burst - 1);
+  }
+
+  while (c.count > 0) {
+    SendJob& job = c.queue[c.head];
+    StoredCommand* cmd = resolveHandle(job.cmd);
+    if (!cmd) cmd = findCommandByName(job.req.name);
+    if (!cmd) {
+      finishSend(c, nullptr, nullptr);
+      continue;
+    }
+    job.cmd = handleOf(cmd);
+
+    if (job.hold && c.started && (job.released || (int32_t)(millis() - job.deadline) >= 0)) {
+      finishSend(c, cmd, job.released ? "hold_end" : "hold_timeout");
+      continue;
+    }
+    if (!c.started) {
+      LOGD("Sending %s on channel %u, %u bursts in %u runs", cmd->name, ch, 1 + cmd->repeatCount, cmd->burstRuns);
+      uint32_t idle = micros() - c.idleAt;
+      c.started = true;
+      c.state.pending = true;
+      c.state.pendingRepeat = false;
+      c.state.pendingGapUs = idle < SEND_SETTLE_US ? SEND_SETTLE_US - idle : 0;
+      c.run = c.taken = 0;
+      c.state.burst = 0;
+      c.state.airtime = 0;
+      c.firstAt = micros() + c.state.pendingGapUs;
+      c.queued = c.firstAt - job.req.rxAt;
+    }
+
+    ChannelSource src = { c, cmd, job.hold, 0, 0 };
+    IrRender r = renderChunk(c.chunk, c.state, src, job.hold);
+    if (r == IR_RENDER_TOO_LONG) LOGE("ERROR: Frame of %s does not fit a chunk", cmd->name);
+    if (r != IR_RENDERED) {
+      finishSend(c, cmd, nullptr);
+      continue;
+    }
+    channelWrite(ch, src.kHz, src.duty, false);
+    c.onAir = true;
+    return;
+  }
+}
+
+// call from loop()
+void handleChannels() {
+  for (uint8_t ch = 0; ch < SEND_CHANNELS; ch++) serviceChannel(ch);
+}
+
+// True while an emitter sends or has just finished: the receiver sees our own frames,
+// so decodes in this window are not presses on a remote
+static bool emittersBusy() {
+  uint32_t now = micros();
+  for (uint8_t ch = 0; ch < SEND_CHANNELS; ch++) {
+    const SendChannel& c = channels[ch];
+    if (c.onAir || c.count > 0 || now - c.idleAt < SEND_SETTLE_US) return true;
+  }
+  return false;
+}
+
+// Queue a send on a channel and start it if the channel is idle
+static bool queueSend(uint8_t ch, const SendJob& job) {
+  SendChannel& c = channels[ch];
+  if (c.count == SEND_QUEUE) return false;
+  c.queue[(c.head + c.count) % SEND_QUEUE] = job;
+  c.count++;
+  serviceChannel(ch);
+  return true;
+}
+
+// Queue a cached command on its emitter; req carries the correlation id if the sender gave one
+void executeCommand(StoredCommand* cmd, const SendRequest* req = nullptr) {
+  if (!cmd) {
+    LOGE("ERROR: Null command pointer");
+    enqueuePublish(TOPIC_STATE, "ERR:NULL_COMMAND");
+    return;
+  }
+
+  SendJob job = {};
+  if (req) {
+    job.req = *req;
+  } else {
+    strncpy(job.req.name, cmd->name, MAX_COMMAND_NAME - 1);
+    job.req.rxAt = micros();
+  }
+  job.cmd = handleOf(cmd);
+  if (queueSend(channelOf(cmd), job)) return;
+
+  LOGW("Send queue of channel %u full, dropping %s", channelOf(cmd), cmd->name);
+  if (job.req.id[0] || job.req.fleet) {
+    publishAck(&job.req, cmd->name, "QUEUE_FULL", 0, 0);
+    return;
+  }
+  char msg[96];
+  snprintf(msg, sizeof(msg), "ERR:QUEUE_FULL:%s", cmd->name);
+  enqueuePublish(TOPIC_STATE, msg);
+}
+
+// Send one full frame on the command's channel and wait for it (the bench, which
+// waits for the channel to drain first)
+void transmitFrame(const StoredCommand* cmd) {
+  uint8_t ch = channelOf(cmd);
+  SendChannel& c = channels[ch];
+  uint16_t len, kHz;
+  uint8_t duty;
+  const uint16_t* frame = frameOf(cmd, false, &len, &kHz, &duty);
+  chunkClear(c.chunk);
+  if (!frame || !frameFits(c.chunk, frame, len)) return;
+  framePush(c.chunk, frame, len);
+  channelWrite(ch, kHz, duty, true);
+}
+
+// blink onboard led to indicate sending; loop() drives the blinks
+void indicateSend() {
+  sendBlinkAt = millis() | 1;
+}
+
+// ====== Hold to Repeat ======
+// A press on TOPIC_PRESS sends the command once and then keeps sending its repeat at
+// the native cadence until a release on TOPIC_RELEASE, as a remote does while a button
+// is held: a volume slider ramps with two messages instead of one send per step.
+// The cadence is the command's burst profile with its last run repeating for as long
+// as the hold lasts; commands without a profile repeat at their protocol's frame
+// period (HOLD_CADENCE). A hold is a send on the command's emitter channel that renders
+// one burst per chunk, so the RMT times the frames and a release stops at the next one.
+// Press: a name or {"name":"tv_vol_up","timeout":5000}. Pressing the held command
+// again refreshes the hold; another command on the same emitter replaces it. Release:
+// the name, or empty for everything held. Without a release the hold ends "timeout" ms
+// (default HOLD_TIMEOUT_MS, at most HOLD_MAX_MS) after the last press, so a lost
+// release cannot leave the volume climbing. State: hold:<name>, then
+// hold_end:<name>,frames:N or hold_timeout:<name>,frames:N.
+#define HOLD_TIMEOUT_MS 3000
+#define HOLD_MAX_MS 30000
+#define HOLD_PERIOD_RAW_MS 110  // Raw commands without a profile: NEC-like
+
+struct HoldCadence {
+  Proto proto;
+  uint8_t periodMs;  // Frame start to frame start, as IRremote repeats; 0 = fixed gap
+  bool repeatFrame;  // Repeat code rather than the full frame
+};
+
+#define JVC_REPEAT_GAP_US 23625  // IRremote's JVC_REPEAT_DISTANCE, 45 units of 525us
+
+static const HoldCadence HOLD_CADENCE[] = {
+  { Proto::NEC, 110, true },       { Proto::LG, 110, true },       { Proto::Samsung, 110, false },
+  { Proto::Sony12, 45, false },    { Proto::JVC, 0, true },        { Proto::RC5, 114, false },
+  { Proto::RC6, 107, false },      { Proto::Panasonic, 130, false },
+};
+
+// Gap after a frame of frameUs and the kind of the next frame, for holds of commands
+// without a burst profile
+static bool holdCadence(const StoredCommand* cmd, uint32_t frameUs, uint32_t* gapUs, bool* repeatFrame) {
+  uint32_t periodMs = HOLD_PERIOD_RAW_MS;
+  *repeatFrame = false;
+  if (!cmd->isRaw) {
+    Proto proto = parseProto(cmd->protocol.proto);
+    for (const HoldCadence& c : HOLD_CADENCE) {
+      if (c.proto == proto) {
+        periodMs = c.periodMs;
+        *repeatFrame = c.repeatFrame;
+        break;
+      }
+    }
+  }
+  if (periodMs == 0) {
+    *gapUs = JVC_REPEAT_GAP_US;  // Headerless JVC frames vary in length with the data
+  } else {
+    *gapUs = periodMs * 1000 > frameUs ? periodMs * 1000 - frameUs : 0;
+  }
+  return true;
+}
+
+void handleHoldPress(const char* buf) {
+  char name[MAX_COMMAND_NAME] = "";
+  long timeout = HOLD_TIMEOUT_MS;
+  if (buf[0] == '{') {
+    StaticJsonDocument<128> doc;
+    if (deserializeJson(doc, buf)) {
+      enqueuePublish(TOPIC_STATE, "ERR:INVALID_JSON");
+      return;
+    }
+    const char* requested = doc["name"] | "";
+    if (strlen(requested) >= MAX_COMMAND_NAME) {
+      enqueuePublish(TOPIC_STATE, "ERR:NAME_TOO_LONG");
+      return;
+    }
+    strcpy(name, requested);
+    timeout = doc["timeout"] | (long)HOLD_TIMEOUT_MS;
+    timeout = constrain(timeout, 1L, (long)HOLD_MAX_MS);
+  } else if (strlen(buf) >= MAX_COMMAND_NAME) {
+    enqueuePublish(TOPIC_STATE, "ERR:NAME_TOO_LONG");
+    return;
+  } else {
+    strcpy(name, buf);
+  }
+  if (name[0] == '\0') {
+    enqueuePublish(TOPIC_STATE, "ERR:EMPTY_COMMAND_NAME");
+    return;
+  }
+  if (benchActive) {
+    enqueuePublish(TOPIC_STATE, "ERR:BUSY");  // The bench owns the receiver
+    return;
+  }
+
+  char msg[96];
+  StoredCommand* cmd = findCommandByName(name);
+  if (!cmd) {
+    LOGW("Command not found: %s", name);
+    snprintf(msg, sizeof(msg), "ERR:NOT_FOUND:%s", name);
+    enqueuePublish(TOPIC_STATE, msg);
+    return;
+  }
+
+  // Keepalive of the running hold, or end it for the new one
+  uint8_t ch = channelOf(cmd);
+  SendChannel& c = channels[ch];
+  for (uint8_t i = 0; i < c.count; i++) {
+    SendJob& job = c.queue[(c.head + i) % SEND_QUEUE];
+    if (!job.hold || job.released) continue;
+    if (strcmp(job.req.name, name) == 0) {
+      job.deadline = millis() + timeout;
+      return;
+    }
+    job.released = true;
+  }
+
+  SendJob job = {};
+  strncpy(job.req.name, name, MAX_COMMAND_NAME - 1);
+  job.req.rxAt = micros();
+  job.cmd = handleOf(cmd);
+  job.hold = true;
+  job.deadline = millis() + timeout;
+  trace(TRACE_CMD_RESOLVED, cmd - commandCache);
+  if (!queueSend(ch, job)) {
+    snprintf(msg, sizeof(msg), "ERR:QUEUE_FULL:%s", name);
+    enqueuePublish(TOPIC_STATE, msg);
+    return;
+  }
+  snprintf(msg, sizeof(msg), "hold:%s", name);
+  enqueuePublish(TOPIC_STATE, msg);
+  LOGD("Hold of %s on channel %u for up to %ld ms", name, ch, timeout);
+}
+
+void handleHoldRelease(const char* buf) {
+  for (uint8_t ch = 0; ch < SEND_CHANNELS; ch++) {
+    SendChannel& c = channels[ch];
+    for (uint8_t i = 0; i < c.count; i++) {
+      SendJob& job = c.queue[(c.head + i) % SEND_QUEUE];
+      if (job.hold && (buf[0] == '\0' || strcmp(buf, job.req.name) == 0)) job.released = true;
+    }
+  }
+}
+
+// ====== Catalogue Versioning ======
+// Each definition is stamped with an FNV-1a hash over its name and payload bytes as
+// received. A retained replay of an unchanged definition (every reconnect) is detected
+// from the stamp alone and skips JSON parsing entirely. The catalogue digest is the
+// order-independent sum of all stamps; the retained manifest carries the expected
+// count and digest so drift is visible without pulling every payload.
+enum class SyncState : uint8_t { Idle, Loading, Ready };
+static SyncState syncState = SyncState::Idle;  // See Load Barrier
+static uint32_t  syncStart = 0;
+static uint32_t  syncNonce = 0;
+static bool      syncSentinelSeen = false;
+
+static bool     manifestKnown  = false;
+static uint16_t manifestCount  = 0;
+static uint32_t manifestDigest = 0;
+static bool     manifestInSync = false;  // Result of the last checkManifest()
+
+uint32_t entryVersion(const char* name, const char* payload, size_t len) {
+  uint32_t h = fnv1a(2166136261u, name, strlen(name));
+  return fnv1a(h, payload, len);
+}
+
+uint32_t catalogueDigest() {
+  uint32_t digest = 0;
+  for (uint16_t i = 0; i < coldSlots; i++) {
+    if (coldSlotState(i) == COLD_USED) digest += coldMeta[i].version;
+  }
+  return digest;
+}
+
+// Compare the cache against the last manifest and report
+void checkManifest() {
+  if (!manifestKnown) return;
+  uint32_t digest = catalogueDigest();
+  char msg[96];
+  manifestInSync = commandCount == manifestCount && digest == manifestDigest;
+  if (manifestInSync) {
+    snprintf(msg, sizeof(msg), "sync:ok,count:%u", commandCount);
+  } else {
+    snprintf(msg, sizeof(msg), "sync:drift,local:%u/%08lx,manifest:%u/%08lx",
+      commandCount, (unsigned long)digest, manifestCount, (unsigned long)manifestDigest);
+  }
+  enqueuePublish(TOPIC_STATE, msg);
+  LOGI("%s", msg);
+}
+
+// Publish a manifest that accounts for a definition this device just published (call
+// before its echo is processed). Only done while in sync, so the device never
+// overwrites a newer external manifest.
+void updateManifestFor(const char* name, const char* payload, size_t len) {
+  if (!manifestKnown || !manifestInSync) return;
+
+  int16_t existing = coldFind(name);
+  manifestDigest += entryVersion(name, payload, len);
+  if (existing >= 0) {
+    manifestDigest -= coldMeta[existing].version;
+  } else {
+    manifestCount++;
+  }
+
+  char msg[64];
+  snprintf(msg, sizeof(msg), "{\"count\":%u,\"hash\":\"%08lx\"}", manifestCount, (unsigned long)manifestDigest);
+  mqtt.publish(TOPIC_MANIFEST, msg, true);
+}
+
+uint8_t affinityRank(JsonVariant affinity);  // See Fleet Routing
+
+// Definition being parsed or imported, before it is written through
+static StoredCommand staged;
+
+// Write a complete definition to the cold tier, and refresh the hot copy if there is
+// one. New commands are not promoted until used.
+bool storeCommand(StoredCommand* cmd) {
+  cmd->fingerprint = commandFingerprint(cmd);
+
+  int16_t existing = coldFind(cmd->name);
+  LOGD("%s command: %s", existing >= 0 ? "Updating" : "Adding new", cmd->name);
+  int16_t slot = coldWrite(cmd, existing);
+  if (slot == COLD_WRITE_FAILED) {
+    char msg[96];
+    snprintf(msg, sizeof(msg), "ERR:STORE_FAILED:%s", cmd->name);
+    enqueuePublish(TOPIC_STATE, msg);
+    return false;
+  }
+  if (slot < 0) {
+    LOGE("ERROR: Command cache full");
+    enqueuePublish(TOPIC_STATE, "ERR:CACHE_FULL");
+    return false;
+  }
+
+  // Keep a hot copy and the recognition index in sync
+  StoredCommand* hot = hotFind(cmd->name);
+  if (hot) {
+    bool rekey = hot->fingerprint != cmd->fingerprint;
+    if (rekey) indexRemove(hot - commandCache);
+    bool referenced = hot->referenced;
+    *hot = *cmd;
+    hot->coldSlot = slot;
+    hot->referenced = referenced;
+    if (rekey) {
+      indexInsert(hot - commandCache);
+      compactRecognizeIndex();
+    }
+  }
+
+  return true;
+}
+
+// err: RAW_TIMINGS or RAW_CARRIER
+static void rejectRaw(const char* err, const char* name) {
+  char msg[96];
+  snprintf(msg, sizeof(msg), "ERR:%s:%s", err, name);
+  enqueuePublish(TOPIC_STATE, msg);
+}
+
+// Add or update command from its JSON definition
+bool addOrUpdateCommand(const char* name, JsonDocument& doc, uint32_t version, bool shared) {
+  if (strlen(name) >= MAX_COMMAND_NAME) {
+    LOGE("ERROR: Command name too long");
+    return false;
+  }
+
+  StoredCommand* cmd = &staged;
+  memset(cmd, 0, sizeof(*cmd));
+
+  // Copy name
+  strncpy(cmd->name, name, MAX_COMMAND_NAME - 1);
+  cmd->name[MAX_COMMAND_NAME - 1] = '\0';
+  cmd->version = version;
+  cmd->shared = shared;
+
+  // Parse repeat fields (default to 0 if not present for backward compatibility)
+  cmd->repeatCount = doc["repeatCount"] | 0;
+  cmd->repeatInterval = doc["repeatInterval"] | 0;
+
+  // Burst profile: "bursts":[[gap us,count,repeat frame],...], else repeatCount full
+  // frames repeatInterval ms apart
+  JsonArray bursts = doc["bursts"];
+  if (!bursts.isNull()) {
+    uint16_t total = 0;
+    for (JsonArray run : bursts) {
+      uint32_t gap = run[0] | 0UL;
+      uint16_t count = run[1] | 0;
+      if (cmd->burstRuns == MAX_BURST_RUNS || count == 0 || gap / BURST_GAP_UNIT_US > 0xFFFF || total + count > 255) {
+        LOGE("ERROR: Invalid burst profile");
+        char msg[96];
+        snprintf(msg, sizeof(msg), "ERR:BURSTS:%s", name);
+        enqueuePublish(TOPIC_STATE, msg);
+        return false;
+      }
+      cmd->bursts[cmd->burstRuns++] = { (uint16_t)(gap / BURST_GAP_UNIT_US), (uint8_t)count, (uint8_t)(run[2] | 0 ? 1 : 0) };
+      total += count;
+    }
+    cmd->repeatCount = total;
+  } else if (cmd->repeatCount > 0) {
+    uint32_t gap = (uint32_t)cmd->repeatInterval * 1000 / BURST_GAP_UNIT_US;
+    cmd->bursts[0] = { (uint16_t)min(gap, (uint32_t)0xFFFF), cmd->repeatCount, 0 };
+    cmd->burstRuns = 1;
+  }
+
+  if (cmd->repeatCount > 0) {
+    LOGD("  Repeat info: count=%u, runs=%u", cmd->repeatCount, cmd->burstRuns);
+  }
+
+  // Emitter (see Emitter Channels)
+  long channel = doc["channel"] | 0L;
+  if (channel < 0 || channel >= MAX_SEND_CHANNELS) {
+    LOGE("ERROR: Channel %ld out of range", channel);
+    char msg[96];
+    snprintf(msg, sizeof(msg), "ERR:CHANNEL:%s", name);
+    enqueuePublish(TOPIC_STATE, msg);
+    return false;
+  }
+  cmd->channel = channel;
+
+  // Check if raw or protocol command
+  if (doc["raw"].is<bool>() && doc["raw"]) {
+    // Raw command
+    cmd->isRaw = true;
+    long freq = doc["freq"] | RAW_FREQ_DEFAULT;
+    long duty = doc["duty"] | RAW_DUTY_DEFAULT;
+    if (!carrierValid(freq, duty)) {
+      LOGE("ERROR: Carrier out of range: %ldkHz, %ld%%", freq, duty);
+      rejectRaw("RAW_CARRIER", name);
+      return false;
+    }
+    cmd->raw.freq = freq;
+    cmd->raw.duty = duty;
+
+    // Timings come packed ("len" + base64 "packed", as learned) or as a "data" array
+    const char* packed = doc["packed"];
+    if (packed) {
+      int n = rawBase64Decode(packed, cmd->raw.packed, MAX_RAW_PACKED);
+      cmd->raw.len = doc["len"] | 0;
+      if (n < 0 || cmd->raw.len > MAX_RAW_DATA || !rawDecode(cmd->raw.packed, n, rawTimings, cmd->raw.len)) {
+        LOGE("ERROR: Invalid packed timings");
+        rejectRaw("RAW_TIMINGS", name);
+        return false;
+      }
+      cmd->raw.packedLen = n;
+    } else {
+      JsonArray dataArray = doc["data"];
+      cmd->raw.len = min((int)dataArray.size(), MAX_RAW_DATA);
+      for (uint16_t i = 0; i < cmd->raw.len; i++) {
+        rawTimings[i] = dataArray[i];
+      }
+      cmd->raw.packedLen = rawEncode(rawTimings, cmd->raw.len, cmd->raw.packed, MAX_RAW_PACKED);
+      if (cmd->raw.packedLen == 0 && cmd->raw.len > 0) {
+        LOGE("ERROR: Raw timings do not fit %u bytes", MAX_RAW_PACKED);
+        rejectRaw("RAW_TIMINGS", name);
+        return false;
+      }
+    }
+
+    // Repeat frame sent by "bursts" runs flagged 1, e.g. "repeatFrame":[9000,2250,560]
+    JsonArray repeatFrame = doc["repeatFrame"];
+    if (repeatFrame.size() > MAX_REPEAT_FRAME) {
+      LOGE("ERROR: Repeat frame longer than %u values", MAX_REPEAT_FRAME);
+      rejectRaw("RAW_TIMINGS", name);
+      return false;
+    }
+    for (JsonVariant v : repeatFrame) cmd->raw.repeatFrame[cmd->raw.repeatLen++] = v;
+
+    LOGD("  Raw command: freq=%u, duty=%u, len=%u, packed=%u bytes", cmd->raw.freq, cmd->raw.duty, cmd->raw.len, cmd->raw.packedLen);
+  } else {
+    // Protocol command
+    cmd->isRaw = false;
+
+    const char* proto = doc["proto"] | "NEC";
+    strncpy(cmd->protocol.proto, proto, 15);
+    cmd->protocol.proto[15] = '\0';
+
+    cmd->protocol.addr = doc["addr"] | 0;
+    cmd->protocol.cmd = doc["cmd"] | 0;
+    cmd->protocol.rpt = doc["rpt"] | 0;
+
+    LOGD("  Protocol command: %s, addr=%u, cmd=%u", cmd->protocol.proto, cmd->protocol.addr, cmd->protocol.cmd);
+  }
+
+  cmd->fleetRank = affinityRank(doc["affinity"]);
+  return storeCommand(cmd);
+}
+
+// Delete command from both tiers
+bool deleteCommand(const char* name) {
+  int16_t slot = coldFind(name);
+  if (slot < 0) return false;
+  LOGD("Deleting command: %s", name);
+  coldRetire(slot);
+
+  StoredCommand* hot = hotFind(name);
+  if (hot) hotRemove(hot - commandCache);
+  return true;
+}
+
+// ====== REMOVED: Hardcoded Commands ======
+// All commands now stored as MQTT retained messages on broker.
+// See migration script to publish these to MQTT.
+//
+// OLD TV COMMANDS (Samsung, addr=7):
+//   tv_power    -> cmd=2
+//   tv_vol_up   -> cmd=7
+//   tv_vol_down -> cmd=11
+//   tv_mute     -> cmd=15
+//
+// OLD FAN RAW COMMANDS:
+//   fan_power        -> 95 values: 1330,270,1380,270,580,1220,1280,270,1430,320,480,1220,430,1220,480,1220,430,1220,430,1220,430,1220,1330,7070,1280,370,1330,270,530,1220,1330,220,1430,270,580,1220,480,1170,480,1170,480,1170,480,1220,430,1220,1330,8020,1330,320,1330,370,480,1220,1280,370,1330,320,480,1220,480,1170,430,1220,430,1270,430,1220,430,1220,1280,7120,1280,370,1280,420,430,1220,1280,420,1280,370,430,1270,380,1270,430,1220,430,1270,380,1270,380,1270,1230
+//   fan_speed_up     -> 57 values: 1180,2420,230,1320,180,770,230,420,230,120,180,120,380,170,180,220,280,1470,180,1470,280,1370,230,1420,330,1320,1180,570,280,170,180,7520,1180,520,1180,520,230,1420,1180,520,1180,570,180,1420,280,1370,230,1370,380,1320,280,120,230,1020,1180,570,280
+//   fan_speed_down   -> 47 values: 1280,370,1330,370,430,1220,1280,320,1380,320,530,1220,430,1220,1230,420,430,1270,380,1270,1280,320,530,7870,1280,320,1380,370,430,1270,1230,370,1330,370,480,1220,430,1220,1280,370,480,1220,430,1220,1280,320,530
+//   fan_rotate       -> 35 values: 1230,120,1580,420,380,1270,230,120,880,470,230,120,880,420,130,120,180,1220,230,1470,230,120,280,120,130,120,230,470,230,1370,230,1470,230,1420,230
+//
+// Run the migration Python script to publish these to MQTT broker as retained messages.
+
+// ====== Device Identity ======
+// The device id selects the topic namespace (home/ir/<id>/) and the MQTT client id
+// (esp32-ir-<id>). It is kept in NVS; DEVICE_ID from credentials.h is only the
+// first-boot default, so one firmware image serves every blaster in the house.
+#ifndef DEVICE_ID
+#define DEVICE_ID "1"
+#endif
+
+static Preferences prefs;
+static char mqttClientId[DEVICE_ID_MAX + 9];
+
+static void buildTopic(char* dst, const char* suffix) {
+  snprintf(dst, TOPIC_MAX, TOPIC_ROOT "%s/%s", deviceId, suffix);
+}
+
+void buildTopics() {
+  buildTopic(topics.send, "send");
+  buildTopic(topics.state, "state");
+  buildTopic(topics.ack, "ack");
+  buildTopic(topics.learn, "learn");
+  buildTopic(topics.listen, "listen");
+  buildTopic(topics.commands, "commands/#");
+  buildTopic(topics.commandsPrefix, "commands/");
+  topics.commandsPrefixLen = strlen(topics.commandsPrefix);
+  buildTopic(topics.catalogFilter, "catalog");
+  buildTopic(topics.deviceId, "device_id");
+  buildTopic(topics.manifest, "manifest");
+  buildTopic(topics.sync, "sync");
+  buildTopic(topics.receive, "receive");
+  buildTopic(topics.received, "received");
+  buildTopic(topics.metrics, "metrics");
+  buildTopic(topics.metricsGet, "metrics/get");
+  buildTopic(topics.profile, "profile");
+  buildTopic(topics.bench, "bench");
+  buildTopic(topics.benchResult, "bench/result");
+  buildTopic(topics.trace, "trace");
+  buildTopic(topics.traceDump, "trace/dump");
+  buildTopic(topics.exportReq, "export");
+  buildTopic(topics.exportData, "export/data");
+  buildTopic(topics.importData, "import");
+  buildTopic(topics.press, "press");
+  buildTopic(topics.release, "release");
+  snprintf(mqttClientId, sizeof(mqttClientId), "esp32-ir-%s", deviceId);
+}
+
+// Topic-safe ids only; "catalog" and "fleet" are taken by shared topics
+bool validDeviceId(const char* id) {
+  size_t n = strlen(id);
+  if (n == 0 || n >= DEVICE_ID_MAX || strcmp(id, "catalog") == 0 || strcmp(id, "fleet") == 0) return false;
+  for (size_t i = 0; i < n; i++) {
+    if (!isalnum((unsigned char)id[i]) && id[i] != '_' && id[i] != '-') return false;
+  }
+  return true;
+}
+
+void loadDeviceId() {
+  prefs.begin("irblaster", true);
+  if (prefs.getString("device_id", deviceId, sizeof(deviceId)) == 0 || !validDeviceId(deviceId)) {
+    strncpy(deviceId, DEVICE_ID, DEVICE_ID_MAX - 1);
+  }
+  prefs.end();
+  buildTopics();
+}
+
+// Save a new id and reboot into its namespace (retained state under the old id is
+// left alone; the broker marks it offline through the last will)
+void changeDeviceId(const char* id) {
+  if (!validDeviceId(id)) {
+    enqueuePublish(TOPIC_STATE, "ERR:INVALID_DEVICE_ID");
+    return;
+  }
+  if (strcmp(id, deviceId) == 0) return;
+
+  prefs.begin("irblaster", false);
+  prefs.putString("device_id", id);
+  prefs.end();
+
+  char msg[64];
+  snprintf(msg, sizeof(msg), "device_id:%s,rebooting", id);
+  mqtt.publish(TOPIC_STATE, msg);  // Direct: the outbox is not flushed again
+  LOGI("Device id changed to %s, rebooting", id);
+  delay(100);
+  ESP.restart();
+}
+
+// ====== Shared Catalogue ======
+// Definitions common to the fleet are published once, retained, to
+// home/ir/catalog/<name>. Each device caches the subset named by its retained filter
+// on home/ir/<id>/catalog, e.g. {"names":["tv_*","ac_power"]} (trailing * = prefix);
+// no filter means every shared command. A definition on the device's own
+// commands/<name> topic overrides the shared one of the same name.
+//
+// A filter of exact names is subscribed per name so the broker only delivers those;
+// any prefix entry falls back to catalog/# with the filter applied here. The filter
+// is kept in NVS so the right subscriptions are made before it is replayed.
+#define CATALOG_FILTER_MAX 24
+#define CATALOG_FILTER_JSON_MAX 1024
+
+static char     catalogFilter[CATALOG_FILTER_MAX][MAX_COMMAND_NAME];
+static uint8_t  catalogFilterCount = 0;
+static bool     catalogFilterSet = false;  // No filter = every shared command
+static bool     catalogFilterExact = false;
+static uint32_t catalogFilterHash = 0;   // Of the filter payload, to skip replays
+
+bool catalogWants(const char* name) {
+  if (!catalogFilterSet) return true;
+  for (uint8_t i = 0; i < catalogFilterCount; i++) {
+    const char* f = catalogFilter[i];
+    size_t n = strlen(f);
+    if (n > 0 && f[n - 1] == '*') {
+      if (strncmp(name, f, n - 1) == 0) return true;
+    } else if (strcmp(name, f) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static void catalogTopic(char* dst, size_t size, const char* name) {
+  snprintf(dst, size, TOPIC_CATALOG "%s", name);
+}
+
+// Subscribe (or unsubscribe) the shared definitions the current filter selects
+void subscribeCatalog(bool subscribe) {
+  char t[TOPIC_MAX + MAX_COMMAND_NAME];
+  if (!catalogFilterExact) {
+    catalogTopic(t, sizeof(t), "#");
+    subscribe ? mqtt.subscribe(t) : mqtt.unsubscribe(t);
+    return;
+  }
+  for (uint8_t i = 0; i < catalogFilterCount; i++) {
+    catalogTopic(t, sizeof(t), catalogFilter[i]);
+    subscribe ? mqtt.subscribe(t) : mqtt.unsubscribe(t);
+  }
+}
+
+// Have the broker replay one shared definition (e.g. after its override was deleted)
+void refetchShared(const char* name) {
+  if (!catalogWants(name)) return;
+  char t[TOPIC_MAX + MAX_COMMAND_NAME];
+  catalogTopic(t, sizeof(t), catalogFilterExact ? name : "#");
+  mqtt.subscribe(t);  // Re-subscribing re-delivers retained messages
+}
+
+bool parseCatalogFilter(const char* json) {
+  catalogFilterCount = 0;
+  catalogFilterSet = false;
+  catalogFilterExact = false;
+  if (json[0] == '\0') return true;
+
+  StaticJsonDocument<CATALOG_FILTER_JSON_MAX> doc;
+  if (deserializeJson(doc, json)) return false;
+  catalogFilterSet = true;
+  catalogFilterExact = true;
+  for (JsonVariant v : doc["names"].as<JsonArray>()) {
+    const char* f = v | "";
+    if (f[0] == '\0' || strlen(f) >= MAX_COMMAND_NAME || catalogFilterCount >= CATALOG_FILTER_MAX) continue;
+    strcpy(catalogFilter[catalogFilterCount++], f);
+    if (strchr(f, '*')) catalogFilterExact = false;
+  }
+  return true;  // An empty list selects nothing
+
+}
+
+void loadCatalogFilter() {
+  static char json[CATALOG_FILTER_JSON_MAX];
+  prefs.begin("irblaster", true);
+  size_t n = prefs.getString("cat_filter", json, sizeof(json));
+  prefs.end();
+  if (n == 0) json[0] = '\0';
+  if (!parseCatalogFilter(json)) parseCatalogFilter("");
+  catalogFilterHash = fnv1a(2166136261u, json, strlen(json));
+}
+
+// New filter from the broker: swap subscriptions and drop shared entries it excludes
+void applyCatalogFilter(const char* json, size_t len) {
+  uint32_t hash = fnv1a(2166136261u, json, len);
+  if (hash == catalogFilterHash) return;  // Retained replay of the current filter
+  if (len >= CATALOG_FILTER_JSON_MAX) {
+    enqueuePublish(TOPIC_STATE, "ERR:CATALOG_FILTER_SIZE");
+    return;
+  }
+
+  subscribeCatalog(false);
+  if (!parseCatalogFilter(json)) {
+    enqueuePublish(TOPIC_STATE, "ERR:INVALID_JSON");
+    loadCatalogFilter();  // Keep the previous filter
+    subscribeCatalog(true);
+    return;
+  }
+  catalogFilterHash = hash;
+  prefs.begin("irblaster", false);
+  prefs.putString("cat_filter", json);
+  prefs.end();
+
+  for (uint16_t i = 0; i < coldSlots; i++) {
+    char name[MAX_COMMAND_NAME];
+    if (coldSlotState(i) != COLD_USED || !(coldState[i] & COLD_FLAG_SHARED)) continue;
+    if (coldReadName(i, name) && !catalogWants(name)) {
+      deleteCommand(name);
+      char msg[96];
+      snprintf(msg, sizeof(msg), "deleted:%s", name);
+      enqueuePublish(TOPIC_STATE, msg);
+    }
+  }
+  subscribeCatalog(true);
+
+  char msg[64];
+  if (catalogFilterSet) {
+    snprintf(msg, sizeof(msg), "catalog_filter:%u", catalogFilterCount);
+  } else {
+    snprintf(msg, sizeof(msg), "catalog_filter:all");
+  }
+  enqueuePublish(TOPIC_STATE, msg);
+  LOGI("Catalogue filter: %u entries%s", catalogFilterCount, catalogFilterExact ? " (exact)" : "");
+}
+
+// Command definition from the device's commands/<name> or the shared catalogue
+void handleDefinition(const char* commandName, const char* buf, unsigned int len, bool shared) {
+  if (shared && !catalogWants(commandName)) return;
+  int16_t existing = coldFind(commandName);
+  if (shared && existing >= 0 && !(coldState[existing] & COLD_FLAG_SHARED)) return;  // Device override wins
+
+  // Empty payload = delete command
+  if (len == 0) {
+    if (deleteCommand(commandName)) {
+      LOGI("Deleted command: %s", commandName);
+      char msg[96];
+      snprintf(msg, sizeof(msg), "deleted:%s", commandName);
+      enqueuePublish(TOPIC_STATE, msg);
+      if (!shared) refetchShared(commandName);  // Fall back to the shared definition
+    }
+    return;
+  }
+
+  // Unchanged definition (retained replay): same stamp = same definition, skip parsing
+  uint32_t version = entryVersion(commandName, buf, len);
+  if (existing >= 0 && coldMeta[existing].version == version) {
+    coldState[existing] = (coldState[existing] & ~COLD_FLAG_SHARED) | COLD_FLAG_SYNCED | (shared ? COLD_FLAG_SHARED : 0);
+    StoredCommand* hot = hotFind(commandName);
+    if (hot) hot->shared = shared;
+    return;
+  }
+
+  // Parse JSON command definition
+  StaticJsonDocument<2048> doc;  // Large enough for MAX_RAW_DATA (200 values)
+  uint32_t parseStart = micros();
+  DeserializationError error = deserializeJson(doc, buf);
+  parseHist.record(micros() - parseStart);
+
+  if (error) {
+    LOGW("JSON parse error: %s", error.c_str());
+    char msg[96];
+    snprintf(msg, sizeof(msg), "ERR:JSON:%s", commandName);
+    enqueuePublish(TOPIC_STATE, msg);
+    return;
+  }
+
+  // Add or update command
+  if (addOrUpdateCommand(commandName, doc, version, shared)) {
+    char msg[96];
+    snprintf(msg, sizeof(msg), "cached:%s", commandName);
+    enqueuePublish(TOPIC_STATE, msg);
+  }
+}
+
+// ====== Fleet Routing ======
+// home/ir/fleet/send (same payload as send) reaches every device; the one best placed
+// for the command transmits. A definition's "affinity" scores the devices that can
+// reach the appliance, e.g. "affinity":{"living":10,"hall":4}. Each device turns that
+// into its rank at parse time (0 = best; ties go to the lower id) and:
+//   rank 0      claims on home/ir/fleet/claim and transmits at once
+//   rank k > 0  waits k * FLEET_CLAIM_STEP_MS; a claim from a better rank cancels,
+//               otherwise it claims and transmits (the better device is offline)
+// Devices not listed, or with a score of 0, never fire. Without "affinity" a device's
+// own definition ranks 0 and a shared one is not routable, so a shared command with
+// no table can never fire twice. Claims travel directly, not through the outbox.
+#define FLEET_RANK_NONE 0xFF   // Not routable from this device
+#define FLEET_RANK_UNSET 0xFE  // No affinity table in the definition
+#define FLEET_CLAIM_STEP_MS 150
+#define FLEET_PENDING 4
+
+struct FleetPending {
+  SendRequest req;
+  CommandHandle cmd;  // Re-resolved by name if evicted or deleted meanwhile
+  uint8_t rank;
+  uint32_t deadline;  // millis()
+  bool active;
+};
+
+static FleetPending fleetPending[FLEET_PENDING];
+
+uint8_t affinityRank(JsonVariant affinity) {
+  if (!affinity.is<JsonObject>()) return FLEET_RANK_UNSET;
+  int mine = affinity[(const char*)deviceId] | 0;
+  if (mine <= 0) return FLEET_RANK_NONE;
+  uint8_t rank = 0;
+  for (JsonPair kv : affinity.as<JsonObject>()) {
+    int score = kv.value() | 0;
+    if (score > mine || (score == mine && strcmp(kv.key().c_str(), deviceId) < 0)) rank++;
+  }
+  return min(rank, (uint8_t)(FLEET_RANK_UNSET - 1));
+}
+
+// Claim key: the correlation id if the client gave one, else the command name
+static const char* fleetKey(const SendRequest* req) {
+  return req->id[0] ? req->id : req->name;
+}
+
+static void fleetClaimAndSend(StoredCommand* cmd, const SendRequest* req, uint8_t rank) {
+  char msg[256];
+  char key[JSON_ESCAPED(MAX_COMMAND_NAME)];
+  snprintf(msg, sizeof(msg), "{\"key\":\"%s\",\"rank\":%u,\"dev\":\"%s\"}",
+    jsonEscape(key, sizeof(key), fleetKey(req)), rank, deviceId);
+  mqtt.publish(TOPIC_FLEET_CLAIM, msg);
+  LOGD("Fleet send %s (rank %u)", req->name, rank);
+  trace(TRACE_CMD_RESOLVED, cmd - commandCache);
+  executeCommand(cmd, req);
+}
+
+void handleFleetSend(const char* buf, uint32_t rxAt) {
+  SendRequest req;
+  if (parseSendRequest(buf, rxAt, &req) || req.name[0] == '\0') return;
+  req.fleet = true;
+
+  StoredCommand* cmd = findCommandByName(req.name);
+  if (!cmd) return;  // Another device may have it
+  uint8_t rank = cmd->fleetRank;
+  if (rank == FLEET_RANK_UNSET) rank = cmd->shared ? FLEET_RANK_NONE : 0;
+  if (rank == FLEET_RANK_NONE) return;
+
+  if (rank == 0) {
+    fleetClaimAndSend(cmd, &req, 0);
+    return;
+  }
+
+  for (uint8_t i = 0; i < FLEET_PENDING; i++) {
+    if (!fleetPending[i].active) {
+      fleetPending[i].req = req;
+      fleetPending[i].cmd = handleOf(cmd);
+      fleetPending[i].rank = rank;
+      fleetPending[i].deadline = millis() + rank * FLEET_CLAIM_STEP_MS;
+      fleetPending[i].active = true;
+      return;
+    }
+  }
+  LOGW("Fleet pending table full, dropping %s", req.name);
+}
+
+// Another device took a request: stand down if it ranks better than us
+void handleFleetClaim(const char* buf) {
+  StaticJsonDocument<128> doc;
+  if (deserializeJson(doc, buf)) return;
+  const char* dev = doc["dev"] | "";
+  if (strcmp(dev, deviceId) == 0) return;  // Our own echo
+  const char* key = doc["key"] | "";
+  uint8_t rank = doc["rank"] | FLEET_RANK_NONE;
+
+  // Oldest matching request first, so repeated name-keyed sends resolve in order
+  FleetPending* oldest = nullptr;
+  for (uint8_t i = 0; i < FLEET_PENDING; i++) {
+    FleetPending& p = fleetPending[i];
+    if (p.active && p.rank > rank && strcmp(fleetKey(&p.req), key) == 0 &&
+        (!oldest || (int32_t)(p.req.rxAt - oldest->req.rxAt) < 0)) {
+      oldest = &p;
+    }
+  }
+  if (oldest) {
+    oldest->active = false;
+    LOGD("Fleet send %s claimed by %s", oldest->req.name, dev);
+  }
+}
+
+// call from loop(): fire requests whose better-ranked devices stayed silent
+void handleFleet() {
+  for (uint8_t i = 0; i < FLEET_PENDING; i++) {
+    FleetPending& p = fleetPending[i];
+    if (p.active && (int32_t)(millis() - p.deadline) >= 0) {
+      p.active = false;
+      StoredCommand* cmd = resolveHandle(p.cmd);
+      if (!cmd) cmd = findCommandByName(p.req.name);
+      if (cmd) fleetClaimAndSend(cmd, &p.req, p.rank);  // Else deleted while waiting
+    }
+  }
+}
+
+// ====== Bulk Transfer ======
+// Export streams the whole cold tier as one binary blob over TOPIC_EXPORT_DATA; import
+// takes the same blob on TOPIC_IMPORT. A blob is a run of chunks, each one MQTT message:
+//   header (16 bytes): "IRXB", version u8, type u8, seq u16, count u16, flags u16,
+//                      crc u32 (CRC-32 of the payload that follows)
+//   begin (seq 0): source device id (u8 length + bytes), commands u16 (a hint)
+//   data:          `count` records, never split across chunks
+//   end:           records u32, CRC-32 over all data payloads u32
+// and a record is (all little-endian):
+//   name (u8 length + bytes), flags u8 (1 = raw, 2 = shared), version u32,
+//   repeatCount u8, repeatInterval u16, fleetRank u8, channel u8, burst runs u8 and per run
+//   gap u16 (50 us units), count u8, repeat frame u8 (see Burst Profile), then
+//   raw:      freq u16 (kHz), duty u8 (%), len u16, packed length u16, packed timings
+//             (see raw_codec.h), repeat frame length u8, repeat frame u16 each
+//   protocol: proto (u8 length + bytes), addr u16, cmd u16, rpt u8
+// Both directions hold one chunk and one record, whatever the catalogue size. Export
+// sends one chunk per loop() iteration; import applies each chunk as it arrives, after
+// its CRC checks out, so records already applied stay if a transfer breaks off (a
+// re-import is idempotent). Import follows the usual rules: a device definition
+// overrides a shared one and shared records outside the catalogue filter are skipped.
+//
+// Version stamps travel with the records, so entries the broker also holds (e.g. the
+// shared catalogue on a fresh device) are skipped by the next retained replay. Flag
+// bit 0 on the begin chunk republishes imported device definitions to the broker,
+// retained, which is how a catalogue is cloned to a new device id; without it,
+// entries the broker does not hold are swept at the next sync. Fleet ranks only
+// carry over to the device that exported them: elsewhere a ranked record is not
+// routable and is re-parsed on its next replay, and the affinity table behind it is
+// not in the blob, so such records are never republished.
+#define XFER_MAGIC "IRXB"
+#define XFER_VERSION 5  // 2: packed raw timings, 3: carrier u16 + duty cycle, 4: burst profile, 5: channel
+#define XFER_HEADER 16
+#define XFER_PAYLOAD 1536  // Chunk payload, fits the 2048-byte MQTT buffer with the topic
+#define XFER_FLAG_PUBLISH 0x0001
+#define XFER_RECORD_RAW 0x01
+#define XFER_RECORD_SHARED 0x02
+#define IMPORT_TIMEOUT_MS 10000  // Between chunks
+
+enum XferChunk : uint8_t { XFER_BEGIN = 0, XFER_DATA, XFER_END };
+
+// CRC-32 (zlib polynomial), chainable: crc32(crc32(0, a), b) == crc32(0, a + b)
+static uint32_t crc32(uint32_t crc, const uint8_t* p, size_t len) {
+  crc = ~crc;
+  while (len--) {
+    crc ^= *p++;
+    for (uint8_t k = 0; k < 8; k++) crc = (crc >> 1) ^ (0xEDB88320u & -(crc & 1));
+  }
+  return ~crc;
+}
+
+// Bounds-checked little-endian cursor over a chunk; `ok` drops on overrun
+struct XferCursor {
+  uint8_t* p;
+  uint8_t* end;
+  bool ok;
+
+  bool room(size_t n) {
+    ok = ok && (size_t)(end - p) >= n;
+    return ok;
+  }
+  void bytes(void* v, size_t n, bool write) {
+    if (!room(n)) return;
+    if (write) memcpy(p, v, n);
+    else memcpy(v, p, n);
+    p += n;
+  }
+};
+
+static size_t xferRecordSize(const StoredCommand* cmd) {
+  size_t n = 1 + strlen(cmd->name) + 1 + 4 + 1 + 2 + 1 + 1 + 1 + 4 * cmd->burstRuns;
+  return n + (cmd->isRaw ? 8 + cmd->raw.packedLen + 2 * cmd->raw.repeatLen : 1 + strlen(cmd->protocol.proto) + 5);
+}
+
+// Serialize (write) or parse (read) one record; parsing fills cmd
+static bool xferRecord(XferCursor& c, StoredCommand* cmd, bool write) {
+  uint8_t n = write ? strlen(cmd->name) : 0;
+  c.bytes(&n, 1, write);
+  if (!c.ok || n == 0 || n >= MAX_COMMAND_NAME) return false;
+  c.bytes(cmd->name, n, write);
+  cmd->name[n] = '\0';
+
+  uint8_t flags = write ? (cmd->isRaw ? XFER_RECORD_RAW : 0) | (cmd->shared ? XFER_RECORD_SHARED : 0) : 0;
+  c.bytes(&flags, 1, write);
+  cmd->isRaw = flags & XFER_RECORD_RAW;
+  cmd->shared = flags & XFER_RECORD_SHARED;
+  c.bytes(&cmd->version, 4, write);
+  c.bytes(&cmd->repeatCount, 1, write);
+  c.bytes(&cmd->repeatInterval, 2, write);
+  c.bytes(&cmd->fleetRank, 1, write);
+  c.bytes(&cmd->channel, 1, write);
+  c.bytes(&cmd->burstRuns, 1, write);
+  if (!c.ok || cmd->channel >= MAX_SEND_CHANNELS || cmd->burstRuns > MAX_BURST_RUNS) return false;
+  uint16_t bursts = 0;
+  for (uint8_t i = 0; i < cmd->burstRuns; i++) {
+    c.bytes(&cmd->bursts[i].gap, 2, write);
+    c.bytes(&cmd->bursts[i].count, 1, write);
+    c.bytes(&cmd->bursts[i].repeatFrame, 1, write);
+    bursts += cmd->bursts[i].count;
+  }
+  if (!c.ok || bursts != cmd->repeatCount) return false;
+
+  if (cmd->isRaw) {
+    c.bytes(&cmd->raw.freq, 2, write);
+    c.bytes(&cmd->raw.duty, 1, write);
+    c.bytes(&cmd->raw.len, 2, write);
+    c.bytes(&cmd->raw.packedLen, 2, write);
+    if (!c.ok || cmd->raw.len > MAX_RAW_DATA || cmd->raw.packedLen > MAX_RAW_PACKED) return false;
+    if (!carrierValid(cmd->raw.freq, cmd->raw.duty)) return false;
+    c.bytes(cmd->raw.packed, cmd->raw.packedLen, write);
+    if (!write && c.ok && !rawTimingsOf(cmd)) return false;
+    c.bytes(&cmd->raw.repeatLen, 1, write);
+    if (!c.ok || cmd->raw.repeatLen > MAX_REPEAT_FRAME) return false;
+    c.bytes(cmd->raw.repeatFrame, 2 * cmd->raw.repeatLen, write);
+  } else {
+    n = write ? strlen(cmd->protocol.proto) : 0;
+    c.bytes(&n, 1, write);
+    if (!c.ok || n >= sizeof(cmd->protocol.proto)) return false;
+    c.bytes(cmd->protocol.proto, n, write);
+    cmd->protocol.proto[n] = '\0';
+    c.bytes(&cmd->protocol.addr, 2, write);
+    c.bytes(&cmd->protocol.cmd, 2, write);
+    c.bytes(&cmd->protocol.rpt, 1, write);
+  }
+  return c.ok;
+}
+
+// JSON definition of a command, as handleDefinition() takes it
+static size_t commandJson(const StoredCommand* cmd, char* out, size_t size) {
+  char extra[176] = "";  // Burst profile and channel
+  size_t pos = appendBursts(extra, sizeof(extra), cmd->bursts, cmd->burstRuns);
+  if (cmd->channel && pos < sizeof(extra)) snprintf(extra + pos, sizeof(extra) - pos, ",\"channel\":%u", cmd->channel);
+  if (!cmd->isRaw) {
+    return snprintf(out, size,
+      "{\"proto\":\"%s\",\"addr\":%u,\"cmd\":%u,\"rpt\":%u,\"repeatCount\":%u,\"repeatInterval\":%u%s}",
+      cmd->protocol.proto, cmd->protocol.addr, cmd->protocol.cmd, cmd->protocol.rpt,
+      cmd->repeatCount, cmd->repeatInterval, extra);
+  }
+  static char packed[MAX_RAW_PACKED * 4 / 3 + 4];
+  rawBase64Encode(cmd->raw.packed, cmd->raw.packedLen, packed);
+  char duty[16] = "";  // Only when not the default, as learned definitions
+  if (cmd->raw.duty != RAW_DUTY_DEFAULT) snprintf(duty, sizeof(duty), ",\"duty\":%u", cmd->raw.duty);
+  char repeatFrame[80] = "";
+  appendRepeatFrame(repeatFrame, sizeof(repeatFrame), cmd->raw.repeatFrame, cmd->raw.repeatLen);
+  return snprintf(out, size,
+    "{\"raw\":true,\"freq\":%u%s,\"len\":%u,\"packed\":\"%s\",\"repeatCount\":%u,\"repeatInterval\":%u%s%s}",
+    cmd->raw.freq, duty, cmd->raw.len, packed, cmd->repeatCount, cmd->repeatInterval, extra, repeatFrame);
+}
+
+static uint8_t xferChunk[XFER_HEADER + XFER_PAYLOAD];
+
+static bool     exportActive = false;
+static uint16_t exportSlot = 0;    // Next cold slot to visit
+static uint16_t exportSeq = 0;
+static uint32_t exportRecords = 0;
+static uint32_t exportCrc = 0;     // Over all data payloads so far
+static uint32_t exportStart = 0;
+
+static bool     importActive = false;
+static uint16_t importSeq = 0;     // Next expected chunk
+static uint16_t importFlags = 0;
+static bool     importSameDevice = false;
+static uint32_t importRecords = 0;
+static uint16_t importPublished = 0;
+static uint32_t importCrc = 0;
+static uint32_t importStart = 0;
+static uint32_t importLastChunk = 0;
+
+// Fill in the header and publish a chunk with `len` payload bytes
+static void publishXferChunk(XferChunk type, uint16_t count, uint16_t len) {
+  memcpy(xferChunk, XFER_MAGIC, 4);
+  xferChunk[4] = XFER_VERSION;
+  xferChunk[5] = type;
+  memcpy(xferChunk + 6, &exportSeq, 2);  // ESP32 is little-endian
+  memcpy(xferChunk + 8, &count, 2);
+  uint16_t flags = 0;
+  memcpy(xferChunk + 10, &flags, 2);
+  uint32_t crc = crc32(0, xferChunk + XFER_HEADER, len);
+  memcpy(xferChunk + 12, &crc, 4);
+  mqtt.publish(TOPIC_EXPORT_DATA, xferChunk, XFER_HEADER + len);
+  exportSeq++;
+}
+
+void startExport() {
+  if (exportActive || importActive || coldSlots == 0) {
+    enqueuePublish(TOPIC_STATE, "ERR:BUSY");
+    return;
+  }
+  exportActive = true;
+  exportSlot = 0;
+  exportSeq = 0;
+  exportRecords = 0;
+  exportCrc = 0;
+  exportStart = millis();
+
+  uint8_t* p = xferChunk + XFER_HEADER;
+  uint8_t n = strlen(deviceId);
+  *p++ = n;
+  memcpy(p, deviceId, n);
+  memcpy(p + n, &commandCount, 2);
+  publishXferChunk(XFER_BEGIN, 0, 1 + n + 2);
+
+  char msg[64];
+  snprintf(msg, sizeof(msg), "export:start,commands:%u", commandCount);
+  enqueuePublish(TOPIC_STATE, msg);
+  LOGI("Export started: %u commands", commandCount);
+}
+
+// call from loop(): one chunk per iteration
+static void handleExport() {
+  if (!exportActive) return;
+  if (!mqtt.connected()) {
+    exportActive = false;  // The receiver has lost the stream
+    LOGW("Export aborted: MQTT disconnected");
+    return;
+  }
+
+  XferCursor c = { xferChunk + XFER_HEADER, xferChunk + sizeof(xferChunk), true };
+  uint16_t count = 0;
+  for (; exportSlot < coldSlots; exportSlot++) {
+    if (coldSlotState(exportSlot) != COLD_USED) continue;
+    if (!coldRead(exportSlot, &staged)) continue;
+    staged.name[MAX_COMMAND_NAME - 1] = '\0';
+    staged.shared = coldState[exportSlot] & COLD_FLAG_SHARED;
+    if (xferRecordSize(&staged) > (size_t)(c.end - c.p)) break;  // Next chunk reads it again
+    xferRecord(c, &staged, true);
+    count++;
+  }
+
+  if (count > 0) {
+    uint16_t len = c.p - (xferChunk + XFER_HEADER);
+    exportCrc = crc32(exportCrc, xferChunk + XFER_HEADER, len);
+    exportRecords += count;
+    publishXferChunk(XFER_DATA, count, len);
+  }
+  if (exportSlot < coldSlots) return;
+
+  memcpy(xferChunk + XFER_HEADER, &exportRecords, 4);
+  memcpy(xferChunk + XFER_HEADER + 4, &exportCrc, 4);
+  publishXferChunk(XFER_END, 0, 8);
+  exportActive = false;
+
+  char msg[96];
+  snprintf(msg, sizeof(msg), "export:done,records:%lu,chunks:%u,ms:%lu",
+    (unsigned long)exportRecords, exportSeq, (unsigned long)(millis() - exportStart));
+  enqueuePublish(TOPIC_STATE, msg);
+  LOGI("%s", msg);
+}
+
+static void abortImport(const char* err) {
+  importActive = false;
+  char msg[64];
+  snprintf(msg, sizeof(msg), "ERR:%s:%u", err, importSeq);
+  enqueuePublish(TOPIC_STATE, msg);
+  LOGW("Import aborted at chunk %u: %s", importSeq, err);
+}
+
+// Apply one imported record (in `staged`)
+static void importRecord() {
+  StoredCommand* cmd = &staged;
+  if (cmd->shared && !catalogWants(cmd->name)) return;
+  int16_t existing = coldFind(cmd->name);
+  if (cmd->shared && existing >= 0 && !(coldState[existing] & COLD_FLAG_SHARED)) return;  // Device override wins
+
+  bool ranked = cmd->fleetRank != FLEET_RANK_UNSET;
+  if (ranked && !importSameDevice) {
+    cmd->fleetRank = FLEET_RANK_NONE;
+    cmd->version = 0;  // Re-parsed on its next replay, which restores the rank
+  }
+
+  if ((importFlags & XFER_FLAG_PUBLISH) && !cmd->shared) {
+    if (ranked) {
+      LOGW("Import: %s has an affinity table, not republished", cmd->name);
+    } else {
+      static char json[2048];
+      char topic[96];
+      size_t len = commandJson(cmd, json, sizeof(json));
+      snprintf(topic, sizeof(topic), "%s%s", topics.commandsPrefix, cmd->name);
+      if (len < sizeof(json) && mqtt.publish(topic, json, true)) {
+        cmd->version = entryVersion(cmd->name, json, len);  // So its echo is skipped
+        importPublished++;
+      }
+    }
+  }
+
+  if (existing >= 0 && coldMeta[existing].version == cmd->version && cmd->version != 0) {
+    coldState[existing] |= COLD_FLAG_SYNCED;  // Already have it
+    return;
+  }
+  storeCommand(cmd);
+}
+
+void handleImportChunk(const uint8_t* buf, unsigned int len) {
+  if (len < XFER_HEADER || memcmp(buf, XFER_MAGIC, 4) != 0 || buf[4] != XFER_VERSION) {
+    enqueuePublish(TOPIC_STATE, "ERR:IMPORT_FORMAT");
+    return;
+  }
+  uint8_t type = buf[5];
+  uint16_t seq, count, flags;
+  uint32_t crc;
+  memcpy(&seq, buf + 6, 2);
+  memcpy(&count, buf + 8, 2);
+  memcpy(&flags, buf + 10, 2);
+  memcpy(&crc, buf + 12, 4);
+  const uint8_t* payload = buf + XFER_HEADER;
+  uint16_t payloadLen = len - XFER_HEADER;
+
+  if (type == XFER_BEGIN) {
+    if (exportActive || syncState != SyncState::Ready) {
+      enqueuePublish(TOPIC_STATE, "ERR:BUSY");  // A half-loaded cache would sweep imports
+      return;
+    }
+    importActive = true;  // A new begin restarts an unfinished import
+    importSeq = 0;
+  }
+  if (!importActive) return;
+  if (seq != importSeq) return abortImport("IMPORT_SEQ");
+  if (crc32(0, payload, payloadLen) != crc) return abortImport("IMPORT_CRC");
+  importSeq++;
+  importLastChunk = millis();
+
+  if (type == XFER_BEGIN) {
+    uint8_t n = payloadLen > 0 ? payload[0] : 0;
+    if (payloadLen < 1 + n + 2) return abortImport("IMPORT_FORMAT");
+    uint16_t hint;
+    memcpy(&hint, payload + 1 + n, 2);
+    importSameDevice = n == strlen(deviceId) && memcmp(payload + 1, deviceId, n) == 0;
+    importFlags = flags;
+    importRecords = 0;
+    importPublished = 0;
+    importCrc = 0;
+    importStart = millis();
+    LOGI("Import started: %u commands%s", hint, (flags & XFER_FLAG_PUBLISH) ? ", republishing" : "");
+    return;
+  }
+
+  if (type == XFER_DATA) {
+    importCrc = crc32(importCrc, payload, payloadLen);
+    XferCursor c = { (uint8_t*)payload, (uint8_t*)payload + payloadLen, true };
+    for (uint16_t i = 0; i < count; i++) {
+      memset(&staged, 0, sizeof(staged));
+      if (!xferRecord(c, &staged, false)) return abortImport("IMPORT_FORMAT");
+      importRecord();
+      importRecords++;
+    }
+    return;
+  }
+
+  // End: whole-stream totals
+  uint32_t records = 0, streamCrc = 0;
+  if (payloadLen >= 8) {
+    memcpy(&records, payload, 4);
+    memcpy(&streamCrc, payload + 4, 4);
+  }
+  if (payloadLen < 8 || records != importRecords || streamCrc != importCrc) return abortImport("IMPORT_CHECKSUM");
+  importActive = false;
+
+  // Republished definitions change the broker's catalogue: follow with its manifest
+  if (importPublished > 0 && manifestKnown && manifestInSync) {
+    char msg[64];
+    snprintf(msg, sizeof(msg), "{\"count\":%u,\"hash\":\"%08lx\"}", commandCount, (unsigned long)catalogueDigest());
+    mqtt.publish(TOPIC_MANIFEST, msg, true);
+  }
+
+  char msg[96];
+  snprintf(msg, sizeof(msg), "import:done,records:%lu,published:%u,ms:%lu",
+    (unsigned long)importRecords, importPublished, (unsigned long)(millis() - importStart));
+  enqueuePublish(TOPIC_STATE, msg);
+  LOGI("%s", msg);
+}
+
+// call from loop(): export progress and stalled imports
+void handleTransfer() {
+  handleExport();
+  if (importActive && millis() - importLastChunk > IMPORT_TIMEOUT_MS) abortImport("IMPORT_TIMEOUT");
+}
+
+// Forward declarations (defined with the other loop() tasks)
+static void publishMetrics(bool force = false);
+void startBench(int16_t slot, bool all);
+
+// Trace dump in progress (see Trace): the ring is frozen at traceHead until it ends
+static uint32_t traceDumpStart = 0;
+static uint16_t traceDumpSeq = 0;
+static uint16_t traceDumpTotal = 0;
+
+// Start publishing the trace ring (oldest first) on TOPIC_TRACE_DUMP from loop()
+void startTraceDump() {
+  if (traceDumping) {
+    LOGW("Trace dump already in progress");
+    return;
+  }
+  traceDumpStart = traceHead > TRACE_CAPACITY ? traceHead - TRACE_CAPACITY : 0;
+  traceDumpSeq = 0;
+  traceDumpTotal = (traceHead - traceDumpStart + TRACE_CHUNK_RECORDS - 1) / TRACE_CHUNK_RECORDS;
+  traceDumping = traceDumpTotal > 0;
+}
+
+// call from loop(): one chunk per iteration
+void handleTraceDump() {
+  if (!traceDumping) return;
+  if (!mqtt.connected()) {
+    traceDumping = false;
+    LOGW("Trace dump aborted: MQTT disconnected");
+    return;
+  }
+
+  static uint8_t chunk[12 + TRACE_CHUNK_RECORDS * sizeof(TraceRecord)];
+  uint32_t first = traceDumpStart + (uint32_t)traceDumpSeq * TRACE_CHUNK_RECORDS;
+  uint16_t count = min((uint32_t)TRACE_CHUNK_RECORDS, traceHead - first);
+  memcpy(chunk, "IRTR", 4);
+  chunk[4] = 1;  // Format version
+  chunk[5] = 0;
+  memcpy(chunk + 6, &traceDumpSeq, 2);  // ESP32 is little-endian
+  memcpy(chunk + 8, &traceDumpTotal, 2);
+  memcpy(chunk + 10, &count, 2);
+  for (uint16_t i = 0; i < count; i++) {
+    memcpy(chunk + 12 + i * sizeof(TraceRecord), &traceRing[(first + i) & (TRACE_CAPACITY - 1)], sizeof(TraceRecord));
+  }
+  mqtt.publish(TOPIC_TRACE_DUMP, chunk, 12 + count * sizeof(TraceRecord));
+  if (++traceDumpSeq < traceDumpTotal) return;
 
-// ====== REMOVED: Hardcoded Commands ======
-// All commands now stored as MQTT retained messages on broker.
-// See migration script to publish these to MQTT.
-//
-// OLD TV COMMANDS (Samsung, addr=7):
-//   tv_power    -> cmd=2
-//   tv_vol_up   -> cmd=7
-//   tv_vol_down -> cmd=11
-//   tv_mute     -> cmd=15
-//
-// OLD FAN RAW COMMANDS:
-//   fan_power        -> 95 values: 1330,270,1380,270,580,1220,1280,270,1430,320,480,1220,430,1220,480,1220,430,1220,430,1220,430,1220,1330,7070,1280,370,1330,270,530,1220,1330,220,1430,270,580,1220,480,1170,480,1170,480,1170,480,1220,430,1220,1330,8020,1330,320,1330,370,480,1220,1280,370,1330,320,480,1220,480,1170,430,1220,430,1270,430,1220,430,1220,1280,7120,1280,370,1280,420,430,1220,1280,420,1280,370,430,1270,380,1270,430,1220,430,1270,380,1270,380,1270,1230
-//   fan_speed_up     -> 57 values: 1180,2420,230,1320,180,770,230,420,230,120,180,120,380,170,180,220,280,1470,180,1470,280,1370,230,1420,330,1320,1180,570,280,170,180,7520,1180,520,1180,520,230,1420,1180,520,1180,570,180,1420,280,1370,230,1370,380,1320,280,120,230,1020,1180,570,280
-//   fan_speed_down   -> 47 values: 1280,370,1330,370,430,1220,1280,320,1380,320,530,1220,430,1220,1230,420,430,1270,380,1270,1280,320,530,7870,1280,320,1380,370,430,1270,1230,370,1330,370,480,1220,430,1220,1280,370,480,1220,430,1220,1280,320,530
-//   fan_rotate       -> 35 values: 1230,120,1580,420,380,1270,230,120,880,470,230,120,880,420,130,120,180,1220,230,1470,230,120,280,120,130,120,230,470,230,1370,230,1470,230,1420,230
-//
-// Run the migration Python script to publish these to MQTT broker as retained messages.
+  traceDumping = false;
+  LOGI("Trace dumped: %lu records in %u chunks", (unsigned long)(traceHead - traceDumpStart), traceDumpTotal);
+}
 
 // MQTT Message Handler with Topic Routing
 void onMqttMessage(char* topic, byte* payload, unsigned int len) {
-  Serial.print("MQTT message on topic: ");
-  Serial.println(topic);
+  uint32_t rxAt = micros();
+  trace(TRACE_MQTT_RX, len);
+  LOGD("MQTT message on topic: %s", topic);
 
   // Copy payload to buffer (with larger size for JSON)
-  static char buf[1024];
+  static char buf[2048];  // Matches mqtt.setBufferSize()
   len = min((unsigned)sizeof(buf)-1, len);
   memcpy(buf, payload, len);
   buf[len] = '\0';
@@ -326,33 +2955,91 @@ void onMqttMessage(char* topic, byte* payload, unsigned int len) {
   // ===== TOPIC_LISTEN: Trigger learning mode with command name =====
   if (strcmp(topic, TOPIC_LISTEN) == 0) {
     if (learnActive) {
-      Serial.println("Already in learn mode");
+      LOGW("Already in learn mode");
+      return;
+    }
+    if (benchActive) {
+      enqueuePublish(TOPIC_STATE, "ERR:BUSY");
       return;
     }
 
-    // Parse JSON to get command name
-    StaticJsonDocument<512> doc;  // Enough for listen command JSON
+    // Parse JSON to get command name (or list of names for a batch session)
+    StaticJsonDocument<2048> doc;  // Enough for a MAX_BATCH_NAMES list
+    uint32_t parseStart = micros();
     DeserializationError error = deserializeJson(doc, buf);
+    parseHist.record(micros() - parseStart);
 
     if (error) {
-      Serial.print("JSON parse error: ");
-      Serial.println(error.c_str());
-      mqtt.publish(TOPIC_STATE, "ERR:INVALID_JSON");
+      LOGW("JSON parse error: %s", error.c_str());
+      enqueuePublish(TOPIC_STATE, "ERR:INVALID_JSON");
+      return;
+    }
+
+    // Carrier for raw captures, e.g. {"name":"beo_power","freq":455,"duty":25}. Without
+    // "freq" it is measured, or RAW_FREQ_DEFAULT without a carrier sensor.
+    long freq = doc["freq"] | 0L;
+    long duty = doc["duty"] | (long)RAW_DUTY_DEFAULT;
+    if (!carrierValid(freq ? freq : RAW_FREQ_DEFAULT, duty)) {
+      LOGW("Carrier out of range: %ldkHz, %ld%%", freq, duty);
+      enqueuePublish(TOPIC_STATE, "ERR:RAW_CARRIER");
+      return;
+    }
+    learnFreq = freq;
+    learnDuty = duty;
+
+    // ===== Batch session: {"names":["a","b",...]} =====
+    JsonArray names = doc["names"];
+    if (!names.isNull()) {
+      if (names.size() == 0 || names.size() > MAX_BATCH_NAMES) {
+        LOGW("Batch name list empty or too long");
+        enqueuePublish(TOPIC_STATE, "ERR:BATCH_SIZE");
+        return;
+      }
+      uint8_t n = 0;
+      for (JsonVariant v : names) {
+        const char* batchName = v | "";
+        if (strlen(batchName) == 0) {
+          enqueuePublish(TOPIC_STATE, "ERR:NO_NAME");
+          return;
+        }
+        if (strlen(batchName) >= MAX_COMMAND_NAME) {
+          enqueuePublish(TOPIC_STATE, "ERR:NAME_TOO_LONG");
+          return;
+        }
+        strcpy(batchNames[n++], batchName);
+      }
+      batchCount = n;
+      batchIndex = 0;
+      batchCaptured = 0;
+      strcpy(learningCommandName, batchNames[0]);
+
+      learnActive = true;
+      learnDeadline = millis() + LEARNING_TOTAL_TIMEOUT_MS;
+      if (!receiveActive) {
+        IrReceiver.begin(IR_RECEIVE_PIN, DISABLE_LED_FEEDBACK);
+      }
+      carrierArm();
+
+      char msg[96];
+      snprintf(msg, sizeof(msg), "batch_start:%u", batchCount);
+      enqueuePublish(TOPIC_STATE, msg);
+      snprintf(msg, sizeof(msg), "learn_start:%s", learningCommandName);
+      enqueuePublish(TOPIC_STATE, msg);
+
+      LOGI("Batch learn started, names: %u", batchCount);
       return;
     }
 
     const char* name = doc["name"];
     if (!name || strlen(name) == 0) {
-      Serial.println("No command name provided");
-      mqtt.publish(TOPIC_STATE, "ERR:NO_NAME");
+      LOGW("No command name provided");
+      enqueuePublish(TOPIC_STATE, "ERR:NO_NAME");
       return;
     }
 
     if (strlen(name) >= MAX_COMMAND_NAME) {
-      Serial.print("Command name too long (max ");
-      Serial.print(MAX_COMMAND_NAME - 1);
-      Serial.println(" chars)");
-      mqtt.publish(TOPIC_STATE, "ERR:NAME_TOO_LONG");
+      LOGW("Command name too long (max %d chars)", MAX_COMMAND_NAME - 1);
+      enqueuePublish(TOPIC_STATE, "ERR:NAME_TOO_LONG");
       return;
     }
 
@@ -362,106 +3049,295 @@ void onMqttMessage(char* topic, byte* payload, unsigned int len) {
 
     // Start learning mode
     learnActive = true;
-    learnDeadline = millis() + 10000UL;  // 10s window
-    IrReceiver.begin(IR_RECEIVE_PIN, DISABLE_LED_FEEDBACK);
+    learnDeadline = millis() + LEARNING_TOTAL_TIMEOUT_MS;
+    if (!receiveActive) {
+      IrReceiver.begin(IR_RECEIVE_PIN, DISABLE_LED_FEEDBACK);
+    }
+    carrierArm();
 
     char msg[96];
     snprintf(msg, sizeof(msg), "learn_start:%s", learningCommandName);
-    mqtt.publish(TOPIC_STATE, msg);
+    enqueuePublish(TOPIC_STATE, msg);
 
-    Serial.print("Learn mode started for: ");
-    Serial.println(learningCommandName);
+    LOGI("Learn mode started for: %s", learningCommandName);
     return;
   }
 
-  // ===== TOPIC_IR_SEND: Send command by name =====
-  if (strcmp(topic, TOPIC_IR_SEND) == 0) {
-    // Simple command name in payload
-    if (len == 0 || buf[0] == '\0') {
-      Serial.println("Empty command name in send request");
-      mqtt.publish(TOPIC_STATE, "ERR:EMPTY_COMMAND_NAME");
-      return;
+  // ===== TOPIC_PROFILE: Enable/disable loop profiler =====
+  if (strcmp(topic, TOPIC_PROFILE) == 0) {
+    bool enable = strcasecmp(buf, "on") == 0 || strcmp(buf, "1") == 0;
+    if (enable != profilerActive) {
+      profileReset();
+      profilerActive = enable;
+      stageMarkTime = micros();  // We are inside loop(): don't charge earlier time to a stage
+      iterationStart = stageMarkTime;
+      memset(iterationStageUs, 0, sizeof(iterationStageUs));
     }
+    enqueuePublish(TOPIC_STATE, profilerActive ? "profile:on" : "profile:off");
+    return;
+  }
+
+  // ===== TOPIC_METRICS_GET: Publish metrics now =====
+  if (strcmp(topic, TOPIC_METRICS_GET) == 0) {
+    publishMetrics(true);
+    return;
+  }
 
+  // ===== TOPIC_BENCH: Start loopback timing bench =====
+  if (strcmp(topic, TOPIC_BENCH) == 0) {
+    if (learnActive || benchActive) {
+      enqueuePublish(TOPIC_STATE, "ERR:BUSY");
+      return;
+    }
+    if (strcmp(buf, "all") == 0) {
+      startBench(0, true);
+      return;
+    }
     StoredCommand* cmd = findCommandByName(buf);
     if (!cmd) {
-      Serial.print("Command not found: ");
-      Serial.println(buf);
       char msg[96];
       snprintf(msg, sizeof(msg), "ERR:NOT_FOUND:%s", buf);
-      mqtt.publish(TOPIC_STATE, msg);
+      enqueuePublish(TOPIC_STATE, msg);
       return;
     }
+    startBench(cmd->coldSlot, false);
+    return;
+  }
 
-    executeCommand(cmd);
+  // ===== TOPIC_TRACE: Dump trace buffer =====
+  if (strcmp(topic, TOPIC_TRACE) == 0) {
+    if (strcmp(buf, "dump") == 0) startTraceDump();
     return;
   }
 
-  // ===== TOPIC_COMMANDS/*: Command definition (add/update/delete) =====
-  if (strncmp(topic, "home/ir/1/commands/", 19) == 0) {
-    // Extract command name from topic
-    const char* commandName = topic + 19;  // Skip "home/ir/1/commands/"
-
-    // Empty payload = delete command
-    if (len == 0) {
-      if (deleteCommand(commandName)) {
-        Serial.print("Deleted command: ");
-        Serial.println(commandName);
-        char msg[96];
-        snprintf(msg, sizeof(msg), "deleted:%s", commandName);
-        mqtt.publish(TOPIC_STATE, msg);
+  // ===== TOPIC_EXPORT / TOPIC_IMPORT: Bulk transfer =====
+  if (strcmp(topic, TOPIC_EXPORT) == 0) {
+    startExport();
+    return;
+  }
+  if (strcmp(topic, TOPIC_IMPORT) == 0) {
+    handleImportChunk((const uint8_t*)buf, len);
+    return;
+  }
+
+  // ===== TOPIC_RECEIVE: Enable/disable receive mode =====
+  if (strcmp(topic, TOPIC_RECEIVE) == 0) {
+    bool enable = strcasecmp(buf, "on") == 0 || strcmp(buf, "1") == 0;
+    if (enable && !receiveActive) {
+      // Learning already owns a running receiver
+      if (!learnActive) IrReceiver.begin(IR_RECEIVE_PIN, DISABLE_LED_FEEDBACK);
+      receiveActive = true;
+      enqueuePublish(TOPIC_STATE, "receive:on");
+      LOGI("Receive mode enabled");
+    } else if (!enable && receiveActive) {
+      if (!learnActive) IrReceiver.end();
+      receiveActive = false;
+      enqueuePublish(TOPIC_STATE, "receive:off");
+      LOGI("Receive mode disabled");
+    }
+    return;
+  }
+
+  // ===== TOPIC_PRESS / TOPIC_RELEASE: Hold to repeat =====
+  if (strcmp(topic, TOPIC_PRESS) == 0) {
+    handleHoldPress(buf);
+    return;
+  }
+  if (strcmp(topic, TOPIC_RELEASE) == 0) {
+    handleHoldRelease(buf);
+    return;
+  }
+
+  // ===== TOPIC_IR_SEND: Send command by name =====
+  if (strcmp(topic, TOPIC_IR_SEND) == 0) {
+    SendRequest req;
+    const char* err = parseSendRequest(buf, rxAt, &req);
+    if (err) {
+      LOGW("Bad send request: %s", err);
+      if (req.id[0] || strcmp(err, "INVALID_ID") == 0) {
+        publishAck(&req, req.name, err, 0, 0);
+        return;
       }
+      char msg[32];
+      snprintf(msg, sizeof(msg), "ERR:%s", err);
+      enqueuePublish(TOPIC_STATE, msg);
       return;
     }
+    const char* name = req.name;
 
-    // Parse JSON command definition
-    StaticJsonDocument<2048> doc;  // Large enough for MAX_RAW_DATA (200 values)
-    DeserializationError error = deserializeJson(doc, buf);
+    if (name[0] == '\0') {
+      LOGW("Empty command name in send request");
+      if (req.id[0]) publishAck(&req, name, "EMPTY_COMMAND_NAME", 0, 0);
+      else enqueuePublish(TOPIC_STATE, "ERR:EMPTY_COMMAND_NAME");
+      return;
+    }
 
-    if (error) {
-      Serial.print("JSON parse error: ");
-      Serial.println(error.c_str());
+    StoredCommand* cmd = findCommandByName(name);
+    if (!cmd) {
+      LOGW("Command not found: %s", name);
+      if (req.id[0]) {
+        publishAck(&req, name, "NOT_FOUND", 0, 0);
+        return;
+      }
       char msg[96];
-      snprintf(msg, sizeof(msg), "ERR:JSON:%s", commandName);
-      mqtt.publish(TOPIC_STATE, msg);
+      snprintf(msg, sizeof(msg), "ERR:NOT_FOUND:%s", name);
+      enqueuePublish(TOPIC_STATE, msg);
       return;
     }
 
-    // Add or update command
-    if (addOrUpdateCommand(commandName, doc)) {
-      char msg[96];
-      snprintf(msg, sizeof(msg), "cached:%s", commandName);
-      mqtt.publish(TOPIC_STATE, msg);
+    trace(TRACE_CMD_RESOLVED, cmd - commandCache);
+    executeCommand(cmd, &req);
+    return;
+  }
+
+  // ===== TOPIC_FLEET_SEND / TOPIC_FLEET_CLAIM: Fleet routing =====
+  if (strcmp(topic, TOPIC_FLEET_SEND) == 0) {
+    handleFleetSend(buf, rxAt);
+    return;
+  }
+  if (strcmp(topic, TOPIC_FLEET_CLAIM) == 0) {
+    handleFleetClaim(buf);
+    return;
+  }
+
+  // ===== TOPIC_MANIFEST: Expected catalogue count + digest =====
+  if (strcmp(topic, TOPIC_MANIFEST) == 0) {
+    StaticJsonDocument<128> doc;
+    if (len == 0 || deserializeJson(doc, buf)) {
+      manifestKnown = false;
+      return;
     }
+    manifestCount = doc["count"] | 0;
+    manifestDigest = strtoul(doc["hash"] | "0", nullptr, 16);
+    manifestKnown = true;
+    manifestInSync = false;
+    if (syncState == SyncState::Ready) checkManifest();  // Otherwise checked at the barrier
+    return;
+  }
+
+  // ===== TOPIC_SYNC: Our own sentinel, everything retained before it has arrived =====
+  if (strcmp(topic, TOPIC_SYNC) == 0) {
+    if (strtoul(buf, nullptr, 10) == syncNonce) syncSentinelSeen = true;
+    return;
+  }
+
+  // ===== TOPIC_DEVICE_ID: Move this device to a new namespace =====
+  if (strcmp(topic, TOPIC_DEVICE_ID) == 0) {
+    changeDeviceId(buf);
+    return;
+  }
+
+  // ===== TOPIC_CATALOG_FILTER: Which shared commands to cache =====
+  if (strcmp(topic, TOPIC_CATALOG_FILTER) == 0) {
+    applyCatalogFilter(buf, len);
+    return;
+  }
+
+  // ===== TOPIC_COMMANDS/*: Command definition (add/update/delete) =====
+  if (strncmp(topic, topics.commandsPrefix, topics.commandsPrefixLen) == 0) {
+    handleDefinition(topic + topics.commandsPrefixLen, buf, len, false);
+    return;
+  }
+
+  // ===== TOPIC_CATALOG/*: Shared command definition =====
+  if (strncmp(topic, TOPIC_CATALOG, strlen(TOPIC_CATALOG)) == 0) {
+    handleDefinition(topic + strlen(TOPIC_CATALOG), buf, len, true);
     return;
   }
 }
 
+// ====== Load Barrier ======
+// After (re)subscribing, the broker replays all retained definitions and then the
+// manifest. The device then publishes a sentinel with a fresh nonce to TOPIC_SYNC;
+// the broker handles a client's packets in order, so once the sentinel comes back
+// every retained message has been delivered. Entries not replayed in between were
+// deleted while we were offline and are swept.
+#define SYNC_TIMEOUT_MS 15000  // Give up waiting for the sentinel (e.g. broker ACL)
+
+void startSync() {
+  for (uint16_t i = 0; i < coldSlots; i++) {
+    coldState[i] &= ~COLD_FLAG_SYNCED;
+  }
+  syncState = SyncState::Loading;
+  syncStart = millis();
+  syncNonce = micros();
+  syncSentinelSeen = false;
+
+  char nonce[16];
+  snprintf(nonce, sizeof(nonce), "%lu", (unsigned long)syncNonce);
+  mqtt.publish(TOPIC_SYNC, nonce);
+  enqueuePublish(TOPIC_STATE, "syncing");
+}
+
+// Drop cache entries the broker no longer has
+static void sweepUnsynced() {
+  for (uint16_t i = 0; i < coldSlots; i++) {
+    char name[MAX_COMMAND_NAME];
+    if (coldSlotState(i) != COLD_USED || (coldState[i] & COLD_FLAG_SYNCED)) continue;
+    if (coldReadName(i, name)) {
+      bool shared = coldState[i] & COLD_FLAG_SHARED;
+      deleteCommand(name);
+      char msg[96];
+      snprintf(msg, sizeof(msg), "deleted:%s", name);
+      enqueuePublish(TOPIC_STATE, msg);
+      if (!shared) refetchShared(name);  // A vanished override may have a shared definition behind it
+    }
+  }
+}
+
+// call from loop(): keeps the load non-blocking, mqtt.loop() keeps delivering
+static void handleSync() {
+  if (syncState != SyncState::Loading) return;
+
+  uint32_t elapsed = millis() - syncStart;
+  bool timedOut = elapsed > SYNC_TIMEOUT_MS;
+  if (!syncSentinelSeen && !timedOut) return;
+
+  if (syncSentinelSeen) sweepUnsynced();  // Only safe with a complete replay
+  syncState = SyncState::Ready;
+  trace(TRACE_SYNC_READY, commandCount);
+  checkManifest();
+
+  char msg[112];
+  snprintf(msg, sizeof(msg), "ready (loaded %d commands in %lu ms%s%s)", commandCount,
+    (unsigned long)elapsed, timedOut ? ", sync timeout" : (manifestKnown && !manifestInSync) ? ", drift" : "",
+    coldRam ? ", no flash store" : "");
+  enqueuePublish(TOPIC_STATE, msg);
+  LOGI("Loaded %d commands from MQTT in %lums", commandCount, (unsigned long)elapsed);
+}
+
 void ensureMqtt() {
   while (!mqtt.connected()) {
-    if (mqtt.connect(MQTT_CLIENTID, MQTT_USER, MQTT_PASS, TOPIC_STATE, 0, true, "offline")) {
-      Serial.println("MQTT connected!");
+    if (mqtt.connect(mqttClientId, MQTT_USER, MQTT_PASS, TOPIC_STATE, 0, true, "offline")) {
+      LOGI("MQTT connected!");
+      trace(TRACE_MQTT_CONNECTED);
 
       // Subscribe to command topics
       mqtt.subscribe(TOPIC_IR_SEND);
+      mqtt.subscribe(TOPIC_PRESS);
+      mqtt.subscribe(TOPIC_RELEASE);
       mqtt.subscribe(TOPIC_LISTEN);
+      mqtt.subscribe(TOPIC_RECEIVE);
+      mqtt.subscribe(TOPIC_PROFILE);
+      mqtt.subscribe(TOPIC_TRACE);
+      mqtt.subscribe(TOPIC_BENCH);
+      mqtt.subscribe(TOPIC_METRICS_GET);
+      mqtt.subscribe(TOPIC_EXPORT);
+      mqtt.subscribe(TOPIC_IMPORT);
+      mqtt.subscribe(TOPIC_FLEET_SEND);
+      mqtt.subscribe(TOPIC_FLEET_CLAIM);
+      mqtt.subscribe(TOPIC_DEVICE_ID);
       mqtt.subscribe(TOPIC_COMMANDS);  // Receives all retained command definitions
-      Serial.println("Subscribed to topics");
-
-      // Wait briefly for retained messages to arrive
-      delay(500);
-      mqtt.loop();  // Process incoming retained messages
-
-      // Publish status
-      char msg[64];
-      snprintf(msg, sizeof(msg), "online (loaded %d commands)", commandCount);
-      mqtt.publish(TOPIC_STATE, msg);
-      Serial.print("Loaded ");
-      Serial.print(commandCount);
-      Serial.println(" commands from MQTT");
+      subscribeCatalog(true);          // Shared definitions selected by the stored filter
+      mqtt.subscribe(TOPIC_CATALOG_FILTER);
+      mqtt.subscribe(TOPIC_MANIFEST);  // Delivered after the definitions above
+      mqtt.subscribe(TOPIC_SYNC);
+      LOGD("Subscribed to topics");
+
+      // Retained definitions arrive asynchronously; handleSync() reports ready
+      startSync();
     } else {
-      Serial.print("MQTT connection failed, rc=");
-      Serial.println(mqtt.state());
+      LOGW("MQTT connection failed, rc=%d", mqtt.state());
       delay(1000);
     }
   }
@@ -519,112 +3395,169 @@ void ensureMqtt() {
 //   return false;
 // }
 
-// Publish learned command as retained message
-static void publishDecode() {
-  const IRData &d = baseSignal;  // Use base signal, not current decodedIRData
+// ====== Learn Pipeline ======
+// capture (handleLearnWindow) -> analyze (analyzeCapture) -> publish (publishDecode)
+// Each stage hands off through a small ring queue and loop() advances each stage by one
+// item per iteration. The receiver is released as soon as a burst sequence ends, so a
+// new learn session can start while earlier results are still being serialized/published.
+// During a batch session captures are held in the capture queue and flushed as one
+// burst when the session ends, so the queue is sized for a full batch.
+#define LEARN_QUEUE_DEPTH MAX_BATCH_NAMES
+#define PUBLISH_QUEUE_DEPTH 2
+
+struct LearnCapture {
+  char name[MAX_COMMAND_NAME];
+  decode_type_t protocol;
+  uint16_t address;
+  uint16_t command;
+  uint8_t repeats;             // Additional bursts after the first
+  uint16_t avgInterval;        // Mean gap in milliseconds (repeatInterval)
+  uint8_t burstRuns;
+  BurstRun bursts[MAX_BURST_RUNS];
+  uint8_t repeatLen;
+  uint16_t repeatFrame[MAX_REPEAT_FRAME];
+  uint16_t freq;               // Carrier in kHz
+  uint8_t duty;                // Carrier duty cycle in percent
+  uint16_t rawLen;
+  uint16_t raw[MAX_RAW_DATA];  // First frame timings in microseconds
+};
+
+struct LearnResult {
+  char name[MAX_COMMAND_NAME];
   char topic[96];
-  char msg[2048];
+  char msg[2048];              // Retained command definition
+  char logMsg[256];            // Non-retained learn log
+  uint8_t repeats;
+};
 
-  if (strlen(learningCommandName) == 0) {
-    Serial.println("ERROR: No command name set for learning");
-    return;
-  }
+static StageQueue<LearnCapture, LEARN_QUEUE_DEPTH> captureQueue;
+static StageQueue<LearnResult, PUBLISH_QUEUE_DEPTH> publishQueue;
 
-  // Calculate average repeat interval
-  uint16_t avgInterval = 0;
-  if (capturedRepeats > 0) {
-    uint32_t totalTime = lastRepeatTime - firstPressTime;
-    avgInterval = totalTime / capturedRepeats;
-  }
+// Raw timings of the base signal, copied when it arrives (the receiver buffer is
+// overwritten by every later frame of the burst)
+static uint16_t baseRaw[MAX_RAW_DATA];
+static uint16_t baseRawLen = 0;
+
+// Analyze stage: turn one capture into its command definition and log payloads
+static void analyzeCapture() {
+  if (batchCount > 0) return;  // Held until the batch session ends
+  LearnCapture* c = captureQueue.front();
+  if (!c) return;
+  LearnResult* r = publishQueue.push();
+  if (!r) return;  // Publish stage still busy, retry next loop
+
+  strcpy(r->name, c->name);
+  r->repeats = c->repeats;
 
   // Build topic for command storage
-  snprintf(topic, sizeof(topic), "home/ir/1/commands/%s", learningCommandName);
+  snprintf(r->topic, sizeof(r->topic), "%s%s", topics.commandsPrefix, c->name);
 
-  if (d.protocol != UNKNOWN) {
+  // Burst profile, if the press had more than one burst
+  char bursts[160] = "";
+  appendBursts(bursts, sizeof(bursts), c->bursts, c->burstRuns);
+
+  if (c->protocol != UNKNOWN) {
     // ===== Known Protocol Command =====
-    Serial.println("Known protocol detected");
+    LOGD("Known protocol detected");
 
     // Build JSON for protocol command with repeat info
-    snprintf(msg, sizeof(msg),
-      "{\"proto\":\"%s\",\"addr\":%lu,\"cmd\":%lu,\"rpt\":0,\"repeatCount\":%u,\"repeatInterval\":%u}",
-      getProtocolString(d.protocol),
-      (unsigned long)d.address,
-      (unsigned long)d.command,
-      capturedRepeats,
-      avgInterval);
-
-    // Publish as RETAINED command definition
-    mqtt.publish(topic, msg, true);
-
-    // Also publish to learn topic for logging (non-retained)
-    char logMsg[256];
-    snprintf(logMsg, sizeof(logMsg),
-      "{\"name\":\"%s\",\"proto\":\"%s\",\"addr\":%lu,\"cmd\":%lu}",
-      learningCommandName,
-      getProtocolString(d.protocol),
-      (unsigned long)d.address,
-      (unsigned long)d.command);
-    mqtt.publish(TOPIC_LEARN, logMsg, false);
-
-    Serial.print("Published protocol command: ");
-    Serial.println(learningCommandName);
+    snprintf(r->msg, sizeof(r->msg),
+      "{\"proto\":\"%s\",\"addr\":%lu,\"cmd\":%lu,\"rpt\":0,\"repeatCount\":%u,\"repeatInterval\":%u%s}",
+      getProtocolString(c->protocol),
+      (unsigned long)c->address,
+      (unsigned long)c->command,
+      c->repeats,
+      c->avgInterval,
+      bursts);
 
+    snprintf(r->logMsg, sizeof(r->logMsg),
+      "{\"name\":\"%s\",\"proto\":\"%s\",\"addr\":%lu,\"cmd\":%lu}",
+      c->name,
+      getProtocolString(c->protocol),
+      (unsigned long)c->address,
+      (unsigned long)c->command);
   } else {
     // ===== Unknown Protocol - Use Raw Timing Data =====
-    Serial.println("Unknown protocol - using raw data");
-
-    // Build JSON with raw timing array
-    // Format: {"raw":true,"freq":38,"data":[123,456,789,...]}
+    LOGD("Unknown protocol - using raw data");
 
-    strcpy(msg, "{\"raw\":true,\"freq\":38,\"data\":[");
-
-    // Add timing values using IRremote 4.x API
-    // Access raw buffer via decodedIRData.rawDataPtr
-    for (uint16_t i = 1; i < d.rawlen; i++) {
-      char num[8];
-      // IRremote 4.x: rawbuf is accessible via rawDataPtr
-      unsigned int timing = IrReceiver.decodedIRData.rawDataPtr->rawbuf[i] * MICROS_PER_TICK;
+    // Build JSON with packed timings (see raw_codec.h), "duty" only when not the default
+    // Format: {"raw":true,"freq":38,"len":95,"packed":"pgqsBA..."}
+    static uint8_t packed[MAX_RAW_PACKED];
+    static char packedText[MAX_RAW_PACKED * 4 / 3 + 4];
+    uint16_t len = c->rawLen;
+    size_t packedLen = rawEncode(c->raw, len, packed, sizeof(packed));
+    while (packedLen == 0 && len > 2) {
+      len -= 2;  // Keep whole mark/space pairs
+      packedLen = rawEncode(c->raw, len, packed, sizeof(packed));
+    }
+    if (len < c->rawLen) LOGW("WARNING: Raw data too long, truncated to %u edges", len);
+    rawBase64Encode(packed, packedLen, packedText);
+    char duty[16] = "";
+    if (c->duty != RAW_DUTY_DEFAULT) snprintf(duty, sizeof(duty), ",\"duty\":%u", c->duty);
+    char repeatFrame[80] = "";
+    appendRepeatFrame(repeatFrame, sizeof(repeatFrame), c->repeatFrame, c->repeatLen);
 
-      // Check if we have room (leave 20 chars for closing)
-      if (strlen(msg) + 20 > sizeof(msg)) {
-        Serial.println("WARNING: Raw data too long, truncating");
-        break;
-      }
+    snprintf(r->msg, sizeof(r->msg),
+      "{\"raw\":true,\"freq\":%u%s,\"len\":%u,\"packed\":\"%s\",\"repeatCount\":%u,\"repeatInterval\":%u%s%s}",
+      c->freq, duty, len, packedText, c->repeats, c->avgInterval, bursts, repeatFrame);
 
-      snprintf(num, sizeof(num), "%u", timing);
-      strcat(msg, num);
+    snprintf(r->logMsg, sizeof(r->logMsg),
+      "{\"name\":\"%s\",\"raw\":true,\"len\":%u,\"freq\":%u}",
+      c->name,
+      c->rawLen,
+      c->freq);
 
-      if (i < d.rawlen - 1) {
-        strcat(msg, ",");
-      }
+    // Print raw array to Serial for reference
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+    logPrintf("uint16_t rawData[%u] = {", c->rawLen);
+    for (uint16_t i = 0; i < c->rawLen; i++) {
+      logPrintf(i ? ", %u" : "%u", c->raw[i]);
     }
+    logPrintf("};\n");
+#endif
+  }
 
-    // Add repeat info to raw command JSON
-    char repeatInfo[64];
-    snprintf(repeatInfo, sizeof(repeatInfo), "],\"repeatCount\":%u,\"repeatInterval\":%u}", capturedRepeats, avgInterval);
-    strcat(msg, repeatInfo);
+  captureQueue.pop();
+}
 
-    // Publish as RETAINED command definition
-    mqtt.publish(topic, msg, true);
+// Publish stage: publish one learned command as retained message
+static void publishDecode() {
+  LearnResult* r = publishQueue.front();
+  if (!r) return;
+  if (!mqtt.connected()) return;  // Keep it queued until reconnected
+  StageTimer timer(publishHist);
+  trace(TRACE_PUBLISH_START, strlen(r->msg));
 
-    // Also publish simpler log message
-    char logMsg[128];
-    snprintf(logMsg, sizeof(logMsg),
-      "{\"name\":\"%s\",\"raw\":true,\"len\":%u}",
-      learningCommandName,
-      d.rawlen - 1);
-    mqtt.publish(TOPIC_LEARN, logMsg, false);
+  // Publish as RETAINED command definition
+  mqtt.publish(r->topic, r->msg, true);
+  updateManifestFor(r->name, r->msg, strlen(r->msg));
 
-    Serial.print("Published raw command: ");
-    Serial.println(learningCommandName);
+  // Also publish to learn topic for logging (non-retained)
+  enqueuePublish(TOPIC_LEARN, r->logMsg);
 
-    // Print raw array to Serial for reference
-    IrReceiver.compensateAndPrintIRResultAsCArray(&Serial, true);
-    Serial.println();
+  // Publish success
+  char msg[128];
+  if (r->repeats > 0) {
+    snprintf(msg, sizeof(msg), "learn_success:%s,bursts:%d", r->name, r->repeats + 1);
+  } else {
+    snprintf(msg, sizeof(msg), "learn_success:%s", r->name);
   }
+  enqueuePublish(TOPIC_STATE, msg);
+
+  LOGI("Command saved to: %s", r->topic);
+  trace(TRACE_PUBLISH_DONE);
+
+  publishQueue.pop();
+}
 
-  Serial.print("Command saved to: ");
-  Serial.println(topic);
+// Drain the whole pipeline in one go (end of a batch session): all definitions go out
+// back to back as a single burst of retained publishes
+static void flushLearnPipeline() {
+  while (captureQueue.front() || publishQueue.front()) {
+    analyzeCapture();
+    if (!mqtt.connected()) return;  // Rest is published by loop() after reconnect
+    publishDecode();
+  }
 }
 
 // Compare two IR signals to see if they're identical
@@ -646,6 +3579,18 @@ bool signalsMatch(const IRData& sig1, const IRData& sig2) {
   return true;  // Same length raw data = probably same signal
 }
 
+// Reset per-capture burst tracking (between names of a batch and at session end)
+static void resetBurstCapture() {
+  hasBaseSignal = false;
+  capturedRepeats = 0;
+  lastSignalTime = 0;
+  baseCarrier = 0;
+  learnRunCount = 0;
+  learnRepeatLen = 0;
+  lastFrameMatched = false;
+  carrierArm();
+}
+
 // call from loop()
 static void handleLearnWindow() {
   if (!learnActive) return;
@@ -656,45 +3601,75 @@ static void handleLearnWindow() {
   if (IrReceiver.decode()) {
     // First signal - store as base for comparison
     if (!hasBaseSignal) {
-      Serial.println("First signal captured, listening for bursts (500ms idle timeout)...");
+      LOGI("First signal captured, listening for bursts (500ms idle timeout)...");
+      trace(TRACE_LEARN_FRAME, 1);
       baseSignal = IrReceiver.decodedIRData;  // Store entire signal
       hasBaseSignal = true;
-      firstPressTime = now;
+      lastFrameMatched = true;
+      baseRawLen = min((int)baseSignal.rawlen - 1, MAX_RAW_DATA);
+      for (uint16_t i = 0; i < baseRawLen; i++) {
+        baseRaw[i] = IrReceiver.decodedIRData.rawDataPtr->rawbuf[i + 1] * MICROS_PER_TICK;
+      }
       lastSignalTime = now;
-      lastRepeatTime = now;
       capturedRepeats = 0;  // Will count additional bursts (0 = single send)
+      baseCarrier = carrierMeasured();
+      if (baseCarrier) LOGI("Carrier: %ukHz", baseCarrier);
 
       // Set maximum timeout (10 seconds total)
       learnDeadline = now + LEARNING_TOTAL_TIMEOUT_MS;
 
       // Print to serial
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
       IrReceiver.printIRResultShort(&Serial);
       Serial.println();
+#endif
     }
     // Subsequent signals - compare to base
     else {
       const IRData& currentSignal = IrReceiver.decodedIRData;
+      // Silence since the previous frame ended, timed by the receiver
+      uint32_t gap = (uint32_t)currentSignal.initialGapTicks * MICROS_PER_TICK;
+
+      // Repeat codes: known protocols decode them as the same command, flagged and
+      // shorter; in a raw burst they are a short frame of their own
+      bool matches = signalsMatch(baseSignal, currentSignal);
+      bool repeatFrame = matches && baseSignal.protocol != UNKNOWN &&
+        (currentSignal.flags & IRDATA_FLAGS_IS_REPEAT) && currentSignal.rawlen < baseSignal.rawlen;
+      // A short raw frame only counts straight after a frame of the burst and with a
+      // repeat code's shape (long leading mark, then a space and a mark); noise
+      // glitches are a few short edges and are ignored like any other frame
+      uint16_t len = currentSignal.rawlen - 1;
+      if (!matches && baseSignal.protocol == UNKNOWN && currentSignal.protocol == UNKNOWN &&
+          lastFrameMatched && gap <= BURST_IDLE_TIMEOUT_MS * 1000UL &&
+          len >= 3 && len <= MAX_REPEAT_FRAME && (learnRepeatLen == 0 || learnRepeatLen == len) &&
+          currentSignal.rawDataPtr->rawbuf[1] * MICROS_PER_TICK >= REPEAT_MIN_MARK_US) {
+        if (learnRepeatLen == 0) {
+          for (uint16_t i = 0; i < len; i++) {
+            learnRepeat[i] = currentSignal.rawDataPtr->rawbuf[i + 1] * MICROS_PER_TICK;
+          }
+          learnRepeatLen = len;
+        }
+        matches = repeatFrame = true;
+      }
 
       // Check if this signal matches the base signal
-      if (signalsMatch(baseSignal, currentSignal)) {
+      if (matches && !burstAppend(learnRuns, learnRunCount, min(gap / BURST_GAP_UNIT_US, (uint32_t)0xFFFF), repeatFrame)) {
+        LOGW("Burst profile full, ignoring burst");
+      } else if (matches) {
         capturedRepeats++;
-        uint16_t interval = now - lastSignalTime;
         lastSignalTime = now;
-        lastRepeatTime = now;
 
-        Serial.print("Burst #");
-        Serial.print(capturedRepeats + 1);  // +1 because we count additional bursts
-        Serial.print(" detected (interval: ");
-        Serial.print(interval);
-        Serial.println("ms)");
+        LOGD("Burst #%d detected (gap: %luus%s)", capturedRepeats + 1, (unsigned long)gap, repeatFrame ? ", repeat frame" : "");
+        trace(TRACE_LEARN_FRAME, capturedRepeats + 1);
 
         // Publish burst detection status
         char msg[64];
         snprintf(msg, sizeof(msg), "learn_burst_detected:%d", capturedRepeats + 1);
-        mqtt.publish(TOPIC_STATE, msg);
+        enqueuePublish(TOPIC_STATE, msg, COALESCE_LEARN_BURST);
       } else {
-        Serial.println("Different signal detected, ignoring (press same button only)");
+        LOGW("Different signal detected, ignoring (press same button only)");
       }
+      lastFrameMatched = matches;
     }
 
     IrReceiver.resume();  // Continue listening
@@ -706,63 +3681,409 @@ static void handleLearnWindow() {
   bool idleTimeout = hasBaseSignal && (timeSinceLastSignal > BURST_IDLE_TIMEOUT_MS);
   bool maxTimeout = now > learnDeadline;
 
-  if (idleTimeout || maxTimeout) {
-    if (!hasBaseSignal) {
-      // No signal received at all
-      Serial.println("Learning timeout - no signal received");
-      mqtt.publish(TOPIC_STATE, "learn_timeout:no_signal");
+  if (!idleTimeout && !maxTimeout) return;
+
+  if (!hasBaseSignal) {
+    // No signal received at all
+    if (batchCount > 0) {
+      LOGI("No signal for batch name, skipping: %s", learningCommandName);
+      char msg[96];
+      snprintf(msg, sizeof(msg), "batch_skip:%s", learningCommandName);
+      enqueuePublish(TOPIC_STATE, msg);
+      batchFingerprints[batchIndex] = 0;  // Never matches a real fingerprint
     } else {
-      // Got signal(s), end learning
-      if (idleTimeout) {
-        Serial.print("Burst sequence complete (");
-        Serial.print(timeSinceLastSignal);
-        Serial.println("ms idle)");
-      } else {
-        Serial.println("Learning timeout (max 10s reached)");
-      }
+      LOGI("Learning timeout - no signal received");
+      enqueuePublish(TOPIC_STATE, "learn_timeout:no_signal");
+    }
+  } else {
+    // Got signal(s), end this capture
+    if (idleTimeout) {
+      LOGI("Burst sequence complete (%lums idle)", (unsigned long)timeSinceLastSignal);
+    } else {
+      LOGI("Learning timeout (max 10s reached)");
+    }
 
-      // Calculate average burst interval if we got multiple bursts
-      uint16_t avgInterval = 0;
-      if (capturedRepeats > 0) {
-        uint32_t totalTime = lastRepeatTime - firstPressTime;
-        avgInterval = totalTime / capturedRepeats;
-
-        Serial.print("Captured ");
-        Serial.print(capturedRepeats + 1);  // +1 for total count
-        Serial.print(" total bursts, avg interval: ");
-        Serial.print(avgInterval);
-        Serial.println("ms");
-      } else {
-        Serial.println("Single burst (no repeats)");
-      }
+    // Mean gap, for the repeatInterval of older readers of the definition
+    uint16_t avgInterval = 0;
+    if (capturedRepeats > 0) {
+      avgInterval = burstMeanMs(learnRuns, learnRunCount);
 
-      // Publish the command with burst info
-      publishDecode();
+      LOGI("Captured %d total bursts in %u runs, mean gap: %ums", capturedRepeats + 1, learnRunCount, avgInterval);
+    } else {
+      LOGI("Single burst (no repeats)");
+    }
 
-      // Publish success
-      char msg[128];
-      if (capturedRepeats > 0) {
-        snprintf(msg, sizeof(msg), "learn_success:%s,bursts:%d", learningCommandName, capturedRepeats + 1);
-      } else {
-        snprintf(msg, sizeof(msg), "learn_success:%s", learningCommandName);
+    // Batch: reject a button that was already recorded under an earlier name
+    if (batchCount > 0) {
+      uint32_t fp = baseSignal.protocol != UNKNOWN
+        ? protocolFingerprint(getProtocolString(baseSignal.protocol), baseSignal.address, baseSignal.command)
+        : rawFingerprint(baseRaw, baseRawLen);
+      for (uint8_t i = 0; i < batchIndex; i++) {
+        if (batchFingerprints[i] == fp) {
+          LOGW("Duplicate press, same as: %s", batchNames[i]);
+          char msg[96];
+          snprintf(msg, sizeof(msg), "batch_duplicate:%s,same_as:%s", learningCommandName, batchNames[i]);
+          enqueuePublish(TOPIC_STATE, msg);
+          resetBurstCapture();
+          learnDeadline = now + LEARNING_TOTAL_TIMEOUT_MS;  // Retry the same name
+          return;
+        }
       }
-      mqtt.publish(TOPIC_STATE, msg);
+      batchFingerprints[batchIndex] = fp;
+    }
+
+    // Hand off to the analyze stage; receiver is released right away
+    LearnCapture* c = captureQueue.push();
+    if (c) {
+      strcpy(c->name, learningCommandName);
+      c->protocol = baseSignal.protocol;
+      c->address = baseSignal.address;
+      c->command = baseSignal.command;
+      c->repeats = capturedRepeats;
+      c->avgInterval = avgInterval;
+      c->burstRuns = learnRunCount;
+      memcpy(c->bursts, learnRuns, sizeof(learnRuns));
+      c->repeatLen = learnRepeatLen;
+      memcpy(c->repeatFrame, learnRepeat, sizeof(learnRepeat));
+      c->freq = learnFreq ? learnFreq : baseCarrier ? baseCarrier : RAW_FREQ_DEFAULT;
+      c->duty = learnDuty;
+      c->rawLen = baseRawLen;
+      memcpy(c->raw, baseRaw, baseRawLen * sizeof(uint16_t));
+      if (batchCount > 0) batchCaptured++;
+      trace(TRACE_LEARN_CAPTURED, capturedRepeats);
+    } else {
+      LOGE("ERROR: Learn pipeline full, capture dropped");
+      char msg[96];
+      snprintf(msg, sizeof(msg), "ERR:LEARN_BUSY:%s", learningCommandName);
+      enqueuePublish(TOPIC_STATE, msg);
+    }
+  }
+
+  resetBurstCapture();
+
+  // Batch: auto-advance to the next name with the receiver still running
+  if (batchCount > 0 && ++batchIndex < batchCount) {
+    strcpy(learningCommandName, batchNames[batchIndex]);
+    learnDeadline = now + LEARNING_TOTAL_TIMEOUT_MS;
+    char msg[96];
+    snprintf(msg, sizeof(msg), "learn_start:%s", learningCommandName);
+    enqueuePublish(TOPIC_STATE, msg);
+    LOGI("Next batch name: %s", learningCommandName);
+    return;
+  }
+
+  // Clean up
+  if (!receiveActive) {
+    IrReceiver.end();  // Stop the receiver (keep it running for receive mode)
+  }
+  learnActive = false;
+  learningCommandName[0] = '\0';  // Clear the name
+
+  if (batchCount > 0) {
+    char msg[64];
+    snprintf(msg, sizeof(msg), "batch_done:%u/%u", batchCaptured, batchCount);
+    enqueuePublish(TOPIC_STATE, msg);
+    LOGI("Batch complete, captured %u/%u", batchCaptured, batchCount);
+    batchCount = 0;
+    flushLearnPipeline();
+  }
+}
+
+// Timings of the last frame passed to receivedFingerprint(), in microseconds
+static uint16_t rxTimings[MAX_RAW_DATA];
+static uint16_t rxLen = 0;
+
+// Recognition key of the frame currently held by the receiver (also copies its timings)
+static uint32_t receivedFingerprint() {
+  const IRData& d = IrReceiver.decodedIRData;
+  rxLen = min((int)d.rawlen - 1, MAX_RAW_DATA);
+  for (uint16_t i = 0; i < rxLen; i++) {
+    rxTimings[i] = d.rawDataPtr->rawbuf[i + 1] * MICROS_PER_TICK;
+  }
+  if (d.protocol != UNKNOWN) {
+    return protocolFingerprint(getProtocolString(d.protocol), d.address, d.command);
+  }
+  return rawFingerprint(rxTimings, rxLen);
+}
+
+// Recognize presses on real remotes while receive mode is on (call from loop())
+static void handleReceive() {
+  if (!receiveActive || learnActive || benchActive) return;
+  if (!IrReceiver.decode()) return;
+  if (emittersBusy()) {
+    IrReceiver.resume();  // Our own transmission
+    return;
+  }
+
+  const IRData& d = IrReceiver.decodedIRData;
+  uint32_t fp = receivedFingerprint();
+  bool isRepeat = d.flags & IRDATA_FLAGS_IS_REPEAT;
+  IrReceiver.resume();
+
+  // One press = one event: suppress repeat frames and the rest of the burst
+  uint32_t now = millis();
+  bool sameBurst = fp == lastRecognizedFp && (now - lastRecognizedTime) <= BURST_IDLE_TIMEOUT_MS;
+  lastRecognizedFp = fp;
+  lastRecognizedTime = now;
+  if (sameBurst || isRepeat) return;
+
+  StoredCommand* cmd = findCommandByFingerprint(fp);
+  if (cmd) {
+    trace(TRACE_RECOGNIZED, cmd - commandCache);
+    enqueuePublish(TOPIC_RECEIVED, cmd->name);
+    LOGI("Recognized: %s", cmd->name);
+  }
+}
+
+static size_t appendHistogram(char* out, size_t size, const char* key, const LatencyHistogram& h) {
+  size_t pos = snprintf(out, size, "\"%s\":{\"n\":%lu,\"p50\":%lu,\"p99\":%lu,\"max\":%lu,\"b\":[",
+    key, (unsigned long)h.count, (unsigned long)h.percentile(50), (unsigned long)h.percentile(99), (unsigned long)h.maxUs);
+  // Trailing empty buckets are omitted
+  int last = HIST_BUCKETS - 1;
+  while (last >= 0 && h.buckets[last] == 0) last--;
+  for (int b = 0; b <= last && pos < size; b++) {
+    pos += snprintf(out + pos, size - pos, b ? ",%lu" : "%lu", (unsigned long)h.buckets[b]);
+  }
+  if (pos < size) pos += snprintf(out + pos, size - pos, "]}");
+  return pos;
+}
+
+// Memory watermarks: heap (free, all-time minimum, largest allocatable block - a
+// shrinking block with steady free heap means fragmentation), stack high-water marks
+// (bytes never used) of the loop task, which also runs the MQTT callback, and of the
+// lwIP task, plus hot tier occupancy in bytes and cold tier / hit-rate counters
+static size_t appendMemory(char* out, size_t size) {
+  TaskHandle_t tcpipTask = xTaskGetHandle("tiT");
+  return snprintf(out, size,
+    "\"mem\":{\"heap_free\":%lu,\"heap_min\":%lu,\"heap_max_block\":%lu,"
+    "\"stack_loop\":%lu,\"stack_tcpip\":%ld,\"cache_used\":%lu,\"cache_size\":%lu,\"cache_commands\":%u,"
+    "\"cold_commands\":%u,\"cold_free\":%u,\"cold_slots\":%u,\"hot_hits\":%lu,\"hot_misses\":%lu,\"hot_evictions\":%lu}",
+    (unsigned long)ESP.getFreeHeap(), (unsigned long)ESP.getMinFreeHeap(), (unsigned long)ESP.getMaxAllocHeap(),
+    (unsigned long)uxTaskGetStackHighWaterMark(nullptr),
+    tcpipTask ? (long)uxTaskGetStackHighWaterMark(tcpipTask) : -1L,
+    (unsigned long)(hotCount * sizeof(StoredCommand)), (unsigned long)sizeof(commandCache), hotCount,
+    commandCount, coldErased, coldSlots,
+    (unsigned long)hotHits, (unsigned long)hotMisses, (unsigned long)hotEvictions);
+}
+
+// Advance pos by an snprintf-style length n. False once the text no longer fits, with
+// pos left on the terminator so later appends write nothing
+static bool metricsFit(size_t& pos, size_t size, size_t n) {
+  if (n >= size - pos) {
+    pos = size - 1;
+    return false;
+  }
+  pos += n;
+  return true;
+}
+
+// Publish metrics document and start a new window (call from loop(), or with force
+// on request)
+static void publishMetrics(bool force) {
+  uint32_t now = millis();
+  if (!force && now - lastMetricsTime < METRICS_INTERVAL_MS) return;
+  if (!mqtt.connected()) return;
+
+  static char msg[1792];
+  const size_t size = sizeof(msg);
+  size_t pos = 0;
+  bool fits = metricsFit(pos, size, snprintf(msg, size, "{\"uptime\":%lu,\"window\":%lu,",
+    (unsigned long)(now / 1000), (unsigned long)(now - lastMetricsTime)));
+  fits &= metricsFit(pos, size, appendMemory(msg + pos, size - pos));
+  fits &= metricsFit(pos, size, snprintf(msg + pos, size - pos,
+    ",\"outbox\":{\"queued\":%u,\"peak\":%u,\"coalesced\":%lu,\"overflow\":%lu},",
+    outbox.count, outboxPeak, (unsigned long)outboxCoalesced, (unsigned long)outboxOverflow));
+  outboxPeak = outbox.count;
+  struct { const char* key; LatencyHistogram* hist; } stages[] = {
+    { "parse", &parseHist }, { "lookup", &lookupHist }, { "airtime", &airtimeHist },
+    { "send", &sendHist }, { "publish", &publishHist },
+  };
+  for (uint8_t i = 0; i < sizeof(stages) / sizeof(stages[0]); i++) {
+    if (i) fits &= metricsFit(pos, size, snprintf(msg + pos, size - pos, ","));
+    fits &= metricsFit(pos, size, appendHistogram(msg + pos, size - pos, stages[i].key, *stages[i].hist));
+    stages[i].hist->reset();
+  }
+  if (profilerActive) {
+    fits &= metricsFit(pos, size, snprintf(msg + pos, size - pos,
+      ",\"loop\":{\"n\":%lu,\"mean\":%lu,\"max\":%lu,\"stalls\":%lu,\"stages\":{",
+      (unsigned long)loopIterations,
+      (unsigned long)(loopIterations ? loopTotalUs / loopIterations : 0),
+      (unsigned long)loopMaxUs, (unsigned long)loopStalls));
+    // Per stage: [mean, max, stalls]
+    for (uint8_t i = 0; i < LOOP_STAGES; i++) {
+      fits &= metricsFit(pos, size, snprintf(msg + pos, size - pos, "%s\"%s\":[%lu,%lu,%lu]", i ? "," : "",
+        loopStageNames[i],
+        (unsigned long)(loopIterations ? loopStats[i].totalUs / loopIterations : 0),
+        (unsigned long)loopStats[i].maxUs, (unsigned long)loopStats[i].stalls));
+    }
+    if (lastStallStage < LOOP_STAGES) {
+      fits &= metricsFit(pos, size, snprintf(msg + pos, size - pos,
+        "},\"last_stall\":{\"stage\":\"%s\",\"us\":%lu,\"age\":%lu}",
+        loopStageNames[lastStallStage], (unsigned long)lastStallUs, (unsigned long)((now - lastStallTime) / 1000)));
+    } else {
+      fits &= metricsFit(pos, size, snprintf(msg + pos, size - pos, "}"));
+    }
+    fits &= metricsFit(pos, size, snprintf(msg + pos, size - pos, "}"));
+    profileReset();
+  }
+  fits &= metricsFit(pos, size, snprintf(msg + pos, size - pos, "}"));
+
+  // A cut-off document is not JSON; send a stub that says so, so requesters still hear back
+  if (!fits) {
+    LOGW("Metrics document exceeds %u bytes", (unsigned)size);
+    snprintf(msg, size, "{\"uptime\":%lu,\"window\":%lu,\"truncated\":true}",
+      (unsigned long)(now / 1000), (unsigned long)(now - lastMetricsTime));
+  }
+  mqtt.publish(TOPIC_METRICS, msg);
+  lastMetricsTime = now;
+}
+
+// ====== Timing Bench ======
+// Loopback test of the transmit path: each stored command is sent once while the
+// receiver listens (IR LED must be visible to the receiver, e.g. pointed at it or at a
+// nearby reflective surface). Reports whether the frame decodes back to the same
+// command and, for raw commands, per-edge timing error against the stored timings:
+// bias (mean signed error) for marks and spaces, mean/max absolute error and jitter
+// (std deviation around the bias). Runs from loop() while WiFi/MQTT stay active, so
+// the numbers include the jitter they add. Receiver resolution is MICROS_PER_TICK.
+// test/test_round_trip runs the same check against a model of the path on the host.
+#define BENCH_DECODE_TIMEOUT_MS 300  // Frame sent -> decoded
+#define BENCH_SETTLE_MS 150          // Gap between commands
+
+static int16_t  benchSlot = -1;     // Cold tier slot under test
+static bool     benchAll = false;   // Walk the whole catalogue vs. a single command
+static bool     benchWaiting = false;
+static uint32_t benchDeadline = 0;
+static uint16_t benchRun = 0;
+static uint16_t benchDecoded = 0;
+static uint16_t benchMatched = 0;
+static uint32_t benchMaxErr = 0;
+static StoredCommand benchCmd;      // Read from flash so the walk does not churn the hot tier
+
+// Next live cold slot from benchSlot on (coldSlots when done)
+static void benchSeek() {
+  while (benchSlot < coldSlots && coldSlotState(benchSlot) != COLD_USED) benchSlot++;
+}
+
+void startBench(int16_t slot, bool all) {
+  benchSlot = slot;
+  benchSeek();
+  benchAll = all;
+  benchWaiting = false;
+  benchDeadline = millis();
+  benchRun = benchDecoded = benchMatched = 0;
+  benchMaxErr = 0;
+  benchActive = true;
+  if (!receiveActive) IrReceiver.begin(IR_RECEIVE_PIN, DISABLE_LED_FEEDBACK);
+  enqueuePublish(TOPIC_STATE, "bench_start");
+}
+
+// Compare the received frame against the command that was sent and publish a result
+static void publishBenchResult(const StoredCommand* cmd, bool decoded) {
+  char msg[320];
+  benchRun++;
+  if (!decoded) {
+    snprintf(msg, sizeof(msg), "{\"name\":\"%s\",\"decoded\":false}", cmd->name);
+    enqueuePublish(TOPIC_BENCH_RESULT, msg);
+    return;
+  }
+  benchDecoded++;
+
+  bool match = receivedFingerprint() == cmd->fingerprint;
+  if (match) benchMatched++;
+  size_t pos = snprintf(msg, sizeof(msg), "{\"name\":\"%s\",\"decoded\":true,\"match\":%s,\"proto\":\"%s\"",
+    cmd->name, match ? "true" : "false", getProtocolString(IrReceiver.decodedIRData.protocol));
+
+  if (cmd->isRaw) {
+    // Even index = mark, odd = space
+    int32_t sum[2] = { 0, 0 };
+    int64_t sumSq[2] = { 0, 0 };
+    uint16_t n[2] = { 0, 0 };
+    uint32_t sumAbs = 0, maxAbs = 0;
+    const uint16_t* timings = rawTimingsOf(cmd);
+    uint16_t edges = timings ? min(cmd->raw.len, rxLen) : 0;
+    for (uint16_t i = 0; i < edges; i++) {
+      int32_t err = (int32_t)rxTimings[i] - timings[i];
+      uint32_t absErr = err < 0 ? -err : err;
+      sum[i & 1] += err;
+      sumSq[i & 1] += (int64_t)err * err;
+      n[i & 1]++;
+      sumAbs += absErr;
+      if (absErr > maxAbs) maxAbs = absErr;
+    }
+    int32_t bias[2];
+    double var = 0;
+    for (uint8_t k = 0; k < 2; k++) {
+      bias[k] = n[k] ? sum[k] / n[k] : 0;
+      if (n[k]) var += (double)sumSq[k] - (double)sum[k] * sum[k] / n[k];
+    }
+    uint32_t jitter = edges ? (uint32_t)sqrt(var / edges) : 0;
+    if (maxAbs > benchMaxErr) benchMaxErr = maxAbs;
+
+    snprintf(msg + pos, sizeof(msg) - pos,
+      ",\"edges\":%u,\"edges_rx\":%u,\"mark_bias\":%ld,\"space_bias\":%ld,\"mean_err\":%lu,\"max_err\":%lu,\"jitter\":%lu}",
+      cmd->raw.len, rxLen, (long)bias[0], (long)bias[1],
+      (unsigned long)(edges ? sumAbs / edges : 0), (unsigned long)maxAbs, (unsigned long)jitter);
+  } else {
+    snprintf(msg + pos, sizeof(msg) - pos, "}");
+  }
+  enqueuePublish(TOPIC_BENCH_RESULT, msg);
+}
+
+// call from loop()
+static void handleBench() {
+  if (!benchActive) return;
+  uint32_t now = millis();
+
+  if (benchWaiting) {
+    bool decoded = IrReceiver.decode();
+    if (!decoded && now < benchDeadline) return;
+    publishBenchResult(&benchCmd, decoded);
+    if (decoded) IrReceiver.resume();
+    benchWaiting = false;
+    benchDeadline = now + BENCH_SETTLE_MS;
+    if (benchAll) {
+      benchSlot++;
+      benchSeek();
+    } else {
+      benchSlot = coldSlots;  // Done after the single command
     }
+    return;
+  }
+
+  if (now < benchDeadline) return;
+
+  // Skip a command deleted meanwhile
+  if (benchSlot < coldSlots && coldSlotState(benchSlot) != COLD_USED) {
+    if (benchAll) benchSeek();
+    else benchSlot = coldSlots;
+  }
 
-    // Clean up
-    IrReceiver.end();  // Stop the receiver
-    learnActive = false;
-    hasBaseSignal = false;
-    capturedRepeats = 0;
-    firstPressTime = 0;
-    lastRepeatTime = 0;
-    lastSignalTime = 0;
-    learningCommandName[0] = '\0';  // Clear the name
+  if (benchSlot >= coldSlots || !coldRead(benchSlot, &benchCmd)) {
+    char msg[128];
+    snprintf(msg, sizeof(msg), "{\"summary\":{\"commands\":%u,\"decoded\":%u,\"matched\":%u,\"max_err\":%lu}}",
+      benchRun, benchDecoded, benchMatched, (unsigned long)benchMaxErr);
+    enqueuePublish(TOPIC_BENCH_RESULT, msg);
+    if (!receiveActive) IrReceiver.end();
+    benchActive = false;
+    enqueuePublish(TOPIC_STATE, "bench_done");
+    LOGI("Bench done: %u/%u decoded, %u matched", benchDecoded, benchRun, benchMatched);
+    return;
   }
+
+  // Wait for the emitter to drain, drop anything received since the last frame, then
+  // send the next one
+  if (channels[channelOf(&benchCmd)].count) return;
+  if (IrReceiver.decode()) IrReceiver.resume();
+  transmitFrame(&benchCmd);
+  benchWaiting = true;
+  benchDeadline = millis() + BENCH_DECODE_TIMEOUT_MS;
 }
 
 void setup() {
   Serial.begin(115200);
+  loadDeviceId();
+  loadCatalogFilter();
   WiFi.mode(WIFI_STA);
   WiFi.begin(WIFI_SSID, WIFI_PASS);
   pinMode(ONBOARD_LED, OUTPUT);  // Initialize LED pin
@@ -773,24 +4094,63 @@ void setup() {
   mqtt.setCallback(onMqttMessage);
   mqtt.setBufferSize(2048);  // Increase from default 256 bytes for large raw commands
 
-  // Only initialize sender here, receiver starts on-demand
-  IrSender.begin(IR_SEND_PIN);
+  memset(recognizeIndex, INDEX_EMPTY, sizeof(recognizeIndex));
+  memset(hotNameIndex, INDEX_EMPTY, sizeof(hotNameIndex));
+  coldBegin();
+
+  // Only initialize senders here, receiver starts on-demand
+  channelsBegin();
+  carrierBegin();
 
-  Serial.println("ESP32 IR Controller Ready");
+  LOGI("ESP32 IR Controller Ready");
 }
 
 void loop() {
+  profileBegin();
+
   if (!mqtt.connected()) ensureMqtt();
+  profileMark(STAGE_CONNECT);
   mqtt.loop();
+  profileMark(STAGE_MQTT);
+  handleSync();
+  profileMark(STAGE_SYNC);
 
-  // Control LED based on learn mode
+  // Control LED based on learn mode; three blinks after a raw send (see indicateSend)
+  uint32_t sinceSend = millis() - sendBlinkAt;
   if (learnActive) {
     digitalWrite(ONBOARD_LED, HIGH);
+  } else if (sendBlinkAt && sinceSend < SEND_BLINK_MS) {
+    digitalWrite(ONBOARD_LED, sinceSend / 200 % 2 == 0 ? HIGH : LOW);
   } else {
     digitalWrite(ONBOARD_LED, LOW);
   }
+  profileMark(STAGE_LED);
 
   // Learning mode now triggered via MQTT on TOPIC_LISTEN (see onMqttMessage function)
 
   handleLearnWindow();
+  profileMark(STAGE_LEARN);
+  handleReceive();
+  profileMark(STAGE_RECEIVE);
+  handleBench();
+  profileMark(STAGE_BENCH);
+  handleFleet();
+  profileMark(STAGE_FLEET);
+  handleChannels();
+  profileMark(STAGE_EMIT);
+  handleTransfer();
+  handleTraceDump();
+  profileMark(STAGE_TRANSFER);
+
+  // Learn pipeline stages after capture, one item each per iteration
+  analyzeCapture();
+  publishDecode();
+  flushOutbox();
+  profileMark(STAGE_PIPELINE);
+
+  publishMetrics();
+  profileMark(STAGE_METRICS);
+
+  logFlush();
+  profileEnd();
 }
\ No newline at end of file
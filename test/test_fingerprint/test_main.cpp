@@ -0,0 +1,109 @@
+// Native tests of include/ir_fingerprint.h: a frame received with jitter must key to
+// the stored command, and different commands must not.
+//
+//   pio test -e native
+
+#include <unity.h>
+
+#include "ir_fingerprint.h"
+#include "ir_frames.h"
+
+// fan_power from commands.json: 220-580 us short and 1170-1430 us long widths, and
+// three gaps between repeated frames
+static const uint16_t FAN_POWER[] = {
+  1330, 270, 1380, 270, 580, 1220, 1280, 270, 1430, 320, 480, 1220, 430, 1220, 480, 1220, 430, 1220, 430, 1220,
+  430, 1220, 1330, 7070, 1280, 370, 1330, 270, 530, 1220, 1330, 220, 1430, 270, 580, 1220, 480, 1170, 480, 1170,
+  480, 1170, 480, 1220, 430, 1220, 1330, 8020, 1330, 320, 1330, 370, 480, 1220, 1280, 370, 1330, 320, 480, 1220,
+  480, 1170, 430, 1220, 430, 1270, 430, 1220, 430, 1220, 1280, 7120, 1280, 370, 1280, 420, 430, 1220, 1280, 420,
+  1280, 370, 430, 1270, 380, 1270, 430, 1220, 430, 1270, 380, 1270, 380, 1270, 1230,
+};
+#define FAN_POWER_LEN (sizeof(FAN_POWER) / sizeof(FAN_POWER[0]))
+
+static uint32_t rng = 12345;
+
+static int32_t uniform(int32_t range) {  // -range..range
+  rng ^= rng << 13;
+  rng ^= rng >> 17;
+  rng ^= rng << 5;
+  return (int32_t)(rng % (2 * range + 1)) - range;
+}
+
+// As a receiver sees it: marks stretched and spaces shortened by bias, each edge off by
+// up to jitter, then rounded to 50 us ticks
+static void receive(const uint16_t* in, uint16_t len, int32_t bias, int32_t jitter, uint16_t* out) {
+  for (uint16_t i = 0; i < len; i++) {
+    int32_t d = in[i] + (i & 1 ? -bias : bias) + uniform(jitter);
+    d = (d + 25) / 50 * 50;
+    out[i] = d < 50 ? 50 : d;
+  }
+}
+
+static void checkJitter(const uint16_t* frame, uint16_t len, uint16_t copies) {
+  uint32_t stored = rawFingerprint(frame, len);
+  uint16_t rx[256];
+  for (uint16_t t = 0; t < copies; t++) {
+    receive(frame, len, uniform(100), 100, rx);
+    TEST_ASSERT_EQUAL_HEX32(stored, rawFingerprint(rx, len));
+  }
+}
+
+void test_fan_power_jitter() { checkJitter(FAN_POWER, FAN_POWER_LEN, 2000); }
+
+// The 220 us space sits below every other short space; wherever it lands the key holds
+void test_fan_power_outlier() {
+  uint32_t stored = rawFingerprint(FAN_POWER, FAN_POWER_LEN);
+  uint16_t frame[FAN_POWER_LEN];
+  for (uint16_t d = 50; d <= 450; d += 50) {
+    for (uint16_t i = 0; i < FAN_POWER_LEN; i++) frame[i] = FAN_POWER[i];
+    frame[31] = d;
+    TEST_ASSERT_EQUAL_HEX32(stored, rawFingerprint(frame, FAN_POWER_LEN));
+  }
+}
+
+void test_fan_power_other_bit() {
+  uint16_t frame[FAN_POWER_LEN];
+  for (uint16_t i = 0; i < FAN_POWER_LEN; i++) frame[i] = FAN_POWER[i];
+  frame[11] = 430;  // A long space made short
+  TEST_ASSERT_NOT_EQUAL(rawFingerprint(FAN_POWER, FAN_POWER_LEN), rawFingerprint(frame, FAN_POWER_LEN));
+}
+
+// Protocol frames captured raw: NEC's 9000/4500 header sits on 8x and 16x its unit
+void test_protocol_frames_jitter() {
+  const Proto protos[] = { Proto::NEC, Proto::Samsung, Proto::LG, Proto::JVC, Proto::Panasonic, Proto::RC5 };
+  for (Proto proto : protos) {
+    for (uint8_t command = 0; command < 16; command++) {
+      uint16_t frame[128], kHz;
+      uint16_t len = encodeFrame(proto, 0x05, command, false, frame, &kHz);
+      checkJitter(frame, len, 50);
+    }
+  }
+}
+
+void test_commands_differ() {
+  uint32_t keys[64];
+  for (uint8_t command = 0; command < 64; command++) {
+    uint16_t frame[128], kHz;
+    uint16_t len = encodeFrame(Proto::NEC, 0x05, command, false, frame, &kHz);
+    keys[command] = rawFingerprint(frame, len);
+    for (uint8_t other = 0; other < command; other++) TEST_ASSERT_NOT_EQUAL(keys[other], keys[command]);
+  }
+}
+
+void test_protocol_fingerprint() {
+  TEST_ASSERT_EQUAL_HEX32(protocolFingerprint("NEC", 4, 8), protocolFingerprint("nec", 4, 8));
+  TEST_ASSERT_NOT_EQUAL(protocolFingerprint("NEC", 4, 8), protocolFingerprint("NEC", 4, 9));
+}
+
+void setUp() {}
+void tearDown() {}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_fan_power_jitter);
+  RUN_TEST(test_fan_power_outlier);
+  RUN_TEST(test_fan_power_other_bit);
+  RUN_TEST(test_protocol_frames_jitter);
+  RUN_TEST(test_commands_differ);
+  RUN_TEST(test_protocol_fingerprint);
+  return UNITY_END();
+}
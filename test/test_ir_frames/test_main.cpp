@@ -0,0 +1,238 @@
+// Native tests of include/ir_frames.h: protocol frames against IRremote 4.x's
+// reference timings and bit layouts, and the RMT chunks rendered from them.
+//
+//   pio test -e native
+
+#include <unity.h>
+
+#include "ir_frames.h"
+
+// IRremote's send functions: header, data bits (pulse distance: bit mark, then the
+// one or zero space; Sony is pulse width), stop bit. Independent of PULSE_CODINGS.
+struct Reference {
+  uint16_t headerMark, headerSpace;
+  uint16_t oneMark, oneSpace, zeroMark, zeroSpace;
+  bool msbFirst, stopBit;
+};
+
+static const Reference NEC_REF = { 16 * 560, 8 * 560, 560, 3 * 560, 560, 560, false, true };
+static const Reference SAMSUNG_REF = { 8 * 553, 8 * 553, 553, 3 * 553, 553, 553, false, true };
+static const Reference LG_REF = { 18 * 500, 4200, 500, 1580, 500, 550, true, true };
+static const Reference JVC_REF = { 8400, 4200, 526, 3 * 526, 526, 526, false, true };
+static const Reference SONY_REF = { 4 * 600, 600, 2 * 600, 600, 600, 600, false, false };
+static const Reference KASEIKYO_REF = { 8 * 432, 4 * 432, 432, 3 * 432, 432, 432, false, true };
+
+static uint16_t reference(const Reference& r, bool header, uint64_t data, uint8_t bits, uint16_t* out) {
+  uint16_t n = 0;
+  if (header) {
+    out[n++] = r.headerMark;
+    out[n++] = r.headerSpace;
+  }
+  for (uint8_t i = 0; i < bits; i++) {
+    bool one = data >> (r.msbFirst ? bits - 1 - i : i) & 1;
+    out[n++] = one ? r.oneMark : r.zeroMark;
+    if (i + 1 < bits || r.stopBit) out[n++] = one ? r.oneSpace : r.zeroSpace;
+  }
+  if (r.stopBit) out[n++] = r.oneMark;
+  return n;
+}
+
+static void checkFrame(Proto proto, uint16_t addr, uint8_t command, bool repeat, const uint16_t* expected, uint16_t n, uint16_t kHz) {
+  uint16_t out[128], outKHz = 0;
+  TEST_ASSERT_EQUAL_UINT16(n, encodeFrame(proto, addr, command, repeat, out, &outKHz));
+  TEST_ASSERT_EQUAL_UINT16_ARRAY(expected, out, n);
+  TEST_ASSERT_EQUAL_UINT16(kHz, outKHz);
+}
+
+static void checkPulse(Proto proto, uint16_t addr, uint8_t command, const Reference& r, uint64_t rawData, uint8_t bits, uint16_t kHz) {
+  uint16_t expected[128];
+  uint16_t n = reference(r, true, rawData, bits, expected);
+  checkFrame(proto, addr, command, false, expected, n, kHz);
+}
+
+// Raw data as IRremote decodes it for these address/command pairs
+void test_nec() { checkPulse(Proto::NEC, 0x04, 0x08, NEC_REF, 0xF708FB04, 32, 38); }
+void test_samsung() { checkPulse(Proto::Samsung, 0x0707, 0x02, SAMSUNG_REF, 0xFD020707, 32, 38); }
+void test_lg() { checkPulse(Proto::LG, 0x88, 0x34, LG_REF, 0x8800347, 28, 38); }
+void test_jvc() { checkPulse(Proto::JVC, 0x07, 0x02, JVC_REF, 0x0207, 16, 38); }
+void test_sony12() { checkPulse(Proto::Sony12, 0x01, 0x15, SONY_REF, 0x95, 12, 40); }
+void test_panasonic() { checkPulse(Proto::Panasonic, 0x08, 0x3D, KASEIKYO_REF, 0xBD3D00802002ULL, 48, 37); }
+
+void test_repeat_codes() {
+  const uint16_t nec[] = { 16 * 560, 4 * 560, 560 };
+  checkFrame(Proto::NEC, 0x04, 0x08, true, nec, 3, 38);
+  const uint16_t lg[] = { 18 * 500, 4 * 500, 500 };
+  checkFrame(Proto::LG, 0x88, 0x34, true, lg, 3, 38);
+  const uint16_t samsung[] = { 8 * 553, 8 * 553, 553, 553, 553 };
+  checkFrame(Proto::Samsung, 0x0707, 0x02, true, samsung, 5, 38);
+}
+
+// JVC repeats the data without the header; Sony resends the whole frame
+void test_repeat_frames() {
+  uint16_t expected[128];
+  uint16_t n = reference(JVC_REF, false, 0x0207, 16, expected);
+  checkFrame(Proto::JVC, 0x07, 0x02, true, expected, n, 38);
+  n = reference(SONY_REF, true, 0x95, 12, expected);
+  checkFrame(Proto::Sony12, 0x01, 0x15, true, expected, n, 40);
+}
+
+// Manchester: RC5 1 = space then mark (889 us halves), RC6 1 = mark then space (444 us
+// halves, 6/2 unit leader, double-width toggle). Address 0x05 / 0x04, command 0x0C.
+void test_rc5() {
+  const uint16_t rc5[] = { 889, 889, 1778, 889, 889, 889, 889, 1778, 1778, 1778, 1778, 889, 889, 1778, 889, 889, 1778, 889, 889 };
+  checkFrame(Proto::RC5, 0x05, 0x0C, false, rc5, sizeof(rc5) / sizeof(rc5[0]), 36);
+}
+
+void test_rc6() {
+  const uint16_t rc6[] = { 2664, 888, 444, 888, 444, 444, 444, 444, 444, 888, 888, 444, 444, 444, 444, 444, 444, 444, 444, 444,
+                           888, 888, 444, 444, 444, 444, 444, 444, 444, 444, 444, 444, 888, 444, 444, 888, 444, 444, 444 };
+  checkFrame(Proto::RC6, 0x04, 0x0C, false, rc6, sizeof(rc6) / sizeof(rc6[0]), 36);
+}
+
+// Levels of a chunk in order, split levels merged back into one duration
+static uint16_t chunkLevels(const IrChunk& c, uint32_t* out, bool* startsWithMark) {
+  uint16_t n = 0;
+  bool last = false;
+  for (uint16_t i = 0; i < c.itemCount + c.half; i++) {
+    const IrItem& item = c.items[i];
+    for (uint8_t l = 0; l < 2; l++) {
+      uint32_t d = l ? item.duration1 : item.duration0;
+      bool mark = l ? item.level1 : item.level0;
+      if (d == 0) break;
+      if (n == 0) *startsWithMark = mark;
+      if (n > 0 && mark == last) out[n - 1] += d;
+      else out[n++] = d;
+      last = mark;
+    }
+  }
+  return n;
+}
+
+void test_long_levels_split() {
+  IrChunk c;
+  chunkClear(c);
+  TEST_ASSERT_EQUAL_UINT32(0, itemPush(c, true, 560));
+  TEST_ASSERT_EQUAL_UINT32(0, itemPush(c, false, 40000));
+  TEST_ASSERT_EQUAL_UINT16(1, c.itemCount);
+  TEST_ASSERT_TRUE(c.half);
+  TEST_ASSERT_EQUAL_UINT32(IR_LEVEL_MAX, c.items[0].duration1);
+  TEST_ASSERT_EQUAL_UINT32(40000 - IR_LEVEL_MAX, c.items[1].duration0);
+  TEST_ASSERT_EQUAL_UINT32(0, c.items[1].level0);
+  TEST_ASSERT_EQUAL_UINT32(0, c.items[1].duration1);  // Ends the chunk
+}
+
+// A send of a fixed frame with gapUs between bursts
+struct FixedSource {
+  const uint16_t* timings;
+  uint16_t len;
+  uint16_t bursts;  // After the first
+  uint32_t gapUs;
+  uint16_t startedCount;
+
+  const uint16_t* frame(bool, uint16_t* n) {
+    *n = len;
+    return timings;
+  }
+  bool next(uint32_t, uint32_t* gap, bool* repeatFrame) {
+    if (bursts == 0) return false;
+    bursts--;
+    *gap = gapUs;
+    *repeatFrame = false;
+    return true;
+  }
+  void started(uint16_t) { startedCount++; }
+};
+
+static IrBurstState sendState() {
+  IrBurstState s = {};
+  s.pending = true;
+  return s;
+}
+
+void test_bursts_in_one_chunk() {
+  uint16_t nec[128], kHz;
+  uint16_t len = encodeFrame(Proto::NEC, 0x04, 0x08, false, nec, &kHz);
+  FixedSource src = { nec, len, 2, 40000, 0 };
+  IrChunk c;
+  IrBurstState s = sendState();
+  TEST_ASSERT_EQUAL(IR_RENDERED, renderChunk(c, s, src, false));
+  TEST_ASSERT_FALSE(s.pending);
+  TEST_ASSERT_EQUAL_UINT16(3, s.burst);
+
+  uint32_t levels[512];
+  bool startsWithMark = false;
+  uint16_t n = chunkLevels(c, levels, &startsWithMark);
+  TEST_ASSERT_TRUE(startsWithMark);
+  TEST_ASSERT_EQUAL_UINT16(3 * len + 2, n);
+  for (uint16_t b = 0; b < 3; b++) {
+    for (uint16_t i = 0; i < len; i++) TEST_ASSERT_EQUAL_UINT32(nec[i], levels[b * (len + 1) + i]);
+    if (b < 2) TEST_ASSERT_EQUAL_UINT32(40000, levels[b * (len + 1) + len]);
+  }
+  TEST_ASSERT_EQUAL(IR_RENDER_DONE, renderChunk(c, s, src, false));
+}
+
+// A send longer than a chunk splits on the gap before a burst; every burst is rendered once
+void test_split_on_gap() {
+  uint16_t frame[199];
+  for (uint16_t i = 0; i < 199; i++) frame[i] = i & 1 ? 800 : 400;
+  FixedSource src = { frame, 199, 5, 50000, 0 };
+  IrBurstState s = sendState();
+  IrChunk c;
+  uint16_t chunks = 0;
+  while (renderChunk(c, s, src, false) == IR_RENDERED) {
+    uint32_t levels[512];
+    bool startsWithMark = false;
+    uint16_t n = chunkLevels(c, levels, &startsWithMark);
+    TEST_ASSERT_TRUE(n > 0);
+    if (s.pending) TEST_ASSERT_EQUAL(n & 1, startsWithMark ? 0 : 1);  // Ends on a gap
+    chunks++;
+  }
+  TEST_ASSERT_EQUAL_UINT16(6, s.burst);
+  TEST_ASSERT_EQUAL_UINT16(6, src.startedCount);
+  TEST_ASSERT_EQUAL_UINT32(6 * (100 * 400 + 99 * 800), s.airtime);
+  TEST_ASSERT_TRUE(chunks >= 3);
+}
+
+void test_hold_one_burst_per_chunk() {
+  uint16_t nec[128], kHz;
+  uint16_t len = encodeFrame(Proto::NEC, 0x04, 0x08, false, nec, &kHz);
+  FixedSource src = { nec, len, 3, 40000, 0 };
+  IrBurstState s = sendState();
+  IrChunk c;
+  TEST_ASSERT_EQUAL(IR_RENDERED, renderChunk(c, s, src, true));
+  TEST_ASSERT_EQUAL_UINT16(1, s.burst);
+  TEST_ASSERT_EQUAL(IR_RENDERED, renderChunk(c, s, src, true));
+  TEST_ASSERT_EQUAL_UINT16(2, s.burst);
+}
+
+void test_frame_too_long() {
+  static uint16_t frame[2 * IR_CHUNK_ITEMS + 1];
+  for (uint16_t i = 0; i < 2 * IR_CHUNK_ITEMS + 1; i++) frame[i] = 500;
+  FixedSource src = { frame, 2 * IR_CHUNK_ITEMS + 1, 0, 0, 0 };
+  IrBurstState s = sendState();
+  IrChunk c;
+  TEST_ASSERT_EQUAL(IR_RENDER_TOO_LONG, renderChunk(c, s, src, false));
+}
+
+void setUp() {}
+void tearDown() {}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_nec);
+  RUN_TEST(test_samsung);
+  RUN_TEST(test_lg);
+  RUN_TEST(test_jvc);
+  RUN_TEST(test_sony12);
+  RUN_TEST(test_panasonic);
+  RUN_TEST(test_repeat_codes);
+  RUN_TEST(test_repeat_frames);
+  RUN_TEST(test_rc5);
+  RUN_TEST(test_rc6);
+  RUN_TEST(test_long_levels_split);
+  RUN_TEST(test_bursts_in_one_chunk);
+  RUN_TEST(test_split_on_gap);
+  RUN_TEST(test_hold_one_burst_per_chunk);
+  RUN_TEST(test_frame_too_long);
+  return UNITY_END();
+}
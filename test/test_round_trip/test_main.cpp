@@ -0,0 +1,589 @@
+// Native round trip of every command in commands.json: each definition is stored as
+// the firmware stores it, rendered into RMT chunks by renderChunk (ir_frames.h), played
+// back by a model of the TX HAL as timestamped edges, and fed through a model receiver
+// to a decoder with IRremote's timings and tolerances. Every burst must decode to the
+// command that was sent (a raw command to no protocol, with every duration matching
+// the stored one), and every edge must land within bounds of where the stored timings
+// put it. Per-edge timing error, and how many raw bursts the firmware's fingerprint
+// recognizes, are printed for each command.
+//
+//   pio test -e native
+
+#include <unity.h>
+#include <ArduinoJson.h>
+#include <stdio.h>
+#include <string>
+
+#include "ir_fingerprint.h"
+#include "ir_frames.h"
+#include "raw_codec.h"
+
+#ifndef COMMANDS_JSON
+#define COMMANDS_JSON "commands.json"  // platformio.ini points this at the project's copy
+#endif
+
+#define MAX_TIMINGS 256
+#define MAX_PACKED RAW_CODEC_MAX_SIZE(MAX_TIMINGS)
+#define MAX_RUNS 8
+#define MAX_EDGES 2048
+#define MAX_FRAMES 32
+
+#define HOLD_REPEATS 2          // Definitions without a burst profile: a short hold...
+#define HOLD_GAP_US 40000       // ...of repeat frames this far apart
+
+#define RX_TICK_US 50           // IRremote's MICROS_PER_TICK
+#define RX_FRAME_GAP_US 10000   // A longer space ends a frame (fan_power has 8 ms spaces)
+#define TX_EDGE_MAX_ERR_US 1    // One RMT tick
+#define RX_EDGE_MAX_ERR_US (RX_TICK_US - 1)
+
+// ====== Commands ======
+struct Run {
+  uint32_t gapUs;
+  uint8_t count;
+  bool repeatFrame;
+};
+
+struct Command {
+  char name[32];
+  bool isRaw;
+  Proto proto;
+  uint16_t addr;
+  uint8_t command;
+  uint16_t len;                  // Raw: timing values, stored packed as the firmware does
+  uint8_t packed[MAX_PACKED];
+  size_t packedLen;
+  uint16_t repeat[MAX_TIMINGS];  // Raw repeat frame, repeatLen 0 = the full frame
+  uint16_t repeatLen;
+  Run runs[MAX_RUNS];
+  uint8_t runCount;
+};
+
+static std::string commandsText;
+
+static bool loadCommands() {
+  if (!commandsText.empty()) return true;
+  FILE* f = fopen(COMMANDS_JSON, "rb");
+  if (!f) return false;
+  char buf[512];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0) commandsText.append(buf, n);
+  fclose(f);
+  return true;
+}
+
+// A definition as the firmware parses it: raw "data" or "packed" timings (with
+// "repeatFrame"), or proto/addr/cmd, and the "bursts" or repeatCount/repeatInterval
+// profile, else a short hold
+static void parseCommand(const char* name, JsonObject def, Command& c) {
+  memset(&c, 0, sizeof(c));
+  snprintf(c.name, sizeof(c.name), "%s", name);
+  c.isRaw = def["raw"] | false;
+  if (c.isRaw) {
+    uint16_t timings[MAX_TIMINGS];
+    const char* packed = def["packed"] | (const char*)nullptr;
+    if (packed) {
+      int n = rawBase64Decode(packed, c.packed, sizeof(c.packed));
+      c.len = def["len"] | 0;
+      TEST_ASSERT_TRUE_MESSAGE(n > 0 && rawDecode(c.packed, n, timings, c.len), name);
+      c.packedLen = n;
+    } else {
+      JsonArray data = def["data"];
+      for (JsonVariant v : data) {
+        TEST_ASSERT_TRUE_MESSAGE(c.len < MAX_TIMINGS, name);
+        timings[c.len++] = v.as<uint16_t>();
+      }
+      c.packedLen = rawEncode(timings, c.len, c.packed, sizeof(c.packed));
+    }
+    TEST_ASSERT_TRUE_MESSAGE(c.len > 0 && c.packedLen > 0, name);
+    JsonArray repeat = def["repeatFrame"];
+    for (JsonVariant v : repeat) c.repeat[c.repeatLen++] = v.as<uint16_t>();
+  } else {
+    c.proto = parseProto(def["proto"] | "NEC");
+    c.addr = def["addr"] | 0;
+    c.command = def["cmd"] | 0;
+  }
+
+  JsonArray bursts = def["bursts"];
+  for (JsonArray run : bursts) {
+    if (c.runCount == MAX_RUNS) break;
+    c.runs[c.runCount++] = { (uint32_t)(run[0] | 0L), (uint8_t)(run[1] | 0), (run[2] | 0) != 0 };
+  }
+  int repeatCount = def["repeatCount"] | 0;
+  if (c.runCount == 0 && repeatCount > 0) {
+    c.runs[c.runCount++] = { (uint32_t)(def["repeatInterval"] | 0) * 1000, (uint8_t)repeatCount, false };
+  }
+  if (c.runCount == 0) c.runs[c.runCount++] = { HOLD_GAP_US, HOLD_REPEATS, true };
+}
+
+// ====== Send ======
+// The renderChunk source of a command's send: its frames, then its burst profile
+struct Send {
+  const Command& c;
+  uint16_t full[MAX_TIMINGS];
+  uint16_t fullLen;
+  uint16_t repeat[MAX_TIMINGS];
+  uint16_t repeatLen;
+  uint8_t run;
+  uint8_t taken;
+
+  explicit Send(const Command& cmd) : c(cmd), fullLen(0), repeatLen(0), run(0), taken(0) {
+    uint16_t kHz;
+    if (c.isRaw) {
+      if (rawDecode(c.packed, c.packedLen, full, c.len)) fullLen = c.len;
+      repeatLen = c.repeatLen;
+      memcpy(repeat, c.repeatLen ? c.repeat : full, sizeof(repeat));
+      if (!repeatLen) repeatLen = fullLen;
+    } else {
+      fullLen = encodeFrame(c.proto, c.addr, c.command, false, full, &kHz);
+      repeatLen = encodeFrame(c.proto, c.addr, c.command, true, repeat, &kHz);
+    }
+  }
+
+  const uint16_t* frame(bool repeatFrame, uint16_t* len) {
+    *len = repeatFrame ? repeatLen : fullLen;
+    return *len ? (repeatFrame ? repeat : full) : nullptr;
+  }
+  bool next(uint32_t, uint32_t* gapUs, bool* repeatFrame) {
+    while (run < c.runCount && taken >= c.runs[run].count) {
+      run++;
+      taken = 0;
+    }
+    if (run >= c.runCount) return false;
+    *gapUs = c.runs[run].gapUs;
+    *repeatFrame = c.runs[run].repeatFrame;
+    taken++;
+    return true;
+  }
+  void started(uint16_t) {}
+};
+
+// ====== Edges ======
+struct Edge {
+  uint32_t us;
+  bool mark;  // Level from here on
+};
+
+struct Timeline {
+  Edge edges[MAX_EDGES];
+  uint16_t count;
+  uint32_t now;
+  bool level;
+};
+
+static void levelFor(Timeline& t, bool mark, uint32_t us) {
+  if (us == 0) return;
+  if (mark != t.level) {
+    TEST_ASSERT_TRUE(t.count < MAX_EDGES);
+    t.edges[t.count++] = { t.now, mark };
+  }
+  t.level = mark;
+  t.now += us;
+}
+
+// The emitter idles off once the RMT runs out of items
+static void lineIdle(Timeline& t) {
+  if (t.level) t.edges[t.count++] = { t.now, false };
+  t.level = false;
+}
+
+// Model of the TX HAL: plays a chunk's items at one tick per us, as the RMT does with
+// RMT_CLK_DIV 80; a zero duration ends the chunk
+static void txPlay(Timeline& t, const IrChunk& c) {
+  for (uint16_t i = 0; i < c.itemCount + c.half; i++) {
+    const IrItem& item = c.items[i];
+    if (item.duration0 == 0) break;
+    levelFor(t, item.level0, item.duration0);
+    if (item.duration1 == 0) break;
+    levelFor(t, item.level1, item.duration1);
+  }
+  lineIdle(t);
+}
+
+// Where the stored timings put the edges: frames and gaps back to back
+static void idealTimeline(const Command& c, Timeline& t) {
+  memset(&t, 0, sizeof(t));
+  Send send(c);
+  bool repeatFrame = false;
+  uint32_t gap = 0;
+  do {
+    levelFor(t, false, gap);
+    uint16_t len;
+    const uint16_t* frame = send.frame(repeatFrame, &len);
+    for (uint16_t i = 0; i < len; i++) levelFor(t, !(i & 1), frame[i]);
+  } while (send.next(0, &gap, &repeatFrame));
+  lineIdle(t);
+}
+
+static void txTimeline(const Command& c, Timeline& t) {
+  memset(&t, 0, sizeof(t));
+  Send send(c);
+  IrBurstState s = {};
+  s.pending = true;
+  IrChunk chunk;
+  IrRender r;
+  while ((r = renderChunk(chunk, s, send, false)) == IR_RENDERED) txPlay(t, chunk);
+  TEST_ASSERT_EQUAL_MESSAGE(IR_RENDER_DONE, r, c.name);
+}
+
+// Model receiver: an ideal demodulator, and IrReceiver sees each edge at its next
+// RX_TICK_US sample, phase us into the tick. Any error past a tick is the transmit path's.
+static uint32_t rxEdgeUs(const Edge& e, uint32_t phase) {
+  return (e.us + RX_TICK_US - 1 - phase) / RX_TICK_US * RX_TICK_US + phase;
+}
+
+struct EdgeStats {
+  uint32_t maxErr;
+  uint64_t sumErr;
+  int64_t sum[2];  // Signed, by level the edge starts: space, mark
+  uint32_t n[2];
+
+  void add(bool mark, int32_t err) {
+    uint32_t absErr = err < 0 ? -err : err;
+    if (absErr > maxErr) maxErr = absErr;
+    sumErr += absErr;
+    sum[mark] += err;
+    n[mark]++;
+  }
+  uint32_t count() const { return n[0] + n[1]; }
+  long bias(bool mark) const { return n[mark] ? (long)(sum[mark] / (int64_t)n[mark]) : 0; }
+};
+
+// Received frames as IRremote's rawbuf holds them: durations in us, mark first
+struct Frames {
+  uint16_t timings[MAX_FRAMES][MAX_TIMINGS];
+  uint16_t len[MAX_FRAMES];
+  uint16_t count;
+};
+
+static void receive(const Timeline& tx, uint32_t phase, Frames& out) {
+  out.count = 0;
+  for (uint16_t i = 0; i + 1 < tx.count; i++) {
+    uint32_t d = rxEdgeUs(tx.edges[i + 1], phase) - rxEdgeUs(tx.edges[i], phase);
+    if (!tx.edges[i].mark && d >= RX_FRAME_GAP_US) continue;  // Gap between frames
+    if (tx.edges[i].mark && (i == 0 || out.len[out.count - 1] == 0 ||
+                             rxEdgeUs(tx.edges[i], phase) - rxEdgeUs(tx.edges[i - 1], phase) >= RX_FRAME_GAP_US)) {
+      TEST_ASSERT_TRUE(out.count < MAX_FRAMES);
+      out.len[out.count++] = 0;
+    }
+    uint16_t& n = out.len[out.count - 1];
+    TEST_ASSERT_TRUE(n < MAX_TIMINGS);
+    out.timings[out.count - 1][n++] = d;
+  }
+}
+
+// ====== Decoder ======
+// IRremote's matching (matchTicks with TICKS_LOW/TICKS_HIGH): a measured mark is held
+// against the expected duration plus MARK_EXCESS_MICROS, a space against it minus that,
+// in whole ticks from 25% under to 25% over and a tick
+#define MARK_EXCESS_US 20
+#define TOLERANCE_PERCENT 25
+
+static bool matchUs(uint32_t measured, int32_t expected) {
+  uint32_t ticks = measured / RX_TICK_US;
+  uint32_t low = (uint32_t)expected * (100 - TOLERANCE_PERCENT) / (100 * RX_TICK_US);
+  uint32_t high = (uint32_t)expected * (100 + TOLERANCE_PERCENT) / (100 * RX_TICK_US) + 1;
+  return ticks >= low && ticks <= high;
+}
+static bool matchMark(uint32_t measured, uint16_t us) { return matchUs(measured, us + MARK_EXCESS_US); }
+static bool matchSpace(uint32_t measured, uint16_t us) { return matchUs(measured, us - MARK_EXCESS_US); }
+
+// IRremote's protocol constants (ir_NEC.hpp and friends), independent of PULSE_CODINGS
+struct PulseProtocol {
+  Proto proto;
+  uint16_t headerMark, headerSpace;
+  uint16_t oneMark, oneSpace, zeroMark, zeroSpace;
+  uint8_t bits;
+  bool msbFirst, stopBit;
+  uint16_t repeatSpace;   // Header space of the repeat code, 0 = none
+  uint8_t repeatBits;     // Zero bits in it
+  bool headerlessRepeat;  // Repeats are the data without the header
+};
+
+static const PulseProtocol PROTOCOLS[] = {
+  { Proto::NEC, 16 * 560, 8 * 560, 560, 3 * 560, 560, 560, 32, false, true, 4 * 560, 0, false },
+  { Proto::Panasonic, 8 * 432, 4 * 432, 432, 3 * 432, 432, 432, 48, false, true, 0, 0, false },
+  { Proto::Sony12, 4 * 600, 600, 2 * 600, 600, 600, 600, 12, false, false, 0, 0, false },
+  { Proto::LG, 18 * 500, 4200, 500, 1580, 500, 550, 28, true, true, 4 * 500, 0, false },
+  { Proto::JVC, 8400, 4200, 526, 3 * 526, 526, 526, 16, false, true, 0, 0, true },
+  { Proto::Samsung, 8 * 553, 8 * 553, 553, 3 * 553, 553, 553, 32, false, true, 8 * 553, 1, false },
+};
+
+struct Decoded {
+  Proto proto;
+  uint16_t addr;
+  uint16_t command;
+  bool repeat;
+};
+
+static uint16_t bitTimings(const PulseProtocol& p, uint8_t bits) {
+  return 2 * bits + (p.stopBit ? 1 : -1);
+}
+
+static bool pulseBits(const PulseProtocol& p, const uint16_t* d, uint8_t bits, uint64_t* data) {
+  *data = 0;
+  for (uint8_t i = 0; i < bits; i++) {
+    bool one;
+    bool last = i + 1 == bits && !p.stopBit;
+    if (p.oneMark != p.zeroMark) {  // Pulse width
+      if (matchMark(d[2 * i], p.oneMark)) one = true;
+      else if (matchMark(d[2 * i], p.zeroMark)) one = false;
+      else return false;
+      if (!last && !matchSpace(d[2 * i + 1], one ? p.oneSpace : p.zeroSpace)) return false;
+    } else {  // Pulse distance
+      if (!matchMark(d[2 * i], p.oneMark)) return false;
+      if (matchSpace(d[2 * i + 1], p.oneSpace)) one = true;
+      else if (matchSpace(d[2 * i + 1], p.zeroSpace)) one = false;
+      else return false;
+    }
+    if (one) *data |= 1ULL << (p.msbFirst ? bits - 1 - i : i);
+  }
+  return !p.stopBit || matchMark(d[2 * bits], p.oneMark);
+}
+
+// Address and command from the data word, as IRremote's decoders split it
+static bool unpack(Proto proto, uint64_t raw, Decoded* out) {
+  uint8_t b[6];
+  for (uint8_t i = 0; i < 6; i++) b[i] = raw >> (8 * i);
+  switch (proto) {
+    case Proto::NEC:
+    case Proto::Samsung:
+      if (b[3] != (uint8_t)~b[2]) return false;
+      out->command = b[2];
+      out->addr = raw & 0xFFFF;
+      // 8-bit addresses go out with their complement (NEC) or twice (Samsung)
+      if (b[1] == (proto == Proto::NEC ? (uint8_t)~b[0] : b[0])) out->addr = b[0];
+      return true;
+    case Proto::LG: {
+      uint16_t command = raw >> 4 & 0xFFFF;
+      uint8_t sum = (command & 0xF) + (command >> 4 & 0xF) + (command >> 8 & 0xF) + (command >> 12);
+      if ((sum & 0xF) != (raw & 0xF)) return false;
+      out->addr = raw >> 20 & 0xFF;
+      out->command = command;
+      return true;
+    }
+    case Proto::JVC:
+      out->addr = b[0];
+      out->command = b[1];
+      return true;
+    case Proto::Sony12:
+      out->addr = raw >> 7 & 0x1F;
+      out->command = raw & 0x7F;
+      return true;
+    case Proto::Panasonic: {
+      uint8_t parity = b[0] ^ b[1];
+      if ((raw & 0xFFFF) != 0x2002 || (raw >> 16 & 0xF) != ((parity ^ (parity >> 4)) & 0xF)) return false;
+      if (b[5] != (b[4] ^ b[2] ^ b[3])) return false;
+      out->addr = raw >> 20 & 0xFFF;
+      out->command = b[4];
+      return true;
+    }
+    default:
+      return false;
+  }
+}
+
+// Half bits of a Manchester frame from offset on, starting with a mark: each duration
+// one to maxUnits units. False on a duration that is no whole number of units.
+static bool halves(const uint16_t* d, uint16_t n, uint16_t unit, uint8_t maxUnits, bool* out, uint8_t* count, uint8_t cap) {
+  for (uint16_t i = 0; i < n; i++) {
+    bool mark = !(i & 1);
+    uint8_t k = 1;
+    while (k <= maxUnits && !(mark ? matchMark(d[i], k * unit) : matchSpace(d[i], k * unit))) k++;
+    if (k > maxUnits || *count + k > cap) return false;
+    while (k--) out[(*count)++] = mark;
+  }
+  return true;
+}
+
+// RC5: start bit, field bit (inverted command bit 6), toggle, 5 address and 6 command
+// bits, 1 = space then mark; the leading space is not seen
+static bool decodeRC5(const uint16_t* d, uint16_t n, Decoded* out) {
+  bool h[28];
+  uint8_t count = 1;
+  h[0] = false;
+  if (!halves(d, n, 889, 2, h, &count, 28) || count < 27) return false;
+  if (count == 27) h[count++] = false;  // A trailing 0 ends on a space
+  uint16_t data = 0;
+  for (uint8_t i = 0; i < 14; i++) {
+    if (h[2 * i] == h[2 * i + 1]) return false;
+    data = data << 1 | h[2 * i + 1];
+  }
+  if (!(data >> 13)) return false;
+  *out = { Proto::RC5, (uint16_t)(data >> 6 & 0x1F), (uint16_t)((data & 0x3F) | (data >> 12 & 1 ? 0 : 0x40)), false };
+  return true;
+}
+
+// RC6 mode 0: leader, start bit, 3 mode bits, double-width toggle, 8 address and 8
+// command bits, 1 = mark then space
+static bool decodeRC6(const uint16_t* d, uint16_t n, Decoded* out) {
+  if (n < 3 || !matchMark(d[0], 6 * 444) || !matchSpace(d[1], 2 * 444)) return false;
+  bool h[44];
+  uint8_t count = 0;
+  if (!halves(d + 2, n - 2, 444, 3, h, &count, 44) || count < 43) return false;
+  if (count == 43) h[count++] = false;
+  if (!h[0] || h[1] || h[8] != h[9] || h[10] != h[11] || h[8] == h[10]) return false;
+  uint32_t data = 0;
+  for (uint8_t i = 0; i < 3; i++) {
+    if (h[2 + 2 * i] == h[3 + 2 * i]) return false;
+  }
+  for (uint8_t i = 0; i < 16; i++) {
+    if (h[12 + 2 * i] == h[13 + 2 * i]) return false;
+    data = data << 1 | h[12 + 2 * i];
+  }
+  *out = { Proto::RC6, (uint16_t)(data >> 8), (uint16_t)(data & 0xFF), false };
+  return true;
+}
+
+// Decodes frames in order, like IrReceiver.decode(): repeat codes take the address and
+// command of the last frame of their protocol
+struct Decoder {
+  Decoded last;
+  bool haveLast;
+
+  bool decode(const uint16_t* d, uint16_t n, Decoded* out) {
+    for (const PulseProtocol& p : PROTOCOLS) {
+      uint64_t raw;
+      if (n == 2 + bitTimings(p, p.bits) && matchMark(d[0], p.headerMark) && matchSpace(d[1], p.headerSpace) &&
+          pulseBits(p, d + 2, p.bits, &raw) && unpack(p.proto, raw, out)) {
+        out->proto = p.proto;
+        out->repeat = false;
+        return remember(out);
+      }
+      if (p.repeatSpace && n == 2 + bitTimings(p, p.repeatBits) && matchMark(d[0], p.headerMark) &&
+          matchSpace(d[1], p.repeatSpace) && pulseBits(p, d + 2, p.repeatBits, &raw) && raw == 0 &&
+          haveLast && last.proto == p.proto) {
+        *out = last;
+        out->repeat = true;
+        return true;
+      }
+      if (p.headerlessRepeat && n == bitTimings(p, p.bits) && pulseBits(p, d, p.bits, &raw) && unpack(p.proto, raw, out)) {
+        out->proto = p.proto;
+        out->repeat = true;
+        return remember(out);
+      }
+    }
+    if (decodeRC5(d, n, out) || decodeRC6(d, n, out)) return remember(out);
+    return false;
+  }
+
+  bool remember(const Decoded* out) {
+    last = *out;
+    haveLast = true;
+    return true;
+  }
+};
+
+// ====== Round Trip ======
+#define RX_PHASES 5  // Sample phases tried per send, spread over a tick
+
+// Send a command, check every edge and every burst, and print the edge error
+static void roundTrip(const Command& c) {
+  static Timeline ideal, tx;
+  static Frames rx;
+  idealTimeline(c, ideal);
+  txTimeline(c, tx);
+  TEST_ASSERT_EQUAL_UINT16_MESSAGE(ideal.count, tx.count, c.name);
+
+  EdgeStats txStats = {}, rxStats = {};
+  for (uint16_t i = 0; i < tx.count; i++) {
+    TEST_ASSERT_TRUE_MESSAGE(tx.edges[i].mark == ideal.edges[i].mark, c.name);
+    txStats.add(tx.edges[i].mark, (int32_t)(tx.edges[i].us - ideal.edges[i].us));
+  }
+  TEST_ASSERT_LESS_OR_EQUAL_UINT32_MESSAGE(TX_EDGE_MAX_ERR_US, txStats.maxErr, c.name);
+
+  Send send(c);
+  uint16_t bursts = 0, recognized = 0;
+  for (uint8_t phase = 0; phase < RX_PHASES; phase++) {
+    uint32_t at = phase * RX_TICK_US / RX_PHASES;
+    for (uint16_t i = 0; i < tx.count; i++) {
+      rxStats.add(tx.edges[i].mark, (int32_t)(rxEdgeUs(tx.edges[i], at) - ideal.edges[i].us));
+    }
+
+    receive(tx, at, rx);
+    Decoder decoder = {};
+    bool repeatFrame = false;
+    uint32_t gap;
+    uint16_t b = 0;
+    do {
+      TEST_ASSERT_TRUE_MESSAGE(b < rx.count, c.name);
+      uint16_t len;
+      const uint16_t* sent = send.frame(repeatFrame, &len);
+      const uint16_t* got = rx.timings[b];
+      Decoded d;
+      bool decoded = decoder.decode(got, rx.len[b], &d);
+      if (c.isRaw) {
+        TEST_ASSERT_FALSE_MESSAGE(decoded, c.name);
+        TEST_ASSERT_EQUAL_UINT16_MESSAGE(len, rx.len[b], c.name);
+        for (uint16_t i = 0; i < len; i++) {
+          TEST_ASSERT_TRUE_MESSAGE(i & 1 ? matchSpace(got[i], sent[i]) : matchMark(got[i], sent[i]), c.name);
+        }
+        if (rawFingerprint(got, len) == rawFingerprint(sent, len)) recognized++;
+      } else {
+        TEST_ASSERT_TRUE_MESSAGE(decoded, c.name);
+        TEST_ASSERT_TRUE_MESSAGE(d.proto == c.proto && d.addr == c.addr && d.command == c.command, c.name);
+      }
+      b++;
+    } while (send.next(0, &gap, &repeatFrame));
+    TEST_ASSERT_EQUAL_UINT16_MESSAGE(b, rx.count, c.name);
+    send.run = send.taken = 0;
+    bursts += b;
+  }
+  TEST_ASSERT_LESS_OR_EQUAL_UINT32_MESSAGE(RX_EDGE_MAX_ERR_US, rxStats.maxErr, c.name);
+
+  char msg[224];
+  int pos = snprintf(msg, sizeof(msg),
+    "%s: %u bursts decoded, %u edges; tx max %lu us; rx mark bias %ld, space bias %ld, mean %lu, max %lu us",
+    c.name, bursts, tx.count, (unsigned long)txStats.maxErr, rxStats.bias(true), rxStats.bias(false),
+    (unsigned long)(rxStats.sumErr / rxStats.count()), (unsigned long)rxStats.maxErr);
+  if (c.isRaw) snprintf(msg + pos, sizeof(msg) - pos, "; fingerprint %u/%u", recognized, bursts);
+  TEST_MESSAGE(msg);
+}
+
+void test_commands_json() {
+  TEST_ASSERT_TRUE_MESSAGE(loadCommands(), "Cannot read " COMMANDS_JSON);
+  JsonDocument doc;
+  TEST_ASSERT_FALSE_MESSAGE(deserializeJson(doc, commandsText), "commands.json does not parse");
+  static Command c;
+  uint16_t commands = 0;
+  for (JsonPair entry : doc.as<JsonObject>()) {
+    parseCommand(entry.key().c_str(), entry.value(), c);
+    roundTrip(c);
+    commands++;
+  }
+  TEST_ASSERT_TRUE(commands > 0);
+}
+
+// Every protocol encoder, beyond the ones commands.json uses
+void test_protocols() {
+  const struct {
+    Proto proto;
+    uint16_t addr;
+  } sends[] = {
+    { Proto::NEC, 0x04 }, { Proto::NEC, 0x1234 }, { Proto::Samsung, 0x07 }, { Proto::LG, 0x88 },
+    { Proto::JVC, 0x07 }, { Proto::Sony12, 0x01 }, { Proto::RC5, 0x05 }, { Proto::RC6, 0x04 },
+    { Proto::Panasonic, 0x08 },
+  };
+  const uint8_t commands[] = { 0x00, 0x15, 0x2C, 0x55, 0x7F };
+  static Command c;
+  for (const auto& s : sends) {
+    for (uint8_t command : commands) {
+      memset(&c, 0, sizeof(c));
+      snprintf(c.name, sizeof(c.name), "proto%u_%x_%x", (unsigned)s.proto, s.addr, command);
+      c.proto = s.proto;
+      c.addr = s.addr;
+      c.command = command;
+      c.runs[c.runCount++] = { HOLD_GAP_US, HOLD_REPEATS, true };
+      roundTrip(c);
+    }
+  }
+}
+
+void setUp() {}
+void tearDown() {}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_commands_json);
+  RUN_TEST(test_protocols);
+  return UNITY_END();
+}
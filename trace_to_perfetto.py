@@ -0,0 +1,119 @@
+#!/usr/bin/env python3
+"""
+IR Blaster Trace Converter
+
+Converts a binary trace dump from the ESP32 (home/ir/1/trace/dump) into
+Chrome trace / Perfetto JSON, so burst spacing, queueing delay and network
+stalls can be inspected on a timeline (chrome://tracing or ui.perfetto.dev).
+
+Capture a dump:
+  mosquitto_sub -t 'home/ir/1/trace/dump' -N -W 5 > trace.bin &
+  mosquitto_pub -t 'home/ir/1/trace' -m 'dump'
+
+Convert:
+  python3 trace_to_perfetto.py trace.bin > trace.json
+"""
+
+import json
+import struct
+import sys
+
+CHUNK_MAGIC = b"IRTR"
+CHUNK_HEADER = struct.Struct("<4sBBHHH")  # magic, version, reserved, seq, total, count
+RECORD = struct.Struct("<IHH")            # timestamp_us, event, arg
+
+LOOP_STAGES = ["connect", "mqtt", "sync", "led", "learn", "receive", "bench", "fleet", "emit",
+               "transfer", "pipeline", "metrics"]
+
+# event id -> (name, phase); "B"/"E" open/close a slice on the same track, "i" is instant
+EVENTS = {
+    1: ("mqtt_rx", "i"),
+    2: ("send", "B"),
+    3: ("burst", "B"),
+    4: ("burst", "E"),
+    5: ("send", "E"),
+    6: ("learn_frame", "i"),
+    7: ("learn_captured", "i"),
+    8: ("publish", "B"),
+    9: ("publish", "E"),
+    10: ("mqtt_connected", "i"),
+    11: ("sync_ready", "i"),
+    12: ("loop_stall", "i"),
+    13: ("recognized", "i"),
+}
+
+# Track (tid) per event group so nested slices line up
+TRACKS = {"send": 1, "burst": 2, "publish": 3}
+
+
+def parse_chunks(data):
+    """Yield (seq, total, records) for every chunk in a concatenated dump"""
+    pos = 0
+    while pos + CHUNK_HEADER.size <= len(data):
+        if data[pos:pos + 4] != CHUNK_MAGIC:
+            # Skip stray bytes (e.g. newlines if -N was not used)
+            pos += 1
+            continue
+        magic, version, _, seq, total, count = CHUNK_HEADER.unpack_from(data, pos)
+        if version != 1:
+            raise ValueError(f"Unsupported trace format version {version}")
+        pos += CHUNK_HEADER.size
+        records = [RECORD.unpack_from(data, pos + i * RECORD.size) for i in range(count)]
+        pos += count * RECORD.size
+        yield seq, total, records
+
+
+def to_chrome_trace(records):
+    """Convert (timestamp_us, event, arg) records, oldest first, to trace events"""
+    events = []
+    last_raw = None
+    offset = 0
+    for raw_ts, event_id, arg in records:
+        # micros() wraps every ~71 minutes
+        if last_raw is not None and raw_ts < last_raw:
+            offset += 1 << 32
+        last_raw = raw_ts
+        ts = raw_ts + offset
+
+        name, phase = EVENTS.get(event_id, (f"event_{event_id}", "i"))
+        args = {"arg": arg}
+        if event_id == 12:
+            args = {"stage": LOOP_STAGES[arg] if arg < len(LOOP_STAGES) else arg}
+
+        entry = {"name": name, "ph": phase, "ts": ts, "pid": 1,
+                 "tid": TRACKS.get(name, 0), "args": args}
+        if phase == "i":
+            entry["s"] = "t"
+        events.append(entry)
+    return {"traceEvents": events, "displayTimeUnit": "ms"}
+
+
+def main():
+    if len(sys.argv) != 2:
+        print(__doc__)
+        return 1
+
+    with open(sys.argv[1], "rb") as f:
+        data = f.read()
+
+    chunks = {}
+    total = 0
+    for seq, chunk_total, records in parse_chunks(data):
+        chunks[seq] = records
+        total = chunk_total
+
+    if not chunks:
+        print("✗ No trace chunks found", file=sys.stderr)
+        return 1
+    missing = [seq for seq in range(total) if seq not in chunks]
+    if missing:
+        print(f"WARNING: missing chunks {missing}, timeline will have gaps", file=sys.stderr)
+
+    records = [rec for seq in sorted(chunks) for rec in chunks[seq]]
+    json.dump(to_chrome_trace(records), sys.stdout)
+    print(f"✓ Converted {len(records)} records from {len(chunks)}/{total} chunks", file=sys.stderr)
+    return 0
+
+
+if __name__ == "__main__":
+    exit(main())